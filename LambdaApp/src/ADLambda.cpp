@@ -7,10 +7,22 @@
 #include <iocsh.h>
 #include <vector>
 #include <math.h>
+#include <cmath>
 #include <string>
 #include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include <limits>
 #include <iostream>
 
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#endif
+
 #include <epicsTime.h>
 #include <epicsMutex.h>
 #include <epicsExit.h>
@@ -20,8 +32,534 @@
 #include <libxsp.h>
 
 
+static size_t elementSize(NDDataType_t type)
+{
+	switch (type)
+	{
+		case NDInt8:
+		case NDUInt8:
+			return 1;
+			
+		case NDInt16:
+		case NDUInt16:
+			return 2;
+			
+		case NDInt32:
+		case NDUInt32:
+		case NDFloat32:
+			return 4;
+			
+		default:
+			return 8;
+	}
+}
+
+/*
+ * Helpers to treat every lambda_input the same way, regardless of whether
+ * the frames come from a receiver, a post-decoder or a replayed recording.
+ */
+static bool nextFrame(lambda_input& input, int timeout, lambda_frame* output)
+{
+	return std::visit([&](auto&& arg) -> bool
+	{
+		auto frame = arg->frame(timeout);
+		
+		if (frame == nullptr || frame->data() == NULL)    { return false; }
+		
+		output->handle = frame;
+		output->data   = frame->data();
+		output->nr     = (int) frame->nr();
+		output->status = (int) frame->status();
+		return true;
+	}, input);
+}
+
+static void releaseFrame(lambda_input& input, const lambda_frame& frame)
+{
+	std::visit([&frame](auto&& arg)
+	{
+		typedef decltype(arg->frame(0)) frame_ptr;
+		arg->release((frame_ptr) frame.handle);
+	}, input);
+}
+
+static void inputPosition(const lambda_input& input, int* x, int* y)
+{
+	*x = 0;
+	*y = 0;
+	
+	if (auto receiver = std::get_if<std::shared_ptr<xsp::lambda::Receiver> >(&input))
+	{
+		xsp::Position modulepos = (*receiver)->position();
+		*x = (int) modulepos.x;
+		*y = (int) modulepos.y;
+	}
+	else if (auto replay = std::get_if<std::shared_ptr<LambdaReplayReceiver> >(&input))
+	{
+		*x = (*replay)->xPosition();
+		*y = (*replay)->yPosition();
+	}
+}
+
+/* Attribute names of the histogram bins, "LambdaHistogram<bin>" */
+static const char* const HISTOGRAM_ATTR_NAMES[NUM_HISTOGRAM_BINS] =
+{
+	"LambdaHistogram0",  "LambdaHistogram1",  "LambdaHistogram2",  "LambdaHistogram3",
+	"LambdaHistogram4",  "LambdaHistogram5",  "LambdaHistogram6",  "LambdaHistogram7",
+	"LambdaHistogram8",  "LambdaHistogram9",  "LambdaHistogram10", "LambdaHistogram11",
+	"LambdaHistogram12", "LambdaHistogram13", "LambdaHistogram14", "LambdaHistogram15"
+};
+
+/* Attributes that describe a single frame, a batch carries them per slice instead */
+static const char* const FRAME_ONLY_ATTR_NAMES[] =
+{
+	"LambdaFrameNumber", "LambdaFrameStatus", "LambdaTimeStamp", "LambdaTotalCounts",
+	"LambdaMaxPixel", "LambdaSaturatedPixels", "LambdaVetoTrigger", "LambdaModuleMissingMask"
+};
+
+/*
+ * Frames an xsp receiver or post-decoder buffers, from the
+ * frame-buffer-size entry of its item in the system file. 0 when the file
+ * doesn't say.
+ */
+static int configBufferFrames(const std::string& path, const std::string& id)
+{
+	FILE* fp = fopen(path.c_str(), "r");
+	
+	if (fp == NULL)    { return 0; }
+	
+	char line[512];
+	bool inside = false;
+	int output = 0;
+	
+	while (fgets(line, sizeof(line), fp) != NULL)
+	{
+		char* text = line + strspn(line, " \t");
+		
+		// "- " opens the next item of a list
+		if (text[0] == '-' && (text[1] == ' ' || text[1] == '\t'))
+		{
+			inside = false;
+			text += 1 + strspn(text + 1, " \t");
+		}
+		
+		char key[128], value[256];
+		
+		if (sscanf(text, "%127[^:#]: %255[^ \t\r\n#]", key, value) != 2)    { continue; }
+		
+		std::string item(value);
+		item.erase(std::remove(item.begin(), item.end(), '"'), item.end());
+		item.erase(std::remove(item.begin(), item.end(), '\''), item.end());
+		
+		if      (std::string(key) == "id")                          { inside = (item == id); }
+		else if (inside && std::string(key) == "frame-buffer-size")    { output = atoi(item.c_str()); }
+	}
+	
+	fclose(fp);
+	
+	return std::max(output, 0);
+}
+
+/*
+ * Thread placement helpers. Affinity, memory policy and scheduling are all
+ * applied by the thread to itself, so they only need the calling thread.
+ */
+#ifdef __linux__
+static bool parseCpuList(const std::string& cpulist, cpu_set_t* output)
+{
+	CPU_ZERO(output);
+	
+	size_t start = 0;
+	
+	while (start < cpulist.size())
+	{
+		size_t end = cpulist.find(',', start);
+		if (end == std::string::npos)    { end = cpulist.size(); }
+		
+		std::string range = cpulist.substr(start, end - start);
+		start = end + 1;
+		
+		if (range.empty())    { continue; }
+		
+		int first, last;
+		
+		if      (sscanf(range.c_str(), "%d-%d", &first, &last) == 2)    {}
+		else if (sscanf(range.c_str(), "%d", &first) == 1)              { last = first; }
+		else                                                            { return false; }
+		
+		for (int cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu += 1)    { CPU_SET(cpu, output); }
+	}
+	
+	return CPU_COUNT(output) > 0;
+}
+
+static std::string formatCpuList(const cpu_set_t* cpus)
+{
+	std::string output;
+	
+	for (int cpu = 0; cpu < CPU_SETSIZE; cpu += 1)
+	{
+		if (! CPU_ISSET(cpu, cpus))    { continue; }
+		
+		int last = cpu;
+		while (last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, cpus))    { last += 1; }
+		
+		if (! output.empty())    { output += ","; }
+		
+		output += std::to_string(cpu);
+		if (last > cpu)    { output += "-" + std::to_string(last); }
+		
+		cpu = last;
+	}
+	
+	return output;
+}
+#endif
+
+static std::string placeThread(const thread_placement& setting)
+{
+	#ifdef __linux__
+	std::string notes;
+	std::string cpulist = setting.cpus;
+	
+	// A NUMA node on its own pins the thread to all of that node's CPUs
+	if (cpulist.empty() && setting.numa_node >= 0)
+	{
+		std::string path = "/sys/devices/system/node/node" + std::to_string(setting.numa_node) + "/cpulist";
+		FILE* fp = fopen(path.c_str(), "r");
+		
+		if (fp)
+		{
+			char buffer[256] = "";
+			if (fgets(buffer, sizeof(buffer), fp))    { cpulist = buffer; }
+			fclose(fp);
+			
+			cpulist.erase(std::remove(cpulist.begin(), cpulist.end(), '\n'), cpulist.end());
+		}
+	}
+	
+	cpu_set_t cpus;
+	
+	if (! cpulist.empty())
+	{
+		if (! parseCpuList(cpulist, &cpus))                                          { notes += " (bad cpu list)"; }
+		else if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0)   { notes += " (affinity denied)"; }
+	}
+	
+	// Preferred rather than bound, so allocations still succeed when the node is full
+	if (setting.numa_node >= 0)
+	{
+		const size_t word_bits = sizeof(unsigned long) * 8;
+		std::vector<unsigned long> nodemask(setting.numa_node / word_bits + 1, 0);
+		
+		nodemask[setting.numa_node / word_bits] |= 1ul << (setting.numa_node % word_bits);
+		
+		if (syscall(SYS_set_mempolicy, MPOL_PREFERRED, nodemask.data(), nodemask.size() * word_bits + 1) != 0)    { notes += " (mempolicy denied)"; }
+	}
+	
+	if (setting.priority > 0)
+	{
+		sched_param param;
+		param.sched_priority = setting.priority;
+		
+		if (pthread_setschedparam(pthread_self(), SCHED_FIFO, &param) != 0)    { notes += " (SCHED_FIFO denied)"; }
+	}
+	
+	int policy;
+	sched_param param;
+	
+	pthread_getaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+	pthread_getschedparam(pthread_self(), &policy, &param);
+	
+	std::string output = "cpus=" + formatCpuList(&cpus);
+	
+	output += " numa=" + ((setting.numa_node >= 0) ? std::to_string(setting.numa_node) : std::string("any"));
+	output += " sched=" + std::string((policy == SCHED_FIFO) ? "FIFO/" + std::to_string(param.sched_priority) : "OTHER");
+	
+	return output + notes;
+	#else
+	return "placement not supported";
+	#endif
+}
+
+/*
+ * Pixel copy used by the stitcher. With statistics enabled the reductions
+ * are folded into the copy loop, so they come from data that is already
+ * being streamed through the cache rather than a second pass over the frame.
+ */
+template <typename T>
+static void copyWithStats(char* out, const char* in, size_t count, int depth, frame_stats* stats)
+{
+	const T* source = (const T*) in;
+	T* dest = (T*) out;
+	
+	const epicsUInt32 saturation = (depth >= 32) ? 0xFFFFFFFF : (epicsUInt32) ((1ull << depth) - 1);
+	const int shift = std::max(depth - HISTOGRAM_BITS, 0);
+	
+	epicsUInt64 total = 0;
+	epicsUInt32 maximum = stats->maximum;
+	epicsUInt32 saturated = 0;
+	
+	for (size_t index = 0; index < count; index += 1)
+	{
+		const epicsUInt32 value = source[index];
+		
+		dest[index] = source[index];
+		
+		total += value;
+		maximum = std::max(maximum, value);
+		saturated += (value >= saturation);
+		
+		stats->histogram[std::min(value >> shift, (epicsUInt32) (NUM_HISTOGRAM_BINS - 1))] += 1;
+	}
+	
+	stats->total += total;
+	stats->maximum = maximum;
+	stats->saturated += saturated;
+}
+
+static void copyPixels(char* out, const char* in, size_t count, int bytesPerElement, int depth, frame_stats* stats)
+{
+	if      (stats == NULL)            { std::memcpy(out, in, count * bytesPerElement); }
+	else if (bytesPerElement == 1)     { copyWithStats<epicsUInt8>(out, in, count, depth, stats); }
+	else if (bytesPerElement == 2)     { copyWithStats<epicsUInt16>(out, in, count, depth, stats); }
+	else if (bytesPerElement == 4)     { copyWithStats<epicsUInt32>(out, in, count, depth, stats); }
+	else                               { std::memcpy(out, in, count * bytesPerElement); }
+}
+
+/*
+ * Adds weighted shares of source pixels onto their destinations for the
+ * split pixels of a remap table. The shares are whole counts that add up
+ * to the source value. Each source pixel is counted in the statistics
+ * once, on its first op.
+ */
+template <typename T>
+static void spreadPixels(char* out, const char* in, const std::vector<lambda_spread_op>& spreads, int depth, frame_stats* stats)
+{
+	const T* source = (const T*) in;
+	T* dest = (T*) out;
+	
+	const epicsUInt32 saturation = (depth >= 32) ? 0xFFFFFFFF : (epicsUInt32) ((1ull << depth) - 1);
+	const int shift = std::max(depth - HISTOGRAM_BITS, 0);
+	
+	uint32_t given = 0;
+	
+	for (const auto& op : spreads)
+	{
+		const epicsUInt32 value = source[op.src];
+		
+		dest[op.dst] += (T) lambdaSpreadShare(op, value, &given);
+		
+		if (stats != NULL && op.first)
+		{
+			stats->total += value;
+			stats->maximum = std::max(stats->maximum, value);
+			stats->saturated += (value >= saturation);
+			stats->histogram[std::min(value >> shift, (epicsUInt32) (NUM_HISTOGRAM_BINS - 1))] += 1;
+		}
+	}
+}
+
+static void remapPixels(char* out, const char* in, const lambda_module_map& remap, int bytesPerElement, int depth, frame_stats* stats)
+{
+	for (const auto& run : remap.runs)
+	{
+		copyPixels(&out[(size_t) run.dst * bytesPerElement], &in[(size_t) run.src * bytesPerElement], run.length, bytesPerElement, depth, stats);
+	}
+	
+	if      (bytesPerElement == 1)    { spreadPixels<epicsUInt8>(out, in, remap.spreads, depth, stats); }
+	else if (bytesPerElement == 2)    { spreadPixels<epicsUInt16>(out, in, remap.spreads, depth, stats); }
+	else if (bytesPerElement == 4)    { spreadPixels<epicsUInt32>(out, in, remap.spreads, depth, stats); }
+}
+
+/*
+ * Adds a frame onto a phase accumulator, saturating rather than wrapping
+ */
+template <typename T>
+static void addPixels(epicsUInt32* sums, const T* in, size_t count)
+{
+	for (size_t pixel = 0; pixel < count; pixel += 1)
+	{
+		epicsUInt64 value = (epicsUInt64) sums[pixel] + in[pixel];
+		
+		sums[pixel] = (value > 0xFFFFFFFFull) ? 0xFFFFFFFFu : (epicsUInt32) value;
+	}
+}
+
+/*
+ * Sums factor x factor blocks of pixels into one, saturating at the type's
+ * maximum. Partial blocks at the right and bottom edges are left out.
+ */
+template <typename T>
+static void binPixels(T* out, const T* in, size_t width, size_t height, int factor)
+{
+	size_t out_width = width / factor;
+	size_t out_height = height / factor;
+	
+	const epicsUInt64 limit = std::numeric_limits<T>::max();
+	
+	for (size_t out_row = 0; out_row < out_height; out_row += 1)
+	{
+		for (size_t out_col = 0; out_col < out_width; out_col += 1)
+		{
+			epicsUInt64 sum = 0;
+			
+			for (int row = 0; row < factor; row += 1)
+			{
+				const T* line = &in[(out_row * factor + row) * width + out_col * factor];
+				
+				for (int col = 0; col < factor; col += 1)    { sum += line[col]; }
+			}
+			
+			out[out_row * out_width + out_col] = (T) std::min(sum, limit);
+		}
+	}
+}
+
+/*
+ * Veto measurements for the part of the ROI one module image covers, with
+ * the image placed at (x, y) in the stitched frame
+ */
+template <typename T>
+static void measureRect(const char* in, int frame_width, int frame_height, int x, int y, const veto_roi& roi, veto_measure* output)
+{
+	const T* source = (const T*) in;
+	
+	const int row_start = std::max(0, roi.y - y);
+	const int row_end   = std::min(frame_height, roi.y + roi.height - y);
+	const int col_start = std::max(0, roi.x - x);
+	const int col_end   = std::min(frame_width, roi.x + roi.width - x);
+	
+	epicsUInt64 sum = 0;
+	epicsUInt32 above = 0;
+	
+	for (int row = row_start; row < row_end; row += 1)
+	{
+		const T* line = &source[(size_t) row * frame_width];
+		
+		for (int col = col_start; col < col_end; col += 1)
+		{
+			const epicsUInt32 value = line[col];
+			
+			sum += value;
+			above += (value >= roi.level);
+		}
+	}
+	
+	output->sum += sum;
+	output->above += above;
+}
+
+/*
+ * The same through a remap table. Run pixels are measured where they land,
+ * split pixels at their first destination. Remapped output starts
+ * row_offset rows into the stitched frame.
+ */
+template <typename T>
+static void measureRemapped(const char* in, const lambda_module_map& remap, int width, int row_offset, const veto_roi& roi, veto_measure* output)
+{
+	const T* source = (const T*) in;
+	
+	for (const auto& run : remap.runs)
+	{
+		uint32_t done = 0;
+		
+		// A run can carry on past the end of a row
+		while (done < run.length)
+		{
+			const uint32_t dst = run.dst + done;
+			const int row = (int) (dst / width) + row_offset;
+			const int col = (int) (dst % width);
+			const uint32_t length = std::min(run.length - done, (uint32_t) (width - col));
+			
+			if (row >= roi.y && row < roi.y + roi.height)
+			{
+				const int col_start = std::max(col, roi.x);
+				const int col_end   = std::min(col + (int) length, roi.x + roi.width);
+				
+				for (int out_col = col_start; out_col < col_end; out_col += 1)
+				{
+					const epicsUInt32 value = source[run.src + done + (out_col - col)];
+					
+					output->sum += value;
+					output->above += (value >= roi.level);
+				}
+			}
+			
+			done += length;
+		}
+	}
+	
+	for (const auto& op : remap.spreads)
+	{
+		if (! op.first)    { continue; }
+		
+		const int row = (int) (op.dst / width) + row_offset;
+		const int col = (int) (op.dst % width);
+		
+		if (row < roi.y || row >= roi.y + roi.height || col < roi.x || col >= roi.x + roi.width)    { continue; }
+		
+		const epicsUInt32 value = source[op.src];
+		
+		output->sum += value;
+		output->above += (value >= roi.level);
+	}
+}
+
+static void measureModule(const char* in, int bytesPerElement, const lambda_module_map* remap, int frame_width, int frame_height, 
+                          int width, int x, int y, const veto_roi& roi, veto_measure* output)
+{
+	if (remap)
+	{
+		if      (bytesPerElement == 1)    { measureRemapped<epicsUInt8>(in, *remap, width, y, roi, output); }
+		else if (bytesPerElement == 2)    { measureRemapped<epicsUInt16>(in, *remap, width, y, roi, output); }
+		else if (bytesPerElement == 4)    { measureRemapped<epicsUInt32>(in, *remap, width, y, roi, output); }
+	}
+	else
+	{
+		if      (bytesPerElement == 1)    { measureRect<epicsUInt8>(in, frame_width, frame_height, x, y, roi, output); }
+		else if (bytesPerElement == 2)    { measureRect<epicsUInt16>(in, frame_width, frame_height, x, y, roi, output); }
+		else if (bytesPerElement == 4)    { measureRect<epicsUInt32>(in, frame_width, frame_height, x, y, roi, output); }
+	}
+}
+
+static void mergeStats(frame_stats* output, const frame_stats& input)
+{
+	output->total += input.total;
+	output->maximum = std::max(output->maximum, input.maximum);
+	output->saturated += input.saturated;
+	
+	for (int bin = 0; bin < NUM_HISTOGRAM_BINS; bin += 1)    { output->histogram[bin] += input.histogram[bin]; }
+}
+
+/*
+ * Copies a finished frame and its description into the shared memory ring
+ */
+static void publishShm(LambdaShmRing* ring, NDArray* frame, size_t bytes, bool lossless, double timeout)
+{
+	lambda_shm_slot meta;
+	
+	meta.frame_id     = (uint64_t) frame->uniqueId;
+	meta.timestamp_ns = (uint64_t) frame->epicsTS.secPastEpoch * 1000000000ull + frame->epicsTS.nsec;
+	meta.data_bytes   = bytes;
+	meta.data_type    = (uint32_t) frame->dataType;
+	meta.ndims        = (uint32_t) std::min(frame->ndims, LAMBDA_SHM_MAX_DIMS);
+	meta.flags        = 0;
+	
+	if (frame->pAttributeList->find("LambdaModuleMissingMask") != NULL)    { meta.flags |= LAMBDA_SHM_PARTIAL; }
+	if (! frame->codec.name.empty())                                     { meta.flags |= LAMBDA_SHM_PACKED; }
+	
+	for (int dim = 0; dim < LAMBDA_SHM_MAX_DIMS; dim += 1)    { meta.dims[dim] = (dim < (int) meta.ndims) ? (uint32_t) frame->dims[dim].size : 0; }
+	
+	std::memset(meta.codec, 0, sizeof(meta.codec));
+	std::strncpy(meta.codec, frame->codec.name.c_str(), sizeof(meta.codec) - 1);
+	
+	ring->publish(meta, frame->pData, lossless, timeout);
+}
+
 static void acquire_thread_callback(void *drvPvt)    { ((ADLambda*) drvPvt)->waitAcquireThread(); }
-static void export_thread_callback(void *drvPvt)     { ((ADLambda*) drvPvt)->exportThread(); }
+
+static void preview_thread_callback(void *drvPvt)    { ((ADLambda*) drvPvt)->previewThread(); }
 
 static void receiver_acquire_callback(void *drvPvt)
 {
@@ -32,6 +570,15 @@ static void receiver_acquire_callback(void *drvPvt)
 	delete data;
 }
 
+static void export_thread_callback(void *drvPvt)
+{
+	export_data* data = (export_data*) drvPvt;
+	
+	data->driver->exportThread(data->shard);
+	
+	delete data;
+}
+
 void ADLambda::spawnAcquireThread(int receiver)
 {
 	this->incrementValue(LAMBDA_ReadoutThreads);
@@ -49,16 +596,44 @@ void ADLambda::spawnAcquireThread(int receiver)
               data);
 }
 
+void ADLambda::spawnExportThread(int shard)
+{
+	export_data* data = new export_data;
+
+	data->driver = this;
+	data->shard = shard;
+
+	epicsThreadCreate("ADLambda::exportThread()",
+	                  epicsThreadPriorityMedium,
+	                  epicsThreadGetStackSize(epicsThreadStackMedium),
+	                  (EPICSTHREADFUNC)::export_thread_callback,
+	                  data);
+}
+
 extern "C" 
 {
 	/** Configuration command for Lambda driver; creates a new ADLambda object.
 	 * \param[in] portName The name of the asyn port driver to be created.
 	 * \param[in] configPath path to the config files.
 	 * \param[in] numModules Number of image module in the camera
+	 * \param[in] numExports Number of asyn addresses (and export threads) frames can be sharded across
+	 */
+	void LambdaConfig(const char *portName, const char* configPath, int numModules, int fake, int numExports) 
+	{
+		new ADLambda(portName, configPath, numModules, fake, numExports);
+	}
+	
+	/** Configuration command for a Lambda driver that replays a raw recording instead of
+	 * connecting to a detector.
+	 * \param[in] portName The name of the asyn port driver to be created.
+	 * \param[in] recording Path of the recording, without the "_m<n>.raw" suffix.
+	 * \param[in] numModules Number of receivers that were recorded
+	 * \param[in] realtime Replay at the recorded frame timing (1) or as fast as possible (0)
+	 * \param[in] numExports Number of asyn addresses (and export threads) frames can be sharded across
 	 */
-	void LambdaConfig(const char *portName, const char* configPath, int numModules, int fake) 
+	void LambdaReplayConfig(const char *portName, const char* recording, int numModules, int realtime, int numExports)
 	{
-		new ADLambda(portName, configPath, numModules, fake);
+		new ADLambda(portName, recording, numModules, 0, numExports, realtime ? REPLAY_REALTIME : REPLAY_FAST);
 	}
 
 }
@@ -70,16 +645,19 @@ const char *ADLambda::driverName = "Lambda";
  * \param[in] portName The name of the asyn port driver to be created.
  * \param[in] configPath directory containing configuration file location
  * \param[in] numModules The number of individual camera modules the system contains
+ * \param[in] fake Skip copying frame data into the NDArrays
+ * \param[in] numExports Number of export threads, each one calls back on its own address
+ * \param[in] replay Read frames from a raw recording at configPath instead of a detector
  *
  */
-ADLambda::ADLambda(const char *portName, const char *configPath, int numModules, int fake) :
+ADLambda::ADLambda(const char *portName, const char *configPath, int numModules, int fake, int numExports, int replay) :
 	ADDriver(portName, 
-	         numModules,
+	         std::max(numModules, numExports + 1),
 			 0,
 	         0, 
 	         0, 
-	         asynEnumMask, 
-	         asynEnumMask, 
+	         asynEnumMask | asynInt32ArrayMask | asynFloat64ArrayMask, 
+	         asynEnumMask | asynInt32ArrayMask | asynFloat64ArrayMask, 
 	         ASYN_CANBLOCK, 
 	         1, 
 	         0, 
@@ -89,7 +667,13 @@ configFileName(configPath)
 	this->startAcquireEvent = new epicsEvent();
 	this->stopAcquireEvent = new epicsEvent();
 	this->dequeLock = new epicsMutex();
+	this->phaseLock = new epicsMutex();
 	this->fake = fake;
+	this->replay = replay;
+	this->numModules = numModules;
+	this->numExports = std::max(numExports, 1);
+	
+	this->export_queues.resize(this->numExports);
 
 	this->threadFinishEvents = (epicsEvent**) calloc(numModules, sizeof(epicsEvent*));
 	
@@ -105,9 +689,15 @@ configFileName(configPath)
 	 */
 	 
 	createParam( LAMBDA_ConfigFilePathString,    asynParamOctet,   &LAMBDA_ConfigFilePath);
+	createParam( LAMBDA_GeometryFileString,      asynParamOctet,   &LAMBDA_GeometryFile);
+	createParam( LAMBDA_ShmNameString,           asynParamOctet,   &LAMBDA_ShmName);
+	createParam( LAMBDA_XpcsMaskFileString,      asynParamOctet,   &LAMBDA_XpcsMaskFile);
 	
 	setStringParam(ADManufacturer, "X-Spectrum GmbH");
 	setStringParam(LAMBDA_ConfigFilePath, configPath);
+	setStringParam(LAMBDA_GeometryFile, "");
+	setStringParam(LAMBDA_ShmName, (std::string("/") + portName).c_str());
+	setStringParam(LAMBDA_XpcsMaskFile, "");
 	
 	// Write version to appropriate parameter
 	setStringParam(NDDriverVersion, GIT_VERSION);
@@ -123,6 +713,40 @@ configFileName(configPath)
 	setDoubleParam(LAMBDA_EnergyThreshold, 40.0);
 	setDoubleParam(LAMBDA_DualThreshold, 40.0);
 	
+	createParam( LAMBDA_RecordBandwidthString,   asynParamFloat64, &LAMBDA_RecordBandwidth);
+	createParam( LAMBDA_QueueFillString,         asynParamFloat64, &LAMBDA_QueueFill);
+	createParam( LAMBDA_TimeToOverflowString,    asynParamFloat64, &LAMBDA_TimeToOverflow);
+	createParam( LAMBDA_StatsPeriodString,       asynParamFloat64, &LAMBDA_StatsPeriod);
+	createParam( LAMBDA_StatsTotalString,        asynParamFloat64, &LAMBDA_StatsTotal);
+	createParam( LAMBDA_StaleAgeString,          asynParamFloat64, &LAMBDA_StaleAge);
+	createParam( LAMBDA_ScanSetupTimeString,     asynParamFloat64, &LAMBDA_ScanSetupTime);
+	createParam( LAMBDA_ShmTimeoutString,        asynParamFloat64, &LAMBDA_ShmTimeout);
+	createParam( LAMBDA_XpcsPeriodString,        asynParamFloat64, &LAMBDA_XpcsPeriod);
+	createParam( LAMBDA_ReorderTimeoutString,    asynParamFloat64, &LAMBDA_ReorderTimeout);
+	createParam( LAMBDA_PreviewRateString,       asynParamFloat64, &LAMBDA_PreviewRate);
+	createParam( LAMBDA_VetoLowString,           asynParamFloat64, &LAMBDA_VetoLow);
+	createParam( LAMBDA_VetoHighString,          asynParamFloat64, &LAMBDA_VetoHigh);
+	createParam( LAMBDA_BatchTimeoutString,      asynParamFloat64, &LAMBDA_BatchTimeout);
+	
+	setDoubleParam(LAMBDA_StatsPeriod, 0.2);
+	setDoubleParam(LAMBDA_StatsTotal, 0.0);
+	setDoubleParam(LAMBDA_StaleAge, 0.0);
+	setDoubleParam(LAMBDA_ScanSetupTime, 0.0);
+	setDoubleParam(LAMBDA_ShmTimeout, 1.0);
+	setDoubleParam(LAMBDA_XpcsPeriod, 1.0);
+	setDoubleParam(LAMBDA_ReorderTimeout, 0.1);
+	setDoubleParam(LAMBDA_PreviewRate, 5.0);
+	setDoubleParam(LAMBDA_VetoLow, 0.0);
+	setDoubleParam(LAMBDA_VetoHigh, 0.0);
+	setDoubleParam(LAMBDA_BatchTimeout, 1.0);
+	
+	for (int index = 0; index < numModules; index += 1)
+	{
+		setDoubleParam(index, LAMBDA_RecordBandwidth, 0.0);
+		setDoubleParam(index, LAMBDA_QueueFill, 0.0);
+		setDoubleParam(index, LAMBDA_TimeToOverflow, -1.0);
+	}
+	
 	
 	/* **************
 	 * INTEGER PARAMS
@@ -140,6 +764,95 @@ configFileName(configPath)
 	createParam( LAMBDA_ReadoutThreadsString,    asynParamInt32,   &LAMBDA_ReadoutThreads);
 	createParam( LAMBDA_StitchWidthString,       asynParamInt32,   &LAMBDA_StitchedWidth);
 	createParam( LAMBDA_StitchHeightString,      asynParamInt32,   &LAMBDA_StitchedHeight);
+	createParam( LAMBDA_RecordEnableString,      asynParamInt32,   &LAMBDA_RecordEnable);
+	createParam( LAMBDA_RecordLiveEveryString,   asynParamInt32,   &LAMBDA_RecordLiveEvery);
+	createParam( LAMBDA_RecordFramesString,      asynParamInt32,   &LAMBDA_RecordFrames);
+	createParam( LAMBDA_ExportModeString,        asynParamInt32,   &LAMBDA_ExportMode);
+	createParam( LAMBDA_ExportShardsString,      asynParamInt32,   &LAMBDA_ExportShards);
+	createParam( LAMBDA_QueueHighWaterString,    asynParamInt32,   &LAMBDA_QueueHighWater);
+	createParam( LAMBDA_QueueCapacityString,     asynParamInt32,   &LAMBDA_QueueCapacity);
+	createParam( LAMBDA_ModuleBadFramesString,   asynParamInt32,   &LAMBDA_ModuleBadFrames);
+	createParam( LAMBDA_StatsEnableString,       asynParamInt32,   &LAMBDA_StatsEnable);
+	createParam( LAMBDA_AttributeTemplateString, asynParamInt32,   &LAMBDA_AttributeTemplate);
+	createParam( LAMBDA_StatsMaxString,          asynParamInt32,   &LAMBDA_StatsMax);
+	createParam( LAMBDA_StatsSaturatedString,    asynParamInt32,   &LAMBDA_StatsSaturated);
+	createParam( LAMBDA_PackedOutputString,      asynParamInt32,   &LAMBDA_PackedOutput);
+	createParam( LAMBDA_StaleModeString,         asynParamInt32,   &LAMBDA_StaleMode);
+	createParam( LAMBDA_StaleDistanceString,     asynParamInt32,   &LAMBDA_StaleDistance);
+	createParam( LAMBDA_StaleFramesString,       asynParamInt32,   &LAMBDA_StaleFrames);
+	createParam( LAMBDA_LateFramesString,        asynParamInt32,   &LAMBDA_LateFrames);
+	createParam( LAMBDA_PendingFramesString,     asynParamInt32,   &LAMBDA_PendingFrames);
+	createParam( LAMBDA_ModuleMissingString,     asynParamInt32,   &LAMBDA_ModuleMissing);
+	createParam( LAMBDA_ScanEnableString,        asynParamInt32,   &LAMBDA_ScanEnable);
+	createParam( LAMBDA_ScanPointsString,        asynParamInt32,   &LAMBDA_ScanPoints);
+	createParam( LAMBDA_ScanPointString,         asynParamInt32,   &LAMBDA_ScanPoint);
+	createParam( LAMBDA_GeometryEnableString,    asynParamInt32,   &LAMBDA_GeometryEnable);
+	createParam( LAMBDA_GeometryRunsString,      asynParamInt32,   &LAMBDA_GeometryRuns);
+	createParam( LAMBDA_GeometrySpreadsString,   asynParamInt32,   &LAMBDA_GeometrySpreads);
+	createParam( LAMBDA_ShmEnableString,         asynParamInt32,   &LAMBDA_ShmEnable);
+	createParam( LAMBDA_ShmSlotsString,          asynParamInt32,   &LAMBDA_ShmSlots);
+	createParam( LAMBDA_ShmModeString,           asynParamInt32,   &LAMBDA_ShmMode);
+	createParam( LAMBDA_ShmPublishedString,      asynParamInt32,   &LAMBDA_ShmPublished);
+	createParam( LAMBDA_ShmOverrunsString,       asynParamInt32,   &LAMBDA_ShmOverruns);
+	createParam( LAMBDA_ShmReadersString,        asynParamInt32,   &LAMBDA_ShmReaders);
+	createParam( LAMBDA_ShmOversizedString,      asynParamInt32,   &LAMBDA_ShmOversized);
+	createParam( LAMBDA_PhaseEnableString,       asynParamInt32,   &LAMBDA_PhaseEnable);
+	createParam( LAMBDA_PhaseBinsString,         asynParamInt32,   &LAMBDA_PhaseBins);
+	createParam( LAMBDA_PhaseCyclesString,       asynParamInt32,   &LAMBDA_PhaseCycles);
+	createParam( LAMBDA_PhaseBlocksString,       asynParamInt32,   &LAMBDA_PhaseBlocks);
+	createParam( LAMBDA_PhaseLateString,         asynParamInt32,   &LAMBDA_PhaseLate);
+	createParam( LAMBDA_XpcsEnableString,        asynParamInt32,   &LAMBDA_XpcsEnable);
+	createParam( LAMBDA_XpcsChannelsString,      asynParamInt32,   &LAMBDA_XpcsChannels);
+	createParam( LAMBDA_XpcsLevelsString,        asynParamInt32,   &LAMBDA_XpcsLevels);
+	createParam( LAMBDA_XpcsWorkersString,       asynParamInt32,   &LAMBDA_XpcsWorkers);
+	createParam( LAMBDA_XpcsExportString,        asynParamInt32,   &LAMBDA_XpcsExport);
+	createParam( LAMBDA_XpcsRingString,          asynParamInt32,   &LAMBDA_XpcsRing);
+	createParam( LAMBDA_XpcsRingsString,         asynParamInt32,   &LAMBDA_XpcsRings);
+	createParam( LAMBDA_XpcsPixelsString,        asynParamInt32,   &LAMBDA_XpcsPixels);
+	createParam( LAMBDA_XpcsFramesString,        asynParamInt32,   &LAMBDA_XpcsFrames);
+	createParam( LAMBDA_XpcsDroppedString,       asynParamInt32,   &LAMBDA_XpcsDropped);
+	createParam( LAMBDA_XpcsMissingString,       asynParamInt32,   &LAMBDA_XpcsMissing);
+	createParam( LAMBDA_ReorderEnableString,     asynParamInt32,   &LAMBDA_ReorderEnable);
+	createParam( LAMBDA_ReorderWindowString,     asynParamInt32,   &LAMBDA_ReorderWindow);
+	createParam( LAMBDA_ReorderDepthString,      asynParamInt32,   &LAMBDA_ReorderDepth);
+	createParam( LAMBDA_ReorderSkippedString,    asynParamInt32,   &LAMBDA_ReorderSkipped);
+	createParam( LAMBDA_ReorderLateString,       asynParamInt32,   &LAMBDA_ReorderLate);
+	createParam( LAMBDA_ReorderDuplicatesString, asynParamInt32,   &LAMBDA_ReorderDuplicates);
+	createParam( LAMBDA_PreviewEnableString,     asynParamInt32,   &LAMBDA_PreviewEnable);
+	createParam( LAMBDA_PreviewModeString,       asynParamInt32,   &LAMBDA_PreviewMode);
+	createParam( LAMBDA_PreviewEveryString,      asynParamInt32,   &LAMBDA_PreviewEvery);
+	createParam( LAMBDA_PreviewBinningString,    asynParamInt32,   &LAMBDA_PreviewBinning);
+	createParam( LAMBDA_PreviewFramesString,     asynParamInt32,   &LAMBDA_PreviewFrames);
+	createParam( LAMBDA_VetoModeString,          asynParamInt32,   &LAMBDA_VetoMode);
+	createParam( LAMBDA_VetoMinXString,          asynParamInt32,   &LAMBDA_VetoMinX);
+	createParam( LAMBDA_VetoMinYString,          asynParamInt32,   &LAMBDA_VetoMinY);
+	createParam( LAMBDA_VetoSizeXString,         asynParamInt32,   &LAMBDA_VetoSizeX);
+	createParam( LAMBDA_VetoSizeYString,         asynParamInt32,   &LAMBDA_VetoSizeY);
+	createParam( LAMBDA_VetoPixelLevelString,    asynParamInt32,   &LAMBDA_VetoPixelLevel);
+	createParam( LAMBDA_VetoPreFramesString,     asynParamInt32,   &LAMBDA_VetoPreFrames);
+	createParam( LAMBDA_VetoPostFramesString,    asynParamInt32,   &LAMBDA_VetoPostFrames);
+	createParam( LAMBDA_VetoAcceptedString,      asynParamInt32,   &LAMBDA_VetoAccepted);
+	createParam( LAMBDA_VetoRetainedString,      asynParamInt32,   &LAMBDA_VetoRetained);
+	createParam( LAMBDA_VetoRejectedString,      asynParamInt32,   &LAMBDA_VetoRejected);
+	createParam( LAMBDA_BatchEnableString,       asynParamInt32,   &LAMBDA_BatchEnable);
+	createParam( LAMBDA_BatchSizeString,         asynParamInt32,   &LAMBDA_BatchSize);
+	createParam( LAMBDA_BatchArraysString,       asynParamInt32,   &LAMBDA_BatchArrays);
+	
+	/* ************
+	 * ARRAY PARAMS
+	 * ************
+	 */
+	
+	createParam( LAMBDA_BadFrameCausesString,    asynParamInt32Array, &LAMBDA_BadFrameCauses);
+	createParam( LAMBDA_StatsHistogramString,    asynParamInt32Array, &LAMBDA_StatsHistogram);
+	createParam( LAMBDA_ScanThresholdsString,    asynParamFloat64Array, &LAMBDA_ScanThresholds);
+	createParam( LAMBDA_XpcsTauString,           asynParamFloat64Array, &LAMBDA_XpcsTau);
+	createParam( LAMBDA_XpcsG2String,            asynParamFloat64Array, &LAMBDA_XpcsG2);
+	createParam( LAMBDA_ThresholdMinString,      asynParamFloat64, &LAMBDA_ThresholdMin);
+	createParam( LAMBDA_ThresholdMaxString,      asynParamFloat64, &LAMBDA_ThresholdMax);
+	
+	setDoubleParam(LAMBDA_ThresholdMin, 1.0);
+	setDoubleParam(LAMBDA_ThresholdMax, 200.0);
 	
 	setIntegerParam(LAMBDA_DecoderDetected, 0);
 	setIntegerParam(LAMBDA_DecodedQueueDepth, 0);
@@ -152,11 +865,102 @@ configFileName(configPath)
 	setIntegerParam(LAMBDA_ReadoutThreads, 0);
 	setIntegerParam(LAMBDA_StitchedWidth, 0);
 	setIntegerParam(LAMBDA_StitchedHeight, 0);
+	setIntegerParam(LAMBDA_RecordEnable, 0);
+	setIntegerParam(LAMBDA_RecordLiveEvery, 0);
+	setIntegerParam(LAMBDA_ExportMode, EXPORT_SINGLE);
+	setIntegerParam(LAMBDA_ExportShards, this->numExports);
+	setIntegerParam(LAMBDA_StatsEnable, 0);
+	setIntegerParam(LAMBDA_AttributeTemplate, 0);
+	setIntegerParam(LAMBDA_StatsMax, 0);
+	setIntegerParam(LAMBDA_StatsSaturated, 0);
+	setIntegerParam(LAMBDA_PackedOutput, 0);
+	setIntegerParam(LAMBDA_StaleMode, STALE_RELEASE);
+	setIntegerParam(LAMBDA_StaleDistance, 0);
+	setIntegerParam(LAMBDA_StaleFrames, 0);
+	setIntegerParam(LAMBDA_LateFrames, 0);
+	setIntegerParam(LAMBDA_PendingFrames, 0);
+	setIntegerParam(LAMBDA_ScanEnable, 0);
+	setIntegerParam(LAMBDA_ScanPoints, 0);
+	setIntegerParam(LAMBDA_ScanPoint, 0);
+	setIntegerParam(LAMBDA_GeometryEnable, 0);
+	setIntegerParam(LAMBDA_GeometryRuns, 0);
+	setIntegerParam(LAMBDA_GeometrySpreads, 0);
+	setIntegerParam(LAMBDA_ShmEnable, 0);
+	setIntegerParam(LAMBDA_ShmSlots, 32);
+	setIntegerParam(LAMBDA_ShmMode, SHM_LOSSY);
+	setIntegerParam(LAMBDA_ShmPublished, 0);
+	setIntegerParam(LAMBDA_ShmOverruns, 0);
+	setIntegerParam(LAMBDA_ShmReaders, 0);
+	setIntegerParam(LAMBDA_ShmOversized, 0);
+	setIntegerParam(LAMBDA_PhaseEnable, 0);
+	setIntegerParam(LAMBDA_PhaseBins, 2);
+	setIntegerParam(LAMBDA_PhaseCycles, 100);
+	setIntegerParam(LAMBDA_PhaseBlocks, 0);
+	setIntegerParam(LAMBDA_PhaseLate, 0);
+	setIntegerParam(LAMBDA_XpcsEnable, 0);
+	setIntegerParam(LAMBDA_XpcsChannels, 16);
+	setIntegerParam(LAMBDA_XpcsLevels, 8);
+	setIntegerParam(LAMBDA_XpcsWorkers, 4);
+	setIntegerParam(LAMBDA_XpcsExport, 1);
+	setIntegerParam(LAMBDA_XpcsRing, 0);
+	setIntegerParam(LAMBDA_XpcsRings, 0);
+	setIntegerParam(LAMBDA_XpcsPixels, 0);
+	setIntegerParam(LAMBDA_XpcsFrames, 0);
+	setIntegerParam(LAMBDA_XpcsDropped, 0);
+	setIntegerParam(LAMBDA_XpcsMissing, 0);
+	setIntegerParam(LAMBDA_ReorderEnable, 0);
+	setIntegerParam(LAMBDA_ReorderWindow, 64);
+	setIntegerParam(LAMBDA_ReorderDepth, 0);
+	setIntegerParam(LAMBDA_ReorderSkipped, 0);
+	setIntegerParam(LAMBDA_ReorderLate, 0);
+	setIntegerParam(LAMBDA_ReorderDuplicates, 0);
+	setIntegerParam(LAMBDA_PreviewEnable, 0);
+	setIntegerParam(LAMBDA_PreviewMode, PREVIEW_RATE);
+	setIntegerParam(LAMBDA_PreviewEvery, 100);
+	setIntegerParam(LAMBDA_PreviewBinning, 1);
+	setIntegerParam(LAMBDA_PreviewFrames, 0);
+	setIntegerParam(LAMBDA_VetoMode, VETO_OFF);
+	setIntegerParam(LAMBDA_VetoMinX, 0);
+	setIntegerParam(LAMBDA_VetoMinY, 0);
+	setIntegerParam(LAMBDA_VetoSizeX, 0);
+	setIntegerParam(LAMBDA_VetoSizeY, 0);
+	setIntegerParam(LAMBDA_VetoPixelLevel, 1);
+	setIntegerParam(LAMBDA_VetoPreFrames, 0);
+	setIntegerParam(LAMBDA_VetoPostFrames, 0);
+	setIntegerParam(LAMBDA_VetoAccepted, 0);
+	setIntegerParam(LAMBDA_VetoRetained, 0);
+	setIntegerParam(LAMBDA_VetoRejected, 0);
+	setIntegerParam(LAMBDA_BatchEnable, 0);
+	setIntegerParam(LAMBDA_BatchSize, 16);
+	setIntegerParam(LAMBDA_BatchArrays, 0);
 	
+	epicsTimeGetCurrent(&this->lastStatsPublish);
+	epicsTimeGetCurrent(&this->lastPreview);
 	
-	this->connect();
-}
-
+	this->attributeTemplate.reset(new NDAttributeList());
+	this->batchAttributes.reset(new NDAttributeList());
+	this->frameAttributes.reset(new NDAttributeList());
+	
+	// Stitched frames come from a pool of their own, so their attributes are only ever touched by stampAttributes
+	this->framePool = new NDArrayPool(this, 0);
+	epicsTimeGetCurrent(&this->lastXpcsPublish);
+	
+	for (int index = 0; index < numModules; index += 1)
+	{
+		setIntegerParam(index, LAMBDA_RecordFrames, 0);
+		setIntegerParam(index, LAMBDA_QueueHighWater, 0);
+		setIntegerParam(index, LAMBDA_QueueCapacity, 0);
+		setIntegerParam(index, LAMBDA_ModuleBadFrames, 0);
+		setIntegerParam(index, LAMBDA_ModuleMissing, 0);
+	}
+	
+	this->telemetry.resize(numModules);
+	this->badFrameCauses.resize(numModules, std::vector<epicsInt32>(NUM_STATUS_BITS, 0));
+	
+	
+	this->connect();
+}
+
 ADLambda::~ADLambda()    { this->disconnect(); }
 
 asynStatus ADLambda::connect()
@@ -173,8 +977,10 @@ asynStatus ADLambda::connect()
 void ADLambda::tryConnect()
 {
 	std::string error_msg;
+	
+	if (this->replay)    { this->connectReplay(); }
 
-	while (! this->connected)
+	while (! this->replay && ! this->connected)
 	{
 		try
 		{
@@ -185,27 +991,43 @@ void ADLambda::tryConnect()
 			this->sys->connect();
 			this->sys->initialize();
 			
+			this->inputs.clear();
+			this->inputNames.clear();
+			this->detectors.clear();
+			
 			/**
-			 * Set up Detector
+			 * Set up Detectors, the first one is the primary head that
+			 * settings are read back from
 			 */
 			
-			this->det = std::dynamic_pointer_cast<xsp::lambda::Detector>(sys->detector("lambda"));
-
-			this->det->setEventHandler([&](auto t, const void* d) {
-				switch (t) 
-				{
-					case xsp::EventType::READY:
-						break;
-						
-					case xsp::EventType::START:
-						break;
-						
-					case xsp::EventType::STOP:
-						break;
-				}
+			for (auto ID : sys->detectorIds())
+			{
+				auto head = std::dynamic_pointer_cast<xsp::lambda::Detector>(sys->detector(ID));
 				
-				this->callParamCallbacks();
-			});
+				if (head == nullptr)    { continue; }
+				
+				head->setEventHandler([&](auto t, const void* d) {
+					switch (t) 
+					{
+						case xsp::EventType::READY:
+							break;
+							
+						case xsp::EventType::START:
+							break;
+							
+						case xsp::EventType::STOP:
+							break;
+					}
+					
+					this->callParamCallbacks();
+				});
+				
+				this->detectors.push_back(head);
+			}
+			
+			if (this->detectors.empty())    { throw xsp::RuntimeError("No Lambda detector in config file", xsp::StatusCode::BAD_RESOURCE_UNAVAILABLE); }
+			
+			this->det = this->detectors[0];
 			
 			xsp::setLogHandler([](xsp::LogLevel l, const std::string& m) {
 				switch (l) {
@@ -232,15 +1054,21 @@ void ADLambda::tryConnect()
 			/*
 			 * Set up reception of images
 			 *
-			 * Check to see if there is a stitching decoder enabled, 
-			 * otherwise connect to modules individually
+			 * Check to see if there are stitching decoders enabled, 
+			 * otherwise connect to modules individually. Every decoder
+			 * is its own input and is placed by its configured offset.
 			 */
 
 			if (sys->postDecoderIds().size() >= 1)
 			{
 				this->setIntegerParam(LAMBDA_DecoderDetected, 1);
 				this->hasDecoder = true;
-				this->inputs.push_back(sys->postDecoder("lambda"));
+				
+				for (auto ID : sys->postDecoderIds())
+				{
+					this->inputs.push_back(sys->postDecoder(ID));
+					this->inputNames.push_back(ID);
+				}
 			}
 			else
 			{
@@ -252,14 +1080,18 @@ void ADLambda::tryConnect()
 					while (!rec->ramAllocated()) { epicsThreadSleep(SHORT_TIME); }
 				
 					inputs.push_back(rec);
+					inputNames.push_back(ID);
 				}
 			}
 
-            for (int index = 1; index <= det->numberOfModules(); index += 1) 
-            {
-                printf("Waiting for HV to settle on module %d...\n", index);
-                while (!det->voltageSettled(index)) epicsThreadSleep(SHORT_TIME);
-            }
+			for (auto& head : this->detectors)
+			{
+				for (int index = 1; index <= head->numberOfModules(); index += 1) 
+				{
+					printf("Waiting for HV to settle on module %d...\n", index);
+					while (!head->voltageSettled(index)) epicsThreadSleep(SHORT_TIME);
+				}
+			}
 
 			this->connected = true;
 			
@@ -274,6 +1106,25 @@ void ADLambda::tryConnect()
 		}
 	}
 
+	if (! this->connected)
+	{
+		this->setIntegerParam(ADStatus, ADStatusError);
+		this->callParamCallbacks();
+		return;
+	}
+	
+	// Per-input threads, events and addresses are sized by numModules
+	if ((int) this->inputs.size() > this->numModules)
+	{
+		std::string message = "System has " + std::to_string(this->inputs.size()) + " inputs, numModules is " + std::to_string(this->numModules);
+		
+		this->setStringParam(ADStatusMessage, message.c_str());
+		this->setIntegerParam(ADStatus, ADStatusError);
+		this->callParamCallbacks();
+		return;
+	}
+
+	this->detectCapacities();
 	this->readParameters();
 	this->setIntegerParam(ADStatus, ADStatusIdle);
 	this->callParamCallbacks();
@@ -284,13 +1135,81 @@ void ADLambda::tryConnect()
 	                  (EPICSTHREADFUNC)::acquire_thread_callback,
 	                  this);
 	                  
-	epicsThreadCreate("ADLambda::exportThread()",
-	                  epicsThreadPriorityMedium,
+	for (int shard = 0; shard < this->numExports; shard += 1)    { this->spawnExportThread(shard); }
+	
+	epicsThreadCreate("ADLambda::previewThread()",
+	                  epicsThreadPriorityLow,
 	                  epicsThreadGetStackSize(epicsThreadStackMedium),
-	                  (EPICSTHREADFUNC)::export_thread_callback,
+	                  (EPICSTHREADFUNC)::preview_thread_callback,
 	                  this);
 }
 
+/**
+ * Replay mode has no xsp system or detector, the inputs are the recorded
+ * receivers "<configPath>_m0" upwards.
+ */
+void ADLambda::connectReplay()
+{
+	this->inputs.clear();
+	this->inputNames.clear();
+	
+	for (int index = 0; index < this->numModules; index += 1)
+	{
+		std::string name = this->configFileName + "_m" + std::to_string(index);
+		
+		auto rec = std::make_shared<LambdaReplayReceiver>(name, this->replay == REPLAY_REALTIME);
+		
+		if (! rec->isOpen())
+		{
+			if (index == 0)
+			{
+				this->setStringParam(ADStatusMessage, rec->error().c_str());
+				this->callParamCallbacks();
+			}
+			
+			break;
+		}
+		
+		printf("Replaying %lu frames from %s\n", (unsigned long) rec->framesRecorded(), name.c_str());
+		this->inputs.push_back(rec);
+		this->inputNames.push_back(name);
+	}
+	
+	this->connected = ! this->inputs.empty();
+}
+
+bool ADLambda::detectorReady()
+{
+	if (this->replay)    { return true; }
+	
+	for (auto& head : this->detectors)
+	{
+		if (! head->isReady())    { return false; }
+	}
+	
+	return true;
+}
+
+bool ADLambda::detectorBusy()
+{
+	if (this->replay)
+	{
+		for (auto& inp : this->inputs)
+		{
+			if (std::get<2>(inp)->isBusy())    { return true; }
+		}
+		
+		return false;
+	}
+	
+	for (auto& head : this->detectors)
+	{
+		if (head->isBusy())    { return true; }
+	}
+	
+	return false;
+}
+
 asynStatus ADLambda::disconnect()
 {
 	this->lock();
@@ -338,27 +1257,177 @@ void ADLambda::decrementValue(int param)
 	setIntegerParam(param, val);
 }
 
-void ADLambda::readParameters()
+/**
+ * Works out where each input's frames go in the stitched image and the
+ * resulting stitched size. Receivers and replayed receivers carry their
+ * own module position, post-decoders use the offset given to
+ * LambdaDecoderOffset. Decoders without one are stacked below the
+ * decoders before them, in config file order.
+ */
+void ADLambda::updateGeometry()
 {
 	int full_width = 0, full_height = 0;
+	int decoder_bottom = 0;
+	
+	this->inputOffsets.clear();
 
-	for (auto inp : this->inputs)
+	for (size_t index = 0; index < this->inputs.size(); index += 1)
 	{	
-		if (this->hasDecoder)
-		{
-			full_height = std::get<1>(inp)->frameHeight();
-			full_width  = std::get<1>(inp)->frameWidth();
-		}
-		else
+		const lambda_input& inp = this->inputs[index];
+		int x_shift, y_shift;
+		
+		inputPosition(inp, &x_shift, &y_shift);
+		
+		if (std::holds_alternative<std::shared_ptr<xsp::PostDecoder> >(inp) && index < this->inputNames.size())
 		{
-			auto temp = std::get<0>(inp);
-			full_width  = std::max(full_width,  (int)(temp->frameWidth() + temp->position().x));
-			full_height = std::max(full_height, (int)(temp->frameHeight() + temp->position().y));
+			auto found = this->decoderOffsets.find(this->inputNames[index]);
+			
+			if (found != this->decoderOffsets.end())
+			{
+				x_shift = found->second.first;
+				y_shift = found->second.second;
+			}
+			else
+			{
+				x_shift = 0;
+				y_shift = decoder_bottom;
+			}
+			
+			decoder_bottom = std::max(decoder_bottom, std::visit([](auto&& arg) -> int { return arg->frameHeight(); }, inp) + y_shift);
 		}
+		
+		this->inputOffsets.push_back(std::make_pair(x_shift, y_shift));
+		
+		full_width  = std::max(full_width,  std::visit([](auto&& arg) -> int { return arg->frameWidth();  }, inp) + x_shift);
+		full_height = std::max(full_height, std::visit([](auto&& arg) -> int { return arg->frameHeight(); }, inp) + y_shift);
+	}
+	
+	// A remap table decides the image size itself
+	if (this->geometry)
+	{
+		full_width = this->geometry->width();
+		full_height = this->geometry->height();
 	}
 	
 	setIntegerParam(LAMBDA_StitchedHeight, full_height);
 	setIntegerParam(LAMBDA_StitchedWidth, full_width);
+}
+
+/**
+ * Loads and compiles the remap table at arm time when LAMBDA_GeometryEnable
+ * is set, otherwise drops any previous table. Either way the stitched size
+ * is recalculated. Called with the driver locked.
+ */
+bool ADLambda::loadGeometry()
+{
+	int enable;
+	std::string path;
+	
+	getIntegerParam(LAMBDA_GeometryEnable, &enable);
+	getStringParam(LAMBDA_GeometryFile, path);
+	
+	this->geometry.reset();
+	
+	if (enable)
+	{
+		auto table = std::make_shared<LambdaGeometry>(path);
+		
+		for (size_t index = 0; table->isValid() && index < this->inputs.size(); index += 1)
+		{
+			const int frame_width  = std::visit([](auto&& arg) -> int { return arg->frameWidth();  }, this->inputs[index]);
+			const int frame_height = std::visit([](auto&& arg) -> int { return arg->frameHeight(); }, this->inputs[index]);
+			
+			table->compile(index, frame_width, frame_height);
+			
+			// Inputs the table doesn't cover still have to fit at their usual position
+			if (table->module(index) == NULL && index < this->inputOffsets.size() &&
+			    (this->inputOffsets[index].first + frame_width > table->width() ||
+			     this->inputOffsets[index].second + frame_height > table->height()))
+			{
+				std::string message = "Geometry size is too small for input " + std::to_string(index);
+				
+				setStringParam(ADStatusMessage, message.c_str());
+				callParamCallbacks();
+				return false;
+			}
+		}
+		
+		if (! table->isValid())
+		{
+			setStringParam(ADStatusMessage, table->error().c_str());
+			callParamCallbacks();
+			return false;
+		}
+		
+		this->geometry = table;
+	}
+	
+	setIntegerParam(LAMBDA_GeometryRuns, this->geometry ? (int) this->geometry->numRuns() : 0);
+	setIntegerParam(LAMBDA_GeometrySpreads, this->geometry ? (int) this->geometry->numSpreads() : 0);
+	
+	this->updateGeometry();
+	this->setSizes();
+	
+	return this->checkOverlap();
+}
+
+/**
+ * Refuses to arm when two inputs placed by offset would write the same
+ * pixels, since one would silently overwrite the other. Inputs the remap
+ * table covers are placed by the table and not checked. Called with the
+ * driver locked.
+ */
+bool ADLambda::checkOverlap()
+{
+	for (size_t first = 0; first < this->inputOffsets.size(); first += 1)
+	{
+		if (this->geometry && this->geometry->module(first))    { continue; }
+		
+		const int first_x = this->inputOffsets[first].first;
+		const int first_y = this->inputOffsets[first].second;
+		const int first_width  = std::visit([](auto&& arg) -> int { return arg->frameWidth();  }, this->inputs[first]);
+		const int first_height = std::visit([](auto&& arg) -> int { return arg->frameHeight(); }, this->inputs[first]);
+		
+		for (size_t second = first + 1; second < this->inputOffsets.size(); second += 1)
+		{
+			if (this->geometry && this->geometry->module(second))    { continue; }
+			
+			const int second_x = this->inputOffsets[second].first;
+			const int second_y = this->inputOffsets[second].second;
+			const int second_width  = std::visit([](auto&& arg) -> int { return arg->frameWidth();  }, this->inputs[second]);
+			const int second_height = std::visit([](auto&& arg) -> int { return arg->frameHeight(); }, this->inputs[second]);
+			
+			if (first_x < second_x + second_width && second_x < first_x + first_width &&
+			    first_y < second_y + second_height && second_y < first_y + first_height)
+			{
+				std::string message = "Inputs " + std::to_string(first) + " and " + std::to_string(second) + " overlap";
+				
+				setStringParam(ADStatusMessage, message.c_str());
+				callParamCallbacks();
+				return false;
+			}
+		}
+	}
+	
+	return true;
+}
+
+void ADLambda::readParameters()
+{
+	this->updateGeometry();
+	
+	if (this->replay)
+	{
+		auto rec = std::get<2>(this->inputs[0]);
+		
+		this->writeDepth(rec->bitDepth());
+		setIntegerParam(LAMBDA_DualMode, rec->dualMode() ? 1 : 0);
+		setStringParam(ADModel, "Replay");
+		
+		this->setSizes();
+		callParamCallbacks();
+		return;
+	}
 	
 	this->setSizes();
 	
@@ -400,6 +1469,12 @@ void ADLambda::readParameters()
 
 void ADLambda::sendParameters()
 {
+	if (this->replay)
+	{
+		this->setSizes();
+		return;
+	}
+	
 	setStringParam(ADStatusMessage, "Sending settings to Detector");
 	callParamCallbacks();
 
@@ -440,46 +1515,121 @@ void ADLambda::sendParameters()
 	else if (operation == TWENTY_FOUR_BIT) { depth = xsp::lambda::BitDepth::DEPTH_24; }
 	
 	xsp::lambda::OperationMode om_set(depth, sum, cm);
-	xsp::lambda::OperationMode om_get = det->operationMode();
-	
-	// Set Values
-	if (det->gatingMode() != gm)    { det->setGatingMode(gm); }
-	if (det->triggerMode() != tm)     { det->setTriggerMode(tm); }
 	
-	if (om_get.bit_depth != om_set.bit_depth ||
-	    om_get.charge_summing != om_set.charge_summing ||
-	    om_get.counter_mode != om_set.counter_mode)   
-	{ 
-		det->setOperationMode(om_set); 
+	// Every head gets the same settings
+	for (auto& head : this->detectors)
+	{
+		xsp::lambda::OperationMode om_get = head->operationMode();
+		
+		// Set Values
+		if (head->gatingMode() != gm)    { head->setGatingMode(gm); }
+		if (head->triggerMode() != tm)     { head->setTriggerMode(tm); }
+		
+		if (om_get.bit_depth != om_set.bit_depth ||
+		    om_get.charge_summing != om_set.charge_summing ||
+		    om_get.counter_mode != om_set.counter_mode)   
+		{ 
+			head->setOperationMode(om_set); 
+		}
+		
+		if (std::abs(head->shutterTime() - (shuttertime * 1000.0)) >= 0.00001)
+		{
+			head->setShutterTime(shuttertime * 1000);
+		}
+		
+		// Set Thresholds
+		std::vector<double> thresholds = head->thresholds();
+		
+		thresholds.reserve(2);
+		
+		if (std::abs(thresholds[0] - low_energy) >= 0.00001 || 
+		    ((dual || charge) && (std::abs(thresholds[1] - high_energy) >= 0.00001)))
+		{
+			if (dual || charge) {
+				printf("Setting thresholds: %f keV, %f keV\n", low_energy, high_energy);
+				head->setThresholds(std::vector<double>{low_energy, high_energy});
+			} else {
+				printf("Setting threshold: %f keV\n", low_energy);
+				head->setThresholds(std::vector<double>{low_energy});
+			}
+		}
+			
+		if (head->frameCount() != frames)    { head->setFrameCount(frames); }
 	}
 	
-	if (std::abs(det->shutterTime() - (shuttertime * 1000.0)) >= 0.00001)
+	this->setSizes();
+	
+	setStringParam(ADStatusMessage, "");
+	this->callParamCallbacks();
+}
+
+/**
+ * Sends a lower energy threshold to every detector head, keeping the upper
+ * threshold where it is, without reading them back first. Called with the
+ * driver locked.
+ * \param[in] threshold Lower energy threshold in keV
+ */
+bool ADLambda::sendThreshold(double threshold)
+{
+	double high_energy;
+	int dual, charge;
+	
+	getDoubleParam(LAMBDA_DualThreshold, &high_energy);
+	getIntegerParam(LAMBDA_DualMode, &dual);
+	getIntegerParam(LAMBDA_ChargeSumming, &charge);
+	
+	std::vector<double> thresholds{threshold};
+	
+	if (dual || charge)    { thresholds.push_back(high_energy); }
+	
+	try
+	{
+		for (auto& head : this->detectors)    { head->setThresholds(thresholds); }
+	}
+	catch (const xsp::RuntimeError& e)
 	{
-		det->setShutterTime(shuttertime * 1000);
+		std::string message(e.what());
+		
+		this->setStringParam(ADStatusMessage, message.c_str());
+		this->callParamCallbacks();
+		
+		return false;
 	}
 	
-	// Set Thresholds
-	std::vector<double> thresholds = det->thresholds();
+	this->setDoubleParam(LAMBDA_EnergyThreshold, threshold);
 	
-	thresholds.reserve(2);
+	return true;
+}
+
+/**
+ * Moves a threshold scan on to its next point. Only the thresholds are
+ * sent since nothing else changes between points. Called with the driver
+ * locked.
+ * \param[in] point Index into the scan list
+ * \param[in] threshold Lower energy threshold in keV
+ */
+bool ADLambda::applyScanPoint(size_t point, double threshold)
+{
+	if (! this->sendThreshold(threshold))    { return false; }
 	
-	if (std::abs(thresholds[0] - low_energy) >= 0.00001 || 
-        ((dual || charge) && (std::abs(thresholds[1] - high_energy) >= 0.00001)))
-    {
-        if (dual || charge) {
-            printf("Setting thresholds: %f keV, %f keV\n", low_energy, high_energy);
-            det->setThresholds(std::vector<double>{low_energy, high_energy});
-        } else {
-                printf("Setting threshold: %f keV\n", low_energy);
-                det->setThresholds(std::vector<double>{low_energy});
-        }
-    }
-		
-	if (det->frameCount() != frames)    { det->setFrameCount(frames); }
+	this->setIntegerParam(LAMBDA_ScanPoint, (int) point);
+	this->callParamCallbacks();
 	
-	this->setSizes();
+	this->buildAttributeTemplate();
 	
-	setStringParam(ADStatusMessage, "");
+	return true;
+}
+
+/**
+ * Ends a threshold scan, putting back the threshold that was set before it
+ * started. Does nothing outside a scan. Called with the driver locked.
+ */
+void ADLambda::finishScan()
+{
+	if (! this->scanActive)    { return; }
+	
+	this->scanActive = false;
+	this->sendThreshold(this->scanRestoreThreshold);
 	this->callParamCallbacks();
 }
 
@@ -487,8 +1637,15 @@ bool ADLambda::tryStartAcquire()
 {
 	try
 	{ 
-		while(! det->isReady())    { epicsThreadSleep(SHORT_TIME); }
-		this->det->startAcquisition();
+		if (this->replay)
+		{
+			for (auto& inp : this->inputs)    { std::get<2>(inp)->start(); }
+			return true;
+		}
+		
+		while(! this->detectorReady())    { epicsThreadSleep(SHORT_TIME); }
+		
+		for (auto& head : this->detectors)    { head->startAcquisition(); }
 		return true;
 	}
 	catch (const xsp::RuntimeError& e)
@@ -506,7 +1663,13 @@ bool ADLambda::tryStopAcquire()
 {
 	try
 	{
-		this->det->stopAcquisition();
+		if (this->replay)
+		{
+			for (auto& inp : this->inputs)    { std::get<2>(inp)->stop(); }
+			return true;
+		}
+		
+		for (auto& head : this->detectors)    { head->stopAcquisition(); }
 		return true;
 	}
 	catch (const xsp::RuntimeError& e)
@@ -520,33 +1683,358 @@ bool ADLambda::tryStopAcquire()
 	}
 }
 
-
 /**
- * Background thread to wait until an acquire signal is recieved.
- * Afterwards, start the acquisition and create an acquire thread
- * for each receiver. Then, wait until the threads all finish.
+ * Opens one raw recorder per input when raw recording is enabled. File
+ * names are built from the standard NDFile parameters with a "_m<input>"
+ * suffix per receiver. Called with the driver locked.
  */
-void ADLambda::waitAcquireThread() 
+bool ADLambda::startRecording()
 {
-	this->lock();
+	int enable, datatype, frame_count, dual_mode, depth;
 	
-	while(this->connected)
+	this->recorders.clear();
+	
+	getIntegerParam(LAMBDA_RecordEnable, &enable);
+	
+	if (! enable)    { return true; }
+	
+	if (this->checkPath() != asynSuccess)
 	{
-		this->unlock();
-			bool signal = this->startAcquireEvent->wait(SHORT_TIME);
-		this->lock();
+		this->setStringParam(ADStatusMessage, "Raw recording path does not exist");
+		this->callParamCallbacks();
+		return false;
+	}
+	
+	char basename[MAX_FILENAME_LEN];
+	
+	this->createFileName(sizeof(basename), basename);
+	this->setStringParam(NDFullFileName, basename);
+	
+	getIntegerParam(NDDataType, &datatype);
+	getIntegerParam(ADNumImages, &frame_count);
+	getIntegerParam(LAMBDA_DualMode, &dual_mode);
+	getIntegerParam(LAMBDA_OperatingMode, &depth);
+	
+	for (size_t index = 0; index < this->inputs.size(); index += 1)
+	{
+		lambda_input input = this->inputs[index];
 		
-		if (!signal)    { continue; }
+		lambda_raw_header header;
+		
+		header.module           = index;
+		header.width            = std::visit([](auto&& arg) -> int { return arg->frameWidth();  }, input);
+		header.height           = std::visit([](auto&& arg) -> int { return arg->frameHeight(); }, input);
+		header.bytes_per_pixel  = elementSize((NDDataType_t) datatype);
+		header.bit_depth        = depth;
+		header.frames_per_image = dual_mode ? 2 : 1;
+		header.frame_bytes      = (uint64_t) header.width * header.height * header.bytes_per_pixel;
+		
+		// Where updateGeometry placed the input, decoders carry no position of their own
+		int x_shift, y_shift;
+		inputPosition(input, &x_shift, &y_shift);
+		
+		if (index < this->inputOffsets.size())
+		{
+			x_shift = this->inputOffsets[index].first;
+			y_shift = this->inputOffsets[index].second;
+		}
+		
+		header.x_position = x_shift;
+		header.y_position = y_shift;
+		
+		std::string name = std::string(basename) + "_m" + std::to_string(index);
+		
+		auto recorder = std::make_unique<LambdaRawRecorder>(name, header, (size_t) frame_count * header.frames_per_image);
+		
+		if (! recorder->isOpen())
+		{
+			this->setStringParam(ADStatusMessage, recorder->error().c_str());
+			this->callParamCallbacks();
+			this->recorders.clear();
+			return false;
+		}
+		
+		this->setIntegerParam(index, LAMBDA_RecordFrames, 0);
+		this->setDoubleParam(index, LAMBDA_RecordBandwidth, 0.0);
+		this->callParamCallbacks(index);
+		
+		this->recorders.push_back(std::move(recorder));
+	}
+	
+	return true;
+}
+
+/**
+ * Creates the shared memory ring when LAMBDA_ShmEnable is set. An existing
+ * ring is kept, along with its readers, as long as its name and slot count
+ * haven't changed and frames still fit. Called with the driver locked.
+ */
+bool ADLambda::openShmRing()
+{
+	int enable, slots, width, height, datatype, phase;
+	std::string name;
+	
+	getIntegerParam(LAMBDA_ShmEnable, &enable);
+	getIntegerParam(LAMBDA_PhaseEnable, &phase);
+	getIntegerParam(LAMBDA_ShmSlots, &slots);
+	getIntegerParam(ADMaxSizeX, &width);
+	getIntegerParam(ADMaxSizeY, &height);
+	getIntegerParam(NDDataType, &datatype);
+	getStringParam(LAMBDA_ShmName, name);
+	
+	if (! enable)
+	{
+		this->shmRing.reset();
+		return true;
+	}
+	
+	uint64_t frame_bytes = (uint64_t) width * height * elementSize((NDDataType_t) datatype) * this->batchSize;
+	
+	// Summed phase bins are always UInt32, whatever the frames are
+	if (phase)    { frame_bytes = std::max(frame_bytes, (uint64_t) width * height * sizeof(epicsUInt32)); }
+	
+	if (this->shmRing && 
+	    this->shmRing->name() == name && 
+	    this->shmRing->numSlots() == (uint32_t) slots && 
+	    this->shmRing->slotBytes() >= frame_bytes)
+	{
+		return true;
+	}
+	
+	this->shmRing.reset();
+	
+	auto ring = std::make_shared<LambdaShmRing>(name, (uint32_t) std::max(slots, 1), frame_bytes);
+	
+	if (! ring->isOpen())
+	{
+		this->setStringParam(ADStatusMessage, ring->error().c_str());
+		this->callParamCallbacks();
+		return false;
+	}
+	
+	this->shmRing = ring;
+	
+	this->setIntegerParam(LAMBDA_ShmPublished, 0);
+	this->setIntegerParam(LAMBDA_ShmOverruns, 0);
+	this->setIntegerParam(LAMBDA_ShmOversized, 0);
+	this->callParamCallbacks();
+	
+	return true;
+}
+
+/**
+ * Starts a new correlator when LAMBDA_XpcsEnable is set, reading the ring
+ * mask for the current image size. Called with the driver locked.
+ */
+bool ADLambda::startXpcs()
+{
+	int enable, channels, levels, workers, width, height;
+	double exposure, period;
+	std::string mask;
+	
+	getIntegerParam(LAMBDA_XpcsEnable, &enable);
+	getIntegerParam(LAMBDA_XpcsChannels, &channels);
+	getIntegerParam(LAMBDA_XpcsLevels, &levels);
+	getIntegerParam(LAMBDA_XpcsWorkers, &workers);
+	getIntegerParam(ADMaxSizeX, &width);
+	getIntegerParam(ADMaxSizeY, &height);
+	getDoubleParam(ADAcquireTime, &exposure);
+	getDoubleParam(ADAcquirePeriod, &period);
+	getStringParam(LAMBDA_XpcsMaskFile, mask);
+	
+	this->xpcs.reset();
+	
+	if (! enable)    { return true; }
+	
+	auto engine = std::make_shared<LambdaXpcs>(mask, (size_t) width, (size_t) height, workers, channels, levels);
+	
+	if (! engine->isValid())
+	{
+		this->setStringParam(ADStatusMessage, engine->error().c_str());
+		this->callParamCallbacks();
+		return false;
+	}
+	
+	this->xpcs = engine;
+	
+	// The detector can't start a frame before the last exposure is over
+	double frame_period = std::max(period, exposure);
+	
+	this->xpcsTau.clear();
+	for (uint32_t lag : engine->lagFrames())    { this->xpcsTau.push_back(lag * frame_period); }
+	
+	this->xpcsG2.assign(engine->numRings() * engine->numLags(), 0.0);
+	
+	this->setIntegerParam(LAMBDA_XpcsRings, engine->numRings());
+	this->setIntegerParam(LAMBDA_XpcsPixels, (int) engine->numPixels());
+	this->setIntegerParam(LAMBDA_XpcsFrames, 0);
+	this->setIntegerParam(LAMBDA_XpcsDropped, 0);
+	this->setIntegerParam(LAMBDA_XpcsMissing, 0);
+	
+	doCallbacksFloat64Array(this->xpcsTau.data(), this->xpcsTau.size(), LAMBDA_XpcsTau, 0);
+	this->updateXpcsWaveform();
+	this->callParamCallbacks();
+	
+	return true;
+}
+
+/**
+ * Recomputes g2 from the correlator, at most once every LAMBDA_XpcsPeriod
+ * seconds unless forced. The computation runs without the driver lock.
+ * Called unlocked from the control thread.
+ */
+void ADLambda::publishXpcs(bool force)
+{
+	std::shared_ptr<LambdaXpcs> engine;
+	double period;
+	
+	this->lock();
+		engine = this->xpcs;
+		getDoubleParam(LAMBDA_XpcsPeriod, &period);
+	this->unlock();
+	
+	if (! engine)    { return; }
+	
+	epicsTimeStamp now;
+	epicsTimeGetCurrent(&now);
+	
+	if (! force && epicsTimeDiffInSeconds(&now, &this->lastXpcsPublish) < period)    { return; }
+	
+	this->lastXpcsPublish = now;
+	
+	std::vector<double> g2;
+	engine->results(g2);
+	
+	this->lock();
+		if (engine == this->xpcs)
+		{
+			this->xpcsG2.swap(g2);
+			
+			this->setIntegerParam(LAMBDA_XpcsFrames, (int) engine->framesProcessed());
+			this->setIntegerParam(LAMBDA_XpcsDropped, (int) engine->framesDropped());
+			this->setIntegerParam(LAMBDA_XpcsMissing, (int) engine->framesMissing());
+			
+			this->updateXpcsWaveform();
+			this->callParamCallbacks();
+		}
+	this->unlock();
+}
+
+/**
+ * Posts the g2 curve of the ring selected by LAMBDA_XpcsRing. Called with
+ * the driver locked.
+ */
+void ADLambda::updateXpcsWaveform()
+{
+	int ring;
+	getIntegerParam(LAMBDA_XpcsRing, &ring);
+	
+	size_t num_lags = this->xpcsTau.size();
+	
+	if (ring < 0 || num_lags == 0 || (size_t) (ring + 1) * num_lags > this->xpcsG2.size())    { return; }
+	
+	doCallbacksFloat64Array(&this->xpcsG2[ring * num_lags], num_lags, LAMBDA_XpcsG2, 0);
+}
+
+/**
+ * Flushes and closes the raw recorders once all acquisition threads have
+ * finished. Called with the driver locked, the lock is dropped while the
+ * last buffers are written out.
+ */
+void ADLambda::stopRecording()
+{
+	if (this->recorders.empty())    { return; }
+	
+	this->unlock();
+		for (auto& recorder : this->recorders)    { recorder->finish(); }
+	this->lock();
+	
+	for (size_t index = 0; index < this->recorders.size(); index += 1)
+	{
+		this->setIntegerParam(index, LAMBDA_RecordFrames, (int) this->recorders[index]->framesWritten());
+		this->setDoubleParam(index, LAMBDA_RecordBandwidth, this->recorders[index]->bandwidth());
+		this->callParamCallbacks(index);
+		
+		if (! this->recorders[index]->error().empty())    { this->setStringParam(ADStatusMessage, this->recorders[index]->error().c_str()); }
+	}
+	
+	int autoincrement;
+	getIntegerParam(NDAutoIncrement, &autoincrement);
+	
+	if (autoincrement)    { this->incrementValue(NDFileNumber); }
+	
+	this->recorders.clear();
+	this->callParamCallbacks();
+}
+
+
+/**
+ * Background thread to wait until an acquire signal is recieved.
+ * Afterwards, start the acquisition and create an acquire thread
+ * for each receiver. Then, wait until the threads all finish.
+ */
+void ADLambda::waitAcquireThread() 
+{
+	int generation = -1;
+	
+	this->lock();
+	
+	while(this->connected)
+	{
+		if (generation != this->placementGeneration)
+		{
+			generation = this->placementGeneration;
+			
+			this->unlock();
+				this->applyPlacement("control");
+			this->lock();
+		}
+		
+		this->unlock();
+			bool signal = this->startAcquireEvent->wait(SHORT_TIME);
+		this->lock();
+		
+		if (!signal)    { continue; }
 		
 		bool aborted = false;
 		
 		this->unlock();
 			this->setStringParam(ADStatusMessage, "Waiting for modules to be ready");
-			while(! det->isReady())    { aborted = this->stopAcquireEvent->wait(SHORT_TIME); }
+			while(! this->detectorReady())    { aborted = this->stopAcquireEvent->wait(SHORT_TIME); }
 		this->lock();
 		
 		if (aborted)    { continue; }
 		
+		/*
+		 * A threshold scan is a series of back to back acquisitions, one
+		 * per point. The first point is sent along with the other settings.
+		 */
+		std::vector<double> points = this->scanThresholds;
+		int scan_enable;
+		
+		getIntegerParam(LAMBDA_ScanEnable, &scan_enable);
+		
+		this->scanActive = scan_enable && ! this->replay && ! points.empty();
+		
+		// The user's threshold comes back once the scan is over
+		if (this->scanActive)
+		{
+			getDoubleParam(LAMBDA_EnergyThreshold, &this->scanRestoreThreshold);
+			
+			this->setDoubleParam(LAMBDA_EnergyThreshold, points[0]);
+			this->setIntegerParam(LAMBDA_ScanPoint, 0);
+		}
+		
+		// The remap table sets the image size, so it has to be ready before the sizes go out
+		if (! this->loadGeometry())
+		{
+			this->finishScan();
+			this->setIntegerParam(ADAcquire, 0);
+			this->setIntegerParam(ADStatus, ADStatusIdle);
+			this->callParamCallbacks();
+			continue;
+		}
+		
 		// Sync epics parameters to detector
 		try
 		{
@@ -557,63 +2045,190 @@ void ADLambda::waitAcquireThread()
 			std::string error_msg(e.what());
 
 			this->setStringParam(ADStatusMessage, error_msg.c_str());
+			this->finishScan();
 			this->callParamCallbacks();
 			continue;
 		}
-
-		this->setIntegerParam(LAMBDA_BadImage, 0);
-		this->setIntegerParam(ADStatus, ADStatusWaiting);
-		this->callParamCallbacks();
 		
-		// Attempt to start aquisition, allow user to abort acquisition
-		while (! aborted && ! this->tryStartAcquire())
-		{
-			this->unlock();
-				aborted = this->stopAcquireEvent->wait(SHORT_TIME);
-			this->lock();
-		}
+		this->buildAttributeTemplate();
 		
-		this->setStringParam(ADStatusMessage, "");
+		// Read ahead of the shared memory ring, whose slots have to hold a whole batch
+		int batch_enable, batch_size;
 		
-		// If stop is pressed, reset to idle
-		if (aborted)
-		{ 
+		getIntegerParam(LAMBDA_BatchEnable, &batch_enable);
+		getIntegerParam(LAMBDA_BatchSize, &batch_size);
+		
+		this->batchSize = batch_enable ? std::max(1, std::min(batch_size, BATCH_MAX_FRAMES)) : 1;
+		
+		// Open raw recording files, the shared memory ring and the correlator before the detector starts producing frames
+		if (! this->openShmRing() || ! this->startXpcs() || ! this->startRecording())
+		{
+			this->finishScan();
 			this->setIntegerParam(ADAcquire, 0);
 			this->setIntegerParam(ADStatus, ADStatusIdle);
 			this->callParamCallbacks();
-			continue; 
+			continue;
 		}
 		
-		this->setIntegerParam(ADStatus, ADStatusAcquire);
-		this->callParamCallbacks();
+		this->startPhaseBins();
+		
+		getIntegerParam(LAMBDA_VetoMode, &this->vetoMode);
+		this->vetoPostRemaining = 0;
+		this->vetoLast = -1;
+		this->vetoBreaks.clear();
+		
+		this->startBatches();
+		
+		int reorder_enable;
+		getIntegerParam(LAMBDA_ReorderEnable, &reorder_enable);
 		
-		// Spawn acquisition threads
+		// The correlator, the phase blocks, the veto's pre-trigger frames and batches of consecutive frames need their frames in order
+		this->reorderActive = reorder_enable || this->xpcs || this->phaseActive || this->vetoMode != VETO_OFF || (this->batchSize > 1 && ! this->batchDirect);
+
+		this->setIntegerParam(LAMBDA_BadImage, 0);
+		this->setIntegerParam(LAMBDA_StaleFrames, 0);
+		this->setIntegerParam(LAMBDA_LateFrames, 0);
+		this->setIntegerParam(LAMBDA_ReorderDepth, 0);
+		this->setIntegerParam(LAMBDA_ReorderSkipped, 0);
+		this->setIntegerParam(LAMBDA_ReorderLate, 0);
+		this->setIntegerParam(LAMBDA_ReorderDuplicates, 0);
+		epicsTimeGetCurrent(&this->lastReorderPublish);
+		this->setIntegerParam(LAMBDA_PreviewFrames, 0);
+		this->setIntegerParam(LAMBDA_VetoAccepted, 0);
+		this->setIntegerParam(LAMBDA_VetoRetained, 0);
+		this->setIntegerParam(LAMBDA_VetoRejected, 0);
+		this->setIntegerParam(LAMBDA_BatchArrays, 0);
+		
+		// Per input counters cover the whole acquisition, all scan points included
 		for (size_t inp_index = 0; inp_index < this->inputs.size(); inp_index += 1)
 		{
 			this->setIntegerParam(inp_index, ADNumImagesCounter, 0);
 			this->setIntegerParam(inp_index, LAMBDA_BadFrameCounter, 0);
+			this->setIntegerParam(inp_index, LAMBDA_ModuleBadFrames, 0);
+			this->setIntegerParam(inp_index, LAMBDA_QueueHighWater, 0);
+			this->setIntegerParam(inp_index, LAMBDA_ModuleMissing, 0);
 			this->callParamCallbacks(inp_index);
 			
-			this->spawnAcquireThread(inp_index);
+			if (inp_index < this->telemetry.size())
+			{
+				this->telemetry[inp_index].started = false;
+				this->telemetry[inp_index].high_water = 0;
+				this->telemetry[inp_index].bad_pending = false;
+				epicsTimeGetCurrent(&this->telemetry[inp_index].last_bad_publish);
+				
+				std::fill(this->badFrameCauses[inp_index].begin(), this->badFrameCauses[inp_index].end(), 0);
+				doCallbacksInt32Array(this->badFrameCauses[inp_index].data(), NUM_STATUS_BITS, LAMBDA_BadFrameCauses, inp_index);
+			}
+		}
+		
+		size_t num_points = this->scanActive ? points.size() : 1;
+		
+		for (size_t point = 0; point < num_points; point += 1)
+		{
+			epicsTimeStamp setup_start;
+			epicsTimeGetCurrent(&setup_start);
+			
+			// The first point's threshold went out with the other settings
+			if (point > 0)
+			{
+				int acquiring;
+				getIntegerParam(ADAcquire, &acquiring);
+				
+				if (! acquiring || ! this->applyScanPoint(point, points[point]))    { break; }
+			}
+			
+			this->setIntegerParam(ADStatus, ADStatusWaiting);
+			this->callParamCallbacks();
+			
+			// Attempt to start aquisition, allow user to abort acquisition
+			while (! aborted && ! this->tryStartAcquire())
+			{
+				this->unlock();
+					aborted = this->stopAcquireEvent->wait(SHORT_TIME);
+				this->lock();
+			}
+			
+			// If stop is pressed, go straight to cleaning up
+			if (aborted)    { break; }
+			
+			if (this->scanActive)
+			{
+				epicsTimeStamp setup_end;
+				epicsTimeGetCurrent(&setup_end);
+				
+				this->setDoubleParam(LAMBDA_ScanSetupTime, epicsTimeDiffInSeconds(&setup_end, &setup_start));
+			}
+			
+			this->setStringParam(ADStatusMessage, "");
+			this->setIntegerParam(ADStatus, ADStatusAcquire);
+			this->staleThrough = -1;
+			this->newestFrame = -1;
+			this->reorderNext = -1;
+			this->batchBase = -1;
+			this->batchClosedBelow = std::numeric_limits<int>::min();
+			this->callParamCallbacks();
+			
+			// Spawn acquisition threads
+			for (size_t inp_index = 0; inp_index < this->inputs.size(); inp_index += 1)    { this->spawnAcquireThread(inp_index); }
+			
+			// Wait for all threads to finish acquiring
+			for (size_t index = 0; index < this->inputs.size(); index += 1)
+			{
+				this->unlock();
+					while (! this->threadFinishEvents[index]->wait(TELEMETRY_PERIOD))
+					{
+						this->publishXpcs(false);
+						
+						// Nothing else times out a gap once frames stop completing
+						this->lock();
+							this->releaseReordered(false);
+							this->releaseBatch(false);
+							this->releaseGroups(false);
+						this->unlock();
+						
+						if (this->phaseActive)    { this->accumulatePhase(); }
+					}
+				this->lock();
+				
+				decrementValue(LAMBDA_ReadoutThreads);
+				callParamCallbacks();
+			}
+			
+			// Whatever is still incomplete will never be finished
+			this->evictStale(0, true);
+			this->releaseReordered(true);
+			this->flushVeto();
+			this->releaseBatch(true);
+			this->releaseGroups(true);
+			
+			// Scan points don't share phase blocks, frame numbers restart with each one
+			if (this->phaseActive)    { this->emitPhaseBins(); }
 		}
 		
-		// Wait for all threads to finish acquiring
-		for (size_t index = 0; index < this->inputs.size(); index += 1)
+		this->finishScan();
+		this->phaseActive = false;
+		this->phaseSums.clear();
+		
+		// Let the correlator catch up so the final g2 covers every frame
+		if (this->xpcs)
 		{
+			std::shared_ptr<LambdaXpcs> engine = this->xpcs;
+			
 			this->unlock();
-				this->threadFinishEvents[index]->wait();
+				engine->finish();
+				this->publishXpcs(true);
 			this->lock();
-			
-			decrementValue(LAMBDA_ReadoutThreads);
-			callParamCallbacks();
 		}
 		
-		this->frames.clear();
+		this->stopRecording();
+		
+		// Counts held back by the rate limit
+		for (size_t inp_index = 0; inp_index < this->inputs.size(); inp_index += 1)    { this->publishBadFrames(inp_index, true); }
 
 		this->setIntegerParam(ADStatus, ADStatusReadout);
 		this->callParamCallbacks();
 		
-		while (! export_queue.empty())    
+		while (this->exportPending())    
 		{
 			this->unlock();
 			epicsThreadSleep(SHORT_TIME); 
@@ -625,241 +2240,2198 @@ void ADLambda::waitAcquireThread()
 		this->callParamCallbacks();
 	}
 	
-	this->unlock();
+	this->unlock();
+}
+
+/**
+ * Hands a completed frame to one of the export threads. Frames are tagged
+ * with a global sequence number so sharded plugin chains can be merged
+ * back into order downstream. Called with the driver locked.
+ * \param[in] slices Frames the export thread copies into a batch, empty otherwise
+ */
+void ADLambda::queueFrame(NDArray* frame, const std::vector<NDArray*>& slices)
+{
+	int mode, shards;
+	
+	getIntegerParam(LAMBDA_ExportMode, &mode);
+	getIntegerParam(LAMBDA_ExportShards, &shards);
+	
+	shards = std::max(1, std::min(shards, this->numExports));
+	
+	int shard = 0;
+	
+	if      (mode == EXPORT_ROUND_ROBIN)     { shard = (int) (this->exportSequence % shards); }
+	else if (mode == EXPORT_FRAME_NUMBER)    { shard = (int) ((epicsUInt32) frame->uniqueId % shards); }
+	
+	if (mode != EXPORT_SINGLE)
+	{
+		frame_attributes* cached = this->cachedAttributes(frame);
+		
+		// Batches and phase bin images aren't stitched frames and get theirs by name
+		if (cached != NULL && cached->sequence != NULL)
+		{
+			cached->sequence->setValue(&this->exportSequence);
+			cached->shard->setValue(&shard);
+		}
+		else
+		{
+			frame->pAttributeList->add("LambdaSequence", "Export sequence number", NDAttrUInt64, &this->exportSequence);
+			frame->pAttributeList->add("LambdaShard", "Export address", NDAttrInt32, &shard);
+		}
+	}
+	
+	this->exportSequence += 1;
+	
+	dequeLock->lock();
+		this->export_queues[shard].push_back(export_item());
+		this->export_queues[shard].back().array = frame;
+		this->export_queues[shard].back().slices = slices;
+	dequeLock->unlock();
+}
+
+/**
+ * Keeps or drops a completed frame on what was measured inside the veto
+ * region while it was stitched. A passing frame is exported along with
+ * the LAMBDA_VetoPreFrames frames held before it and the
+ * LAMBDA_VetoPostFrames frames after it, everything else is released.
+ * Frames arrive from the in-order stage, so the held frames are the ones
+ * just before the trigger. Called with the driver locked.
+ */
+void ADLambda::vetoFrame(NDArray* frame, const veto_measure& measure)
+{
+	if (this->vetoMode == VETO_OFF)
+	{
+		this->batchFrame(frame);
+		return;
+	}
+	
+	// Numbers the in-order stage skipped, so batching can tell them from vetoed frames
+	if (this->vetoLast >= 0 && frame->uniqueId != this->vetoLast + 1)    { this->vetoBreaks.push_back(frame->uniqueId); }
+	
+	this->vetoLast = frame->uniqueId;
+	
+	int pre_frames, post_frames;
+	double low, high;
+	
+	getIntegerParam(LAMBDA_VetoPreFrames, &pre_frames);
+	getIntegerParam(LAMBDA_VetoPostFrames, &post_frames);
+	getDoubleParam(LAMBDA_VetoLow, &low);
+	getDoubleParam(LAMBDA_VetoHigh, &high);
+	
+	double metric = (this->vetoMode == VETO_PIXEL_COUNT) ? (double) measure.above : (double) measure.sum;
+	
+	// An upper limit of 0 or less leaves the window open ended
+	bool pass = (metric >= low) && (high <= 0.0 || metric <= high);
+	
+	epicsInt32 trigger = pass ? 1 : 0;
+	
+	frame_attributes* cached = this->cachedAttributes(frame);
+	
+	if (cached != NULL && cached->veto_trigger != NULL)    { cached->veto_trigger->setValue(&trigger); }
+	else                                                  { frame->pAttributeList->add("LambdaVetoTrigger", "Frame passed the veto", NDAttrInt32, &trigger); }
+	
+	if (pass)
+	{
+		while (! this->vetoHistory.empty())
+		{
+			NDArray* held = this->vetoHistory.front();
+			this->vetoHistory.pop_front();
+			
+			incrementValue(LAMBDA_VetoRetained);
+			this->batchFrame(held);
+		}
+		
+		incrementValue(LAMBDA_VetoAccepted);
+		this->batchFrame(frame);
+		
+		this->vetoPostRemaining = std::max(post_frames, 0);
+	}
+	else if (this->vetoPostRemaining > 0)
+	{
+		this->vetoPostRemaining -= 1;
+		
+		incrementValue(LAMBDA_VetoRetained);
+		this->batchFrame(frame);
+	}
+	else
+	{
+		this->vetoHistory.push_back(frame);
+		
+		while ((int) this->vetoHistory.size() > std::max(pre_frames, 0))
+		{
+			this->vetoHistory.front()->release();
+			this->vetoHistory.pop_front();
+			
+			incrementValue(LAMBDA_VetoRejected);
+		}
+	}
+	
+	callParamCallbacks();
+}
+
+/**
+ * Releases the pre-trigger frames still held at the end of a scan point
+ * or acquisition, they count as rejected. Called with the driver locked.
+ */
+void ADLambda::flushVeto()
+{
+	while (! this->vetoHistory.empty())
+	{
+		this->vetoHistory.front()->release();
+		this->vetoHistory.pop_front();
+		
+		incrementValue(LAMBDA_VetoRejected);
+	}
+	
+	this->vetoPostRemaining = 0;
+	this->vetoLast = -1;
+	this->vetoBreaks.clear();
+	
+	callParamCallbacks();
+}
+
+/**
+ * Tells whether every frame number between the last batched frame and
+ * this one reached the veto, so the ones missing in between were vetoed
+ * rather than lost. Called with the driver locked.
+ */
+bool ADLambda::vetoContinues(int frame_number)
+{
+	while (! this->vetoBreaks.empty() && this->vetoBreaks.front() <= this->batchLast)    { this->vetoBreaks.pop_front(); }
+	
+	if (this->vetoMode == VETO_OFF || frame_number <= this->batchLast)    { return false; }
+	
+	return this->vetoBreaks.empty() || this->vetoBreaks.front() > frame_number;
+}
+
+/**
+ * Holds completed frames until they can be exported in uniqueId order,
+ * when LAMBDA_ReorderEnable was set at arm time or the correlator is
+ * running. Frames arriving after later frames have gone out are dropped
+ * and counted as late, a second frame with a number already held is
+ * dropped and counted as a duplicate. Called with the driver locked.
+ * \param[in] measure Veto measurements taken while the frame was stitched
+ * \param[in] partial The frame was delivered with inputs missing
+ */
+void ADLambda::reorderFrame(NDArray* frame, const veto_measure& measure, bool partial)
+{
+	if (! this->reorderActive)
+	{
+		this->deliverFrame(frame, measure, partial);
+		return;
+	}
+	
+	if (this->reorderNext >= 0 && frame->uniqueId < this->reorderNext)
+	{
+		incrementValue(LAMBDA_ReorderLate);
+		frame->release();
+		return;
+	}
+	
+	auto inserted = this->reorderPending.emplace(frame->uniqueId, reorder_entry());
+	
+	if (! inserted.second)
+	{
+		incrementValue(LAMBDA_ReorderDuplicates);
+		frame->release();
+		return;
+	}
+	
+	reorder_entry& entry = inserted.first->second;
+	
+	entry.array = frame;
+	entry.veto = measure;
+	entry.partial = partial;
+	epicsTimeGetCurrent(&entry.arrived);
+	
+	this->releaseReordered(false);
+}
+
+/**
+ * Marks a frame number as dropped, so the in-order stage moves past it
+ * without waiting for the window or timeout. Called with the driver locked.
+ */
+void ADLambda::reorderDrop(int frame_number)
+{
+	if (! this->reorderActive)    { return; }
+	
+	if (this->reorderNext >= 0 && frame_number < this->reorderNext)    { return; }
+	
+	auto inserted = this->reorderPending.emplace(frame_number, reorder_entry());
+	
+	// A copy of the frame is already held, that one goes out
+	if (! inserted.second)    { return; }
+	
+	reorder_entry& entry = inserted.first->second;
+	
+	entry.array = NULL;
+	entry.partial = false;
+	epicsTimeGetCurrent(&entry.arrived);
+	
+	this->releaseReordered(false);
+}
+
+/**
+ * Passes a frame on once it's in order: to the correlator, then to the
+ * phase accumulators or through the veto to batching and export. Called
+ * with the driver locked.
+ */
+void ADLambda::deliverFrame(NDArray* frame, const veto_measure& measure, bool partial)
+{
+	if (this->xpcs)
+	{
+		// A frame with inputs missing would skew the intensities, the correlator sees a gap instead
+		if (partial)    { this->xpcs->skip(1); }
+		else            { this->xpcs->push(frame); }
+	}
+	
+	// Summed instead of exported, by accumulatePhase outside the driver lock
+	if (this->phaseActive)
+	{
+		if (partial)
+		{
+			frame->release();
+			return;
+		}
+		
+		this->phaseLock->lock();
+			this->phaseQueue.push_back(frame);
+		this->phaseLock->unlock();
+		return;
+	}
+	
+	if (this->xpcs)
+	{
+		int keep;
+		getIntegerParam(LAMBDA_XpcsExport, &keep);
+		
+		if (! keep)
+		{
+			frame->release();
+			return;
+		}
+	}
+	
+	this->vetoFrame(frame, measure);
+}
+
+/**
+ * Exports held frames for as long as the lowest one is next in line. A gap
+ * is skipped once more than LAMBDA_ReorderWindow frames are held or the
+ * frame after it has waited LAMBDA_ReorderTimeout seconds. The first frame
+ * of an acquisition isn't known, so the start is found the same way.
+ * Called with the driver locked.
+ * \param[in] flush Export everything, used at the end of an acquisition
+ */
+void ADLambda::releaseReordered(bool flush)
+{
+	int window;
+	double timeout;
+	
+	getIntegerParam(LAMBDA_ReorderWindow, &window);
+	getDoubleParam(LAMBDA_ReorderTimeout, &timeout);
+	
+	epicsTimeStamp now;
+	epicsTimeGetCurrent(&now);
+	
+	while (! this->reorderPending.empty())
+	{
+		auto lowest = this->reorderPending.begin();
+		
+		bool in_order = (lowest->first == this->reorderNext);
+		bool overflow = ((int) this->reorderPending.size() > std::max(window, 0));
+		bool expired = (epicsTimeDiffInSeconds(&now, &lowest->second.arrived) >= timeout);
+		
+		if (! in_order && ! overflow && ! expired && ! flush)    { break; }
+		
+		if (! in_order && this->reorderNext >= 0)
+		{
+			int skipped;
+			getIntegerParam(LAMBDA_ReorderSkipped, &skipped);
+			setIntegerParam(LAMBDA_ReorderSkipped, skipped + (lowest->first - this->reorderNext));
+			
+			if (this->xpcs)    { this->xpcs->skip(lowest->first - this->reorderNext); }
+		}
+		
+		reorder_entry entry = lowest->second;
+		
+		this->reorderNext = lowest->first + 1;
+		this->reorderPending.erase(lowest);
+		
+		if (entry.array != NULL)    { this->deliverFrame(entry.array, entry.veto, entry.partial); }
+		else if (this->xpcs)        { this->xpcs->skip(1); }
+	}
+	
+	setIntegerParam(LAMBDA_ReorderDepth, (int) this->reorderPending.size());
+	
+	// This runs for every frame, the counters only go out at the telemetry rate
+	if (flush || epicsTimeDiffInSeconds(&now, &this->lastReorderPublish) >= TELEMETRY_PERIOD)
+	{
+		this->lastReorderPublish = now;
+		callParamCallbacks();
+	}
+}
+
+/**
+ * Creates the per-slice batch attributes once per acquisition, so adding a
+ * frame to a batch only sets values, and decides whether the receivers
+ * stitch frames straight into their batch. That needs each frame to be
+ * done with once it is stitched: the correlator, the phase accumulators,
+ * the veto and packing all keep or change a frame on its own, so with any
+ * of them, or with recording that skips frames, frames are stitched
+ * separately and copied into batches. Called with the driver locked, after
+ * LAMBDA_BatchSize, the recorders, the correlator, the phase bins and the
+ * veto mode are set up.
+ */
+void ADLambda::startBatches()
+{
+	this->batchAttributes->clear();
+	this->batchAttrNames.clear();
+	this->batchFrameAttr.clear();
+	this->batchTimeAttr.clear();
+	this->batchMissingAttr.clear();
+	this->batchDirect = false;
+	
+	if (this->batchSize <= 1)    { return; }
+	
+	int width, height, datatype, depth, packed;
+	
+	getIntegerParam(ADMaxSizeX, &width);
+	getIntegerParam(ADMaxSizeY, &height);
+	getIntegerParam(NDDataType, &datatype);
+	getIntegerParam(LAMBDA_OperatingMode, &depth);
+	getIntegerParam(LAMBDA_PackedOutput, &packed);
+	
+	packed = packed && (depth == ONE_BIT || depth == SIX_BIT) && (elementSize((NDDataType_t) datatype) == 1);
+	
+	this->batchDims[0] = (size_t) width;
+	this->batchDims[1] = (size_t) height;
+	this->batchType = (NDDataType_t) datatype;
+	this->batchDirect = ! this->xpcs && ! this->phaseActive && this->vetoMode == VETO_OFF && ! packed;
+	
+	// Frames only recorded would leave holes that hold every batch open until its timeout
+	int live_every;
+	getIntegerParam(LAMBDA_RecordLiveEvery, &live_every);
+	
+	if (! this->recorders.empty() && live_every != 1)    { this->batchDirect = false; }
+	
+	epicsInt32 zero = 0;
+	epicsFloat64 zero_time = 0.0;
+	epicsUInt64 zero64 = 0;
+	
+	for (int slot = 0; slot < this->batchSize; slot += 1)
+	{
+		std::string index = std::to_string(slot);
+		
+		this->batchAttrNames.push_back("LambdaBatchFrame" + index);
+		this->batchAttrNames.push_back("LambdaBatchTime" + index);
+		this->batchAttrNames.push_back("LambdaBatchMissing" + index);
+		
+		this->batchFrameAttr.push_back(this->batchAttributes->add(this->batchAttrNames[3 * slot].c_str(), "Frame number of a batch slice", NDAttrInt32, &zero));
+		this->batchTimeAttr.push_back(this->batchAttributes->add(this->batchAttrNames[3 * slot + 1].c_str(), "Time stamp of a batch slice", NDAttrFloat64, &zero_time));
+		this->batchMissingAttr.push_back(this->batchAttributes->add(this->batchAttrNames[3 * slot + 2].c_str(), "Inputs missing from a batch slice", NDAttrUInt64, &zero64));
+	}
+}
+
+/**
+ * Adds a frame to the K x height x width batch being collected when
+ * LAMBDA_BatchEnable was set at arm time, and exports the batch once it's
+ * full. A batch only holds consecutive frames of the same shape, not
+ * counting frames removed by the veto, anything else closes it. Frames are
+ * only held here, an export thread copies them into the batch. Packed
+ * frames are exported on their own. Called with the driver locked.
+ */
+void ADLambda::batchFrame(NDArray* frame)
+{
+	if (this->batchSize <= 1)
+	{
+		this->queueFrame(frame);
+		return;
+	}
+	
+	const bool fits = (frame->ndims == 2 && frame->codec.name.empty());
+	
+	if (! this->batchSlices.empty())
+	{
+		NDArray* first = this->batchSlices.front();
+		
+		bool continues = fits && 
+		                 frame->dataType == first->dataType && 
+		                 frame->dims[0].size == first->dims[0].size && 
+		                 frame->dims[1].size == first->dims[1].size && 
+		                 (frame->uniqueId == this->batchLast + 1 || this->vetoContinues(frame->uniqueId));
+		
+		if (! continues)    { this->releaseBatch(true); }
+	}
+	
+	if (! fits)
+	{
+		this->queueFrame(frame);
+		return;
+	}
+	
+	if (this->batchSlices.empty())
+	{
+		this->batchMissing = 0;
+		epicsTimeGetCurrent(&this->batchStarted);
+	}
+	
+	size_t slot = this->batchSlices.size();
+	
+	epicsInt32 frame_no = frame->uniqueId;
+	double stamp = frame->timeStamp;
+	epicsUInt64 missing = 0;
+	
+	NDAttribute* missing_attr = frame->pAttributeList->find("LambdaModuleMissingMask");
+	if (missing_attr != NULL)    { missing_attr->getValue(NDAttrUInt64, &missing); }
+	
+	this->batchFrameAttr[slot]->setValue(&frame_no);
+	this->batchTimeAttr[slot]->setValue(&stamp);
+	this->batchMissingAttr[slot]->setValue(&missing);
+	
+	this->batchMissing |= missing;
+	this->batchLast = frame->uniqueId;
+	this->batchSlices.push_back(frame);
+	
+	if ((int) this->batchSlices.size() >= this->batchSize)    { this->releaseBatch(true); }
+}
+
+/**
+ * Exports the batch being collected, sized to the frames it holds.
+ * Without flush, only once it has been open for LAMBDA_BatchTimeout
+ * seconds, so a slow or stopped acquisition doesn't hold frames back. The
+ * batch array is allocated and stamped here, its pixels are filled in by
+ * the export thread. Called with the driver locked.
+ */
+void ADLambda::releaseBatch(bool flush)
+{
+	if (this->batchSlices.empty())    { return; }
+	
+	if (! flush)
+	{
+		double timeout;
+		getDoubleParam(LAMBDA_BatchTimeout, &timeout);
+		
+		epicsTimeStamp now;
+		epicsTimeGetCurrent(&now);
+		
+		if (epicsTimeDiffInSeconds(&now, &this->batchStarted) < timeout)    { return; }
+	}
+	
+	std::vector<NDArray*> slices;
+	slices.swap(this->batchSlices);
+	
+	NDArray* first = slices.front();
+	epicsInt32 count = (epicsInt32) slices.size();
+	
+	size_t dims[3] = { first->dims[0].size, first->dims[1].size, slices.size() };
+	
+	NDArray* batch = pNDArrayPool->alloc(3, dims, first->dataType, 0, NULL);
+	
+	// Without memory for the batch the frames still go out, one at a time
+	if (batch == NULL)
+	{
+		for (NDArray* frame : slices)    { this->queueFrame(frame); }
+		return;
+	}
+	
+	// The batch is stamped like its first frame and carries the attributes all its frames share
+	batch->uniqueId = first->uniqueId;
+	batch->timeStamp = first->timeStamp;
+	batch->epicsTS = first->epicsTS;
+	batch->codec.name.clear();
+	
+	// Pooled arrays keep the attributes of their last use
+	batch->pAttributeList->clear();
+	first->pAttributeList->copy(batch->pAttributeList);
+	
+	for (const char* name : FRAME_ONLY_ATTR_NAMES)    { batch->pAttributeList->remove(name); }
+	for (const char* name : HISTOGRAM_ATTR_NAMES)     { batch->pAttributeList->remove(name); }
+	
+	this->batchAttributes->copy(batch->pAttributeList);
+	
+	// The slice attributes exist for every slot, a short batch drops the unused ones
+	for (size_t index = 3 * slices.size(); index < this->batchAttrNames.size(); index += 1)
+	{
+		batch->pAttributeList->remove(this->batchAttrNames[index].c_str());
+	}
+	
+	batch->pAttributeList->add("LambdaBatchFrames", "Frames in this batch", NDAttrInt32, &count);
+	
+	// Partial if any of its frames is
+	if (this->batchMissing != 0)
+	{
+		batch->pAttributeList->add("LambdaModuleMissingMask", "Inputs missing from any frame", NDAttrUInt64, &this->batchMissing);
+	}
+	
+	this->queueFrame(batch, slices);
+	
+	incrementValue(LAMBDA_BatchArrays);
+	callParamCallbacks();
+}
+
+/**
+ * Finds the slice a frame is stitched into when the receivers fill batches
+ * directly, opening its batch if this is the batch's first frame. Batches
+ * cover BatchSize frame numbers each, counted from the first frame
+ * reported in the scan point, and are zeroed when opened. Called with the
+ * driver locked.
+ * \return Where the frame's pixels go, or NULL if the frame is dropped: its
+ *         batch has already gone out, its slice was already stitched or
+ *         there was no memory for its batch
+ */
+char* ADLambda::openSlice(int frame_number)
+{
+	if (this->batchBase < 0)    { this->batchBase = frame_number; }
+	
+	int offset = frame_number - this->batchBase;
+	int first = frame_number - (((offset % this->batchSize) + this->batchSize) % this->batchSize);
+	
+	auto found = this->batchGroups.find(first);
+	
+	if (found == this->batchGroups.end())
+	{
+		if (first < this->batchClosedBelow)
+		{
+			incrementValue(LAMBDA_LateFrames);
+			return NULL;
+		}
+		
+		size_t dims[3] = { this->batchDims[0], this->batchDims[1], (size_t) this->batchSize };
+		
+		NDArray* array = pNDArrayPool->alloc(3, dims, this->batchType, 0, NULL);
+		
+		if (array == NULL)
+		{
+			incrementValue(LAMBDA_BadFrameCounter);
+			return NULL;
+		}
+		
+		NDArrayInfo info;
+		array->getInfo(&info);
+		
+		std::memset(array->pData, 0, info.totalBytes);
+		array->codec.name.clear();
+		
+		// Pooled arrays keep the attributes of their last use
+		array->pAttributeList->clear();
+		
+		batch_group& group = this->batchGroups[first];
+		
+		group.array = array;
+		group.pending = 0;
+		group.resolved = 0;
+		group.missing = 0;
+		group.used.assign(this->batchSize, false);
+		group.numbers.assign(this->batchSize, -1);
+		group.stamps.assign(this->batchSize, epicsTimeStamp());
+		group.slice_missing.assign(this->batchSize, 0);
+		epicsTimeGetCurrent(&group.opened);
+		
+		found = this->batchGroups.find(first);
+	}
+	
+	batch_group& group = found->second;
+	int slot = frame_number - first;
+	
+	if (group.used[slot])
+	{
+		incrementValue(LAMBDA_ReorderDuplicates);
+		return NULL;
+	}
+	
+	group.used[slot] = true;
+	group.pending += 1;
+	
+	size_t slice_bytes = this->batchDims[0] * this->batchDims[1] * elementSize(this->batchType);
+	
+	return (char*) group.array->pData + slot * slice_bytes;
+}
+
+/**
+ * Settles the slice of a frame stitched straight into a batch. A kept
+ * frame has its number, time stamp and missing inputs recorded for the
+ * slice attributes and may be picked for the preview, a dropped frame's
+ * slice is cleared. Called with the driver locked.
+ */
+void ADLambda::finishSlice(const stitch_frame& frame, bool keep)
+{
+	int offset = frame.number - this->batchBase;
+	int first = frame.number - (((offset % this->batchSize) + this->batchSize) % this->batchSize);
+	
+	auto found = this->batchGroups.find(first);
+	
+	if (found == this->batchGroups.end())    { return; }
+	
+	batch_group& group = found->second;
+	int slot = frame.number - first;
+	
+	group.pending -= 1;
+	group.resolved += 1;
+	
+	if (keep)
+	{
+		group.numbers[slot] = frame.number;
+		group.stamps[slot] = frame.stamp;
+		group.slice_missing[slot] = frame.missing;
+		group.missing |= frame.missing;
+		
+		this->sendPreview(group.array, slot, frame.number, &frame.stamp);
+	}
+	else
+	{
+		size_t slice_bytes = this->batchDims[0] * this->batchDims[1] * elementSize(this->batchType);
+		
+		std::memset(frame.data, 0, slice_bytes);
+	}
+	
+	this->releaseGroups(false);
+}
+
+/**
+ * Exports batches that receivers stitch into directly, oldest first so
+ * batches go out in frame order. A batch goes once every slice is settled
+ * or, without flush, once it has been open for LAMBDA_BatchTimeout seconds
+ * with none of its frames still being stitched. Trailing empty slices are
+ * left off and a batch without any frames is dropped. Called with the
+ * driver locked.
+ */
+void ADLambda::releaseGroups(bool flush)
+{
+	double timeout;
+	getDoubleParam(LAMBDA_BatchTimeout, &timeout);
+	
+	epicsTimeStamp now;
+	epicsTimeGetCurrent(&now);
+	
+	bool released = false;
+	
+	while (! this->batchGroups.empty())
+	{
+		auto oldest = this->batchGroups.begin();
+		batch_group& group = oldest->second;
+		
+		bool done = flush || 
+		            group.resolved >= this->batchSize || 
+		            (group.pending == 0 && epicsTimeDiffInSeconds(&now, &group.opened) >= timeout);
+		
+		if (! done)    { break; }
+		
+		NDArray* batch = group.array;
+		
+		int count = 0;
+		int slices = 0;
+		
+		for (int slot = 0; slot < this->batchSize; slot += 1)
+		{
+			if (group.numbers[slot] < 0)    { continue; }
+			
+			count += 1;
+			slices = slot + 1;
+		}
+		
+		this->batchClosedBelow = oldest->first + this->batchSize;
+		
+		if (count == 0)
+		{
+			batch->release();
+			this->batchGroups.erase(oldest);
+			continue;
+		}
+		
+		int lead = 0;
+		while (group.numbers[lead] < 0)    { lead += 1; }
+		
+		batch->dims[2].size = slices;
+		batch->uniqueId = group.numbers[lead];
+		batch->epicsTS = group.stamps[lead];
+		batch->timeStamp = batch->epicsTS.secPastEpoch + batch->epicsTS.nsec / 1.e9;
+		
+		if (this->useAttributeTemplate)    { this->attributeTemplate->copy(batch->pAttributeList); }
+		
+		this->frameAttributes->copy(batch->pAttributeList);
+		
+		for (const char* name : FRAME_ONLY_ATTR_NAMES)    { batch->pAttributeList->remove(name); }
+		for (const char* name : HISTOGRAM_ATTR_NAMES)     { batch->pAttributeList->remove(name); }
+		
+		for (int slot = 0; slot < slices; slot += 1)
+		{
+			double stamp = (group.numbers[slot] < 0) ? 0.0 : group.stamps[slot].secPastEpoch + group.stamps[slot].nsec / 1.e9;
+			
+			this->batchFrameAttr[slot]->setValue(&group.numbers[slot]);
+			this->batchTimeAttr[slot]->setValue(&stamp);
+			this->batchMissingAttr[slot]->setValue(&group.slice_missing[slot]);
+		}
+		
+		this->batchAttributes->copy(batch->pAttributeList);
+		
+		for (size_t index = 3 * slices; index < this->batchAttrNames.size(); index += 1)
+		{
+			batch->pAttributeList->remove(this->batchAttrNames[index].c_str());
+		}
+		
+		batch->pAttributeList->add("LambdaBatchFrames", "Frames in this batch", NDAttrInt32, &count);
+		
+		if (group.missing != 0)
+		{
+			batch->pAttributeList->add("LambdaModuleMissingMask", "Inputs missing from any frame", NDAttrUInt64, &group.missing);
+		}
+		
+		this->batchGroups.erase(oldest);
+		this->queueFrame(batch);
+		
+		incrementValue(LAMBDA_BatchArrays);
+		released = true;
+	}
+	
+	if (released)    { callParamCallbacks(); }
+}
+
+bool ADLambda::exportPending()
+{
+	bool output = false;
+	
+	dequeLock->lock();
+		for (auto& queue : this->export_queues)    { output = output || ! queue.empty(); }
+	dequeLock->unlock();
+	
+	return output;
+}
+
+/**
+ * Thread to pull and export NDArrays being generated by the acquisition threads.
+ * Each export thread owns one queue and calls back on the address matching its shard.
+ */
+void ADLambda::exportThread(int shard)
+{	
+	int generation = -1;
+	NDArray* pImage = NULL;
+	std::string role = "export" + std::to_string(shard);
+	
+	while(this->connected)
+	{
+		if (generation != this->placementGeneration)
+		{
+			generation = this->placementGeneration;
+			this->applyPlacement(role);
+		}
+		
+		// Pull from available frames
+		export_item next;
+		next.array = NULL;
+		
+		dequeLock->lock();
+			if (! this->export_queues[shard].empty())
+			{
+				std::swap(next, this->export_queues[shard].front());
+				this->export_queues[shard].pop_front();
+			}
+		dequeLock->unlock();
+		
+		if (next.array == NULL)
+		{
+			epicsThreadSleep(SHORT_TIME);
+			continue;
+		}
+		
+		if (pImage)    { pImage->release(); }
+		pImage = next.array;
+		
+		// Batches are filled in here rather than by the thread that finished their frames
+		if (! next.slices.empty())
+		{
+			NDArrayInfo slice_info;
+			next.slices.front()->getInfo(&slice_info);
+			
+			char* output = (char*) pImage->pData;
+			
+			for (NDArray* slice : next.slices)
+			{
+				std::memcpy(output, slice->pData, slice_info.totalBytes);
+				output += slice_info.totalBytes;
+				
+				slice->release();
+			}
+		}
+		
+		NDArrayInfo info;
+		pImage->getInfo(&info);
+		
+		size_t bytes = pImage->codec.name.empty() ? info.totalBytes : pImage->compressedSize;
+		
+		std::shared_ptr<LambdaShmRing> ring;
+		int shm_mode;
+		double shm_timeout;
+		
+		this->lock();
+			ring = this->shmRing;
+			getIntegerParam(LAMBDA_ShmMode, &shm_mode);
+			getDoubleParam(LAMBDA_ShmTimeout, &shm_timeout);
+		this->unlock();
+		
+		// A lossless ring can block on slow readers, so this happens unlocked
+		if (ring)    { publishShm(ring.get(), pImage, bytes, shm_mode == SHM_LOSSLESS, shm_timeout); }
+		
+		// The ring's counters share its lock with a publish that may be waiting on readers
+		uint64_t shm_published = 0, shm_overruns = 0, shm_oversized = 0;
+		int shm_readers = 0;
+		
+		if (ring)
+		{
+			shm_published = ring->published();
+			shm_overruns = ring->overruns();
+			shm_oversized = ring->oversized();
+			shm_readers = ring->readers();
+		}
+		
+		this->lock();
+			incrementValue(NDArrayCounter);
+			this->setIntegerParam(NDArraySize, (int) bytes);
+			
+			if (ring)
+			{
+				this->setIntegerParam(LAMBDA_ShmPublished, (int) shm_published);
+				this->setIntegerParam(LAMBDA_ShmOverruns, (int) shm_overruns);
+				this->setIntegerParam(LAMBDA_ShmOversized, (int) shm_oversized);
+				this->setIntegerParam(LAMBDA_ShmReaders, shm_readers);
+			}
+		
+			int arrayCallbacks;
+			getIntegerParam(NDArrayCallbacks, &arrayCallbacks);
+		
+			this->callParamCallbacks();
+		this->unlock();
+		
+		// Outside the driver lock so the shards deliver to their plugins in parallel
+		if (arrayCallbacks)    { doCallbacksGenericPointer(pImage, NDArrayData, shard); }
+	}
+	
+	if (pImage)    { pImage->release(); }
+}
+
+
+/**
+ * Thread spawned per detector module, acquires frames from indexed receiver and
+ * copies the data to the correct spot in the stitched image.
+ */
+void ADLambda::acquireThread(int index)
+{
+	lambda_input input = this->inputs[index];
+
+	int width, height, toRead, datatype, dual_mode, depth, live_every, stats_enabled, packed;
+	double exposure;
+	LambdaRawRecorder* recorder = NULL;
+	
+	/**
+	 * Grab parameters that will be used for the entirety of the acquisition
+	 */
+	
+	this->lock();
+		this->getIntegerParam(ADMaxSizeX, &width);
+		this->getIntegerParam(ADMaxSizeY, &height);
+		this->getIntegerParam(ADNumImages, &toRead);
+		this->getIntegerParam(NDDataType, &datatype);
+		this->getIntegerParam(LAMBDA_OperatingMode, &depth);
+		this->getIntegerParam(LAMBDA_DualMode, &dual_mode);
+		this->getDoubleParam(ADAcquireTime, &exposure);
+		this->getIntegerParam(LAMBDA_RecordLiveEvery, &live_every);
+		this->getIntegerParam(LAMBDA_StatsEnable, &stats_enabled);
+		this->getIntegerParam(LAMBDA_PackedOutput, &packed);
+		
+		int veto_min_x, veto_min_y, veto_size_x, veto_size_y, veto_level;
+		
+		this->getIntegerParam(LAMBDA_VetoMinX, &veto_min_x);
+		this->getIntegerParam(LAMBDA_VetoMinY, &veto_min_y);
+		this->getIntegerParam(LAMBDA_VetoSizeX, &veto_size_x);
+		this->getIntegerParam(LAMBDA_VetoSizeY, &veto_size_y);
+		this->getIntegerParam(LAMBDA_VetoPixelLevel, &veto_level);
+		
+		const bool measure_veto = (this->vetoMode != VETO_OFF);
+		
+		// The correlator and the phase accumulators read the unpacked pixels
+		if (this->xpcs || this->phaseActive)    { packed = 0; }
+		
+		const bool phase = this->phaseActive;
+		
+		if (index < (int) this->recorders.size())    { recorder = this->recorders[index].get(); }
+	this->unlock();
+	
+	this->applyPlacement("receiver" + std::to_string(index));
+	
+	// Packing only applies to the byte-per-pixel modes
+	packed = packed && (depth == ONE_BIT || depth == SIX_BIT) && (elementSize((NDDataType_t) datatype) == 1);
+	
+	size_t imagedims_output[2] = { (size_t) width, (size_t) height};
+	const int frame_width  = std::visit([](auto&& arg) -> const int { return arg->frameWidth();  }, input);
+	const int frame_height = std::visit([](auto&& arg) -> const int { return arg->frameHeight(); }, input);
+	int x_shift = 0;
+	int y_shift = 0;
+	
+	std::shared_ptr<LambdaGeometry> geometry;
+	
+	this->lock();
+		if (index < (int) this->inputOffsets.size())
+		{
+			x_shift = this->inputOffsets[index].first;
+			y_shift = this->inputOffsets[index].second;
+		}
+		
+		geometry = this->geometry;
+	this->unlock();
+	
+	const lambda_module_map* remap = geometry ? geometry->module(index) : NULL;
+	
+	// A single input that covers the whole image needs no stitching
+	const bool single = (this->inputs.size() == 1);
+	const bool contiguous = (x_shift == 0 && frame_width == width);
+	
+	// In dual mode the second counter's image goes below the whole first image
+	const int counter_height = dual_mode ? height / 2 : height;
+	
+	// A size of 0 runs the veto region to the edge of the image
+	veto_roi roi;
+	
+	roi.x = std::max(veto_min_x, 0);
+	roi.y = std::max(veto_min_y, 0);
+	roi.width  = (veto_size_x > 0) ? veto_size_x : width - roi.x;
+	roi.height = (veto_size_y > 0) ? veto_size_y : height - roi.y;
+	roi.level = (epicsUInt32) std::max(veto_level, 0);
+	
+	lambda_frame acquired[2];
+	
+	const int bytes_per_element = (int) elementSize((NDDataType_t) datatype);
+	
+	int numAcquired = 0;
+	int dual = 0;
+	
+	while (numAcquired < toRead)
+	{
+		// Empty frame plus the detector saying it's not busy means something's gone wrong.
+		if (! nextFrame(input, 1500, &acquired[dual]))
+		{
+			if (this->detectorBusy())    { continue; }
+			else                  { this->tryStopAcquire(); break; }
+		}
+		
+		/*
+		 * For dual mode, every acquisition is two frames, increment dual to save frame in
+		 * the second slot of acquired.
+		 */
+		if (dual_mode && !dual)    { dual = 1; continue; }
+		else                       { dual = 0; }
+	
+		const int frame_no = acquired[0].nr;
+		
+		/*
+		 * Raw recording writes every frame to disk, only every live_every'th
+		 * frame continues on to be stitched for live view.
+		 */
+		if (recorder)
+		{
+			for (int which = 0; which <= dual_mode; which += 1)
+			{
+				recorder->write(acquired[which].data, acquired[which].nr, (uint32_t) acquired[which].status);
+			}
+			
+			if (live_every <= 0 || (frame_no % live_every) != 0)
+			{
+				releaseFrame(input, acquired[0]);
+				if (dual_mode)    { releaseFrame(input, acquired[1]); }
+				
+				numAcquired += 1;
+				
+				this->lock();
+					this->countBadFrame(index, acquired[0].status | acquired[dual_mode].status);
+					
+					// Consumed by the recording, so the in-order stage doesn't wait for it. Counted once, not per input.
+					this->reorderDrop(frame_no);
+					
+					if (index == 0)    { incrementValue(ADNumImagesCounter); }
+					
+					this->setIntegerParam(index, LAMBDA_RecordFrames, (int) recorder->framesWritten());
+					this->setDoubleParam(index, LAMBDA_RecordBandwidth, recorder->bandwidth());
+					
+					int numBuffered = std::visit([](auto&& arg) -> int { return arg->framesQueued(); }, input);
+					this->updateQueueTelemetry(index, numBuffered);
+				this->unlock();
+				
+				continue;
+			}
+		}
+		
+		NDArray* output = NULL;
+		char* target = NULL;
+		epicsTimeStamp stamp;
+		
+		this->lock();
+			auto found = this->frames.find(frame_no);
+			
+			// The rest of this frame was already evicted, drop the straggler
+			if (! single && found == this->frames.end() && frame_no <= this->staleThrough)
+			{
+				incrementValue(LAMBDA_LateFrames);
+				this->countBadFrame(index, acquired[0].status | acquired[dual_mode].status);
+				this->unlock();
+				
+				releaseFrame(input, acquired[0]);
+				if (dual_mode)    { releaseFrame(input, acquired[1]); }
+				
+				numAcquired += 1;
+				continue;
+			}
+			
+			// If there's not an NDArray stored for this frame_no, create one
+			if ((single || found == this->frames.end()) && this->batchDirect)
+			{
+				target = this->openSlice(frame_no);
+				
+				// Late for a batch that has gone out, already stitched, or no memory for the batch
+				if (target == NULL)
+				{
+					this->countBadFrame(index, acquired[0].status | acquired[dual_mode].status);
+					this->unlock();
+					
+					releaseFrame(input, acquired[0]);
+					if (dual_mode)    { releaseFrame(input, acquired[1]); }
+					
+					numAcquired += 1;
+					continue;
+				}
+				
+				updateTimeStamp(&stamp);
+			}
+			else if (single || found == this->frames.end())
+			{
+				output = this->framePool->alloc(2, imagedims_output, (NDDataType_t) datatype, 0, NULL);
+				output->uniqueId = frame_no;
+				output->codec.name.clear();
+				
+				updateTimeStamps(output);
+				
+				target = (char*) output->pData;
+				stamp = output->epicsTS;
+			
+				memset(target, 0, imagedims_output[0] * imagedims_output[1] * bytes_per_element);
+			}
+			
+			if (single || found == this->frames.end())
+			{
+				if (! single)
+				{
+					stitch_frame& entry = this->frames[frame_no];
+					
+					entry.array = output;
+					entry.data = target;
+					entry.number = frame_no;
+					entry.stamp = stamp;
+					entry.reported = 0;
+					entry.contributed = 0;
+					entry.writers = 1;
+					entry.bad = false;
+					entry.has_stats = stats_enabled;
+					entry.packed = packed;
+					entry.missing = 0;
+					std::memset(&entry.stats, 0, sizeof(frame_stats));
+					std::memset(&entry.veto, 0, sizeof(veto_measure));
+					epicsTimeGetCurrent(&entry.first_seen);
+				}
+				
+				incrementValue(ADNumImagesCounter);
+			}
+			else
+			{
+				output = found->second.array;
+				target = found->second.data;
+				found->second.writers += 1;
+			}
+		this->unlock();
+		
+		numAcquired += 1;
+		
+		// If not in dual mode, will just take the first status twice
+		int bad_frame = (acquired[0].status | acquired[dual_mode].status); 
+		
+		frame_stats module_stats;
+		std::memset(&module_stats, 0, sizeof(frame_stats));
+		
+		frame_stats* stats = stats_enabled ? &module_stats : NULL;
+		
+		veto_measure module_veto = { 0, 0 };
+		
+		// Stitch frame into its correct spot in the NDArray
+		if (bad_frame == (int) xsp::FrameStatusCode::FRAME_OK)
+		{
+			if (! this->fake)
+			{
+				for (int which = 0; which <= dual_mode; which += 1)
+				{
+					char* in_data = (char*) acquired[which].data;
+					char* out_data = target;
+
+					if (remap)
+					{
+						int out_offset = counter_height * which * width * bytes_per_element;
+						
+						remapPixels(&out_data[out_offset], in_data, *remap, bytes_per_element, depth, stats);
+					}
+					else if (contiguous)
+					{
+						int in_offset = 0;
+						int out_offset = (y_shift + counter_height * which) * width * bytes_per_element;
+					
+						copyPixels(&out_data[out_offset], &in_data[in_offset], frame_height * frame_width, bytes_per_element, depth, stats);
+					}
+					else
+					{
+						for (int row = 0; row < frame_height; row += 1)
+						{
+							int in_offset = row * frame_width * bytes_per_element;
+							int out_offset = ((y_shift + row + (counter_height * which)) * width + x_shift) * bytes_per_element;
+						
+							copyPixels(&out_data[out_offset], &in_data[in_offset], frame_width, bytes_per_element, depth, stats);
+						}
+					}
+					
+					if (measure_veto)
+					{
+						measureModule(in_data, bytes_per_element, remap, frame_width, frame_height, width, 
+						              x_shift, (remap ? 0 : y_shift) + counter_height * which, roi, &module_veto);
+					}
+				}
+			}
+		}
+		
+		releaseFrame(input, acquired[0]);
+		if (dual_mode)    { releaseFrame(input, acquired[1]); }
+
+		
+		bool finished = false;
+		stitch_frame complete;
+		
+		this->lock();
+			this->countBadFrame(index, bad_frame);
+			
+			if (single)
+			{
+				complete.array = output;
+				complete.data = target;
+				complete.number = frame_no;
+				complete.stamp = stamp;
+				complete.reported = 1;
+				complete.bad = (bad_frame != 0);
+				complete.has_stats = stats_enabled;
+				complete.packed = packed;
+				complete.missing = 0;
+				complete.stats = module_stats;
+				complete.veto = module_veto;
+				
+				finished = true;
+			}
+			else
+			{
+				stitch_frame& entry = this->frames[frame_no];
+				
+				entry.reported += 1;
+				entry.writers -= 1;
+				entry.contributed |= ((epicsUInt64) 1 << (index % 64));
+				entry.bad = entry.bad || (bad_frame != 0);
+				
+				if (stats_enabled)    { mergeStats(&entry.stats, module_stats); }
+				
+				entry.veto.sum += module_veto.sum;
+				entry.veto.above += module_veto.above;
+				
+				// Once every input has reported, the frame is finished
+				if (entry.reported >= this->inputs.size())
+				{
+					complete = entry;
+					this->frames.erase(frame_no);
+					
+					finished = true;
+				}
+				
+				this->evictStale(frame_no, false);
+			}
+		
+			int numBuffered = std::visit([](auto&& arg) -> int { return arg->framesQueued(); }, input);
+			this->updateQueueTelemetry(index, numBuffered);
+		
+		this->unlock();
+		
+		if (finished)
+		{
+			// Every input is done writing, so the thread that finished the frame packs it unlocked
+			if (complete.packed && ! complete.bad)    { packFrame(complete.array, depth); }
+			
+			this->lock();
+				this->completeFrame(complete);
+			this->unlock();
+			
+			// And sums whatever the in-order stage has let through, its own frame or not
+			if (phase)    { this->accumulatePhase(); }
+		}
+	}
+	
+	this->threadFinishEvents[index]->trigger();
+}
+
+/**
+ * Final step for a frame once every input has reported. Bad frames are
+ * dropped, good ones get their statistics attached and are queued for
+ * export. A frame stitched straight into a batch only settles its slice.
+ * Called with the driver locked.
+ */
+void ADLambda::completeFrame(stitch_frame& frame)
+{
+	if (frame.bad)
+	{
+		incrementValue(LAMBDA_BadFrameCounter);
+		
+		if (frame.array == NULL)
+		{
+			this->finishSlice(frame, false);
+			return;
+		}
+		
+		this->reorderDrop(frame.array->uniqueId);
+		frame.array->release();
+		return;
+	}
+	
+	if (frame.has_stats)    { this->publishStats(frame.stats); }
+	
+	// Stitched straight into a batch, which goes out once all its slices are done with
+	if (frame.array == NULL)
+	{
+		this->finishSlice(frame, true);
+		return;
+	}
+	
+	// Frames finished by a receiver are already packed, only evicted partial frames get here unpacked.
+	// The pixels don't change after this, so the preview thread can read them.
+	if (frame.packed && frame.array->codec.name.empty())
+	{
+		int depth;
+		getIntegerParam(LAMBDA_OperatingMode, &depth);
+		
+		this->packFrame(frame.array, depth);
+	}
+	
+	this->stampAttributes(frame);
+	
+	// Rare enough to add by name, the next stamp of this array notices the extra attribute
+	if (frame.missing != 0)
+	{
+		epicsUInt64 missing = frame.missing;
+		frame.array->pAttributeList->add("LambdaModuleMissingMask", "Inputs missing from this frame", NDAttrUInt64, &missing);
+	}
+	
+	// Ahead of everything that may keep the frame from the plugins
+	this->sendPreview(frame.array);
+	
+	this->reorderFrame(frame.array, frame.veto, frame.missing != 0);
+}
+
+/**
+ * Removes incomplete frames from the reassembly map once they are more
+ * than LAMBDA_StaleDistance frames behind the newest one any input has
+ * reported or older than LAMBDA_StaleAge seconds, both off by default.
+ * A frame a receiver may still have buffered is never evicted: the
+ * distance is at least the largest receiver queue capacity, and the age
+ * only counts while the inputs it is missing have nothing queued.
+ * Depending on LAMBDA_StaleMode they're either released or delivered with
+ * a LambdaModuleMissingMask attribute. The map is ordered by frame number
+ * so only its head needs checking. Called with the driver locked.
+ * \param[in] newest Frame number just reported by an input
+ * \param[in] flush Evict everything regardless of age, used at the end of an acquisition
+ */
+void ADLambda::evictStale(int newest, bool flush)
+{
+	int mode, distance;
+	double max_age;
+	
+	getIntegerParam(LAMBDA_StaleMode, &mode);
+	getIntegerParam(LAMBDA_StaleDistance, &distance);
+	getDoubleParam(LAMBDA_StaleAge, &max_age);
+	
+	this->newestFrame = std::max(this->newestFrame, newest);
+	
+	epicsTimeStamp now;
+	epicsTimeGetCurrent(&now);
+	
+	size_t num_inputs = std::min(this->inputs.size(), (size_t) 64);
+	epicsUInt64 all_inputs = (num_inputs == 64) ? ~(epicsUInt64) 0 : (((epicsUInt64) 1 << num_inputs) - 1);
+	
+	// A lagging receiver can hold up to its capacity in frames that will still arrive
+	if (distance > 0)
+	{
+		for (size_t index = 0; index < num_inputs; index += 1)
+		{
+			int capacity;
+			getIntegerParam(index, LAMBDA_QueueCapacity, &capacity);
+			
+			if (capacity <= 0 && index < this->inputCapacity.size())    { capacity = this->inputCapacity[index]; }
+			
+			distance = std::max(distance, capacity);
+		}
+	}
+	
+	bool evicted = false;
+	
+	while (! this->frames.empty())
+	{
+		auto oldest = this->frames.begin();
+		stitch_frame& entry = oldest->second;
+		
+		if (entry.writers > 0)    { break; }
+		
+		epicsUInt64 missing = all_inputs & ~entry.contributed;
+		
+		bool queued = false;
+		
+		for (size_t index = 0; index < num_inputs && index < this->telemetry.size(); index += 1)
+		{
+			if ((missing & ((epicsUInt64) 1 << index)) && this->telemetry[index].last_depth > 0)    { queued = true; }
+		}
+		
+		bool stale = flush || 
+		             (distance > 0 && (this->newestFrame - oldest->first) > distance) ||
+		             (max_age > 0.0 && ! queued && epicsTimeDiffInSeconds(&now, &entry.first_seen) > max_age);
+		
+		if (! stale)    { break; }
+		
+		for (size_t index = 0; index < num_inputs; index += 1)
+		{
+			if (missing & ((epicsUInt64) 1 << index))
+			{
+				int count;
+				getIntegerParam(index, LAMBDA_ModuleMissing, &count);
+				setIntegerParam(index, LAMBDA_ModuleMissing, count + 1);
+				callParamCallbacks(index);
+			}
+		}
+		
+		incrementValue(LAMBDA_StaleFrames);
+		this->staleThrough = std::max(this->staleThrough, oldest->first);
+		
+		if (mode == STALE_DELIVER)
+		{
+			entry.missing = missing;
+			this->completeFrame(entry);
+		}
+		else if (entry.array == NULL)
+		{
+			this->finishSlice(entry, false);
+		}
+		else
+		{
+			this->reorderDrop(oldest->first);
+			entry.array->release();
+		}
+		
+		this->frames.erase(oldest);
+		evicted = true;
+	}
+	
+	setIntegerParam(LAMBDA_PendingFrames, (int) this->frames.size());
+	
+	if (evicted)    { callParamCallbacks(); }
+}
+
+/**
+ * Packs a 1-bit or 6-bit frame in place. The NDArray keeps its dimensions
+ * and data type, codec.name and compressedSize describe the packed data so
+ * that plugins which aren't codec aware skip it. See LambdaPack.h for the
+ * unpack functions.
+ */
+void ADLambda::packFrame(NDArray* frame, int depth)
+{
+	NDArrayInfo info;
+	frame->getInfo(&info);
+	
+	uint8_t* data = (uint8_t*) frame->pData;
+	
+	if (depth == ONE_BIT)
+	{
+		frame->compressedSize = lambdaPack1(data, data, info.nElements);
+		frame->codec.name = LAMBDA_CODEC_PACK1;
+	}
+	else
+	{
+		frame->compressedSize = lambdaPack6(data, data, info.nElements);
+		frame->codec.name = LAMBDA_CODEC_PACK6;
+	}
+}
+
+/**
+ * Expands a frame packed by packFrame into a new byte per pixel NDArray
+ * with the same metadata. Returns NULL if the pool is exhausted.
+ */
+NDArray* ADLambda::unpackFrame(NDArray* frame)
+{
+	size_t dims[ND_ARRAY_MAX_DIMS];
+	
+	for (int dim = 0; dim < frame->ndims; dim += 1)    { dims[dim] = frame->dims[dim].size; }
+	
+	NDArray* output = pNDArrayPool->alloc(frame->ndims, dims, NDUInt8, 0, NULL);
+	
+	if (output == NULL)    { return NULL; }
+	
+	NDArrayInfo info;
+	output->getInfo(&info);
+	
+	if (frame->codec.name == LAMBDA_CODEC_PACK1)    { lambdaUnpack1((const uint8_t*) frame->pData, (uint8_t*) output->pData, info.nElements); }
+	else                                            { lambdaUnpack6((const uint8_t*) frame->pData, (uint8_t*) output->pData, info.nElements); }
+	
+	output->uniqueId = frame->uniqueId;
+	output->timeStamp = frame->timeStamp;
+	output->epicsTS = frame->epicsTS;
+	frame->pAttributeList->copy(output->pAttributeList);
+	output->pAttributeList->remove("LambdaPackedBits");
+	
+	return output;
+}
+
+/**
+ * Sets up the phase accumulators when LAMBDA_PhaseEnable is set. Frames
+ * are summed into bin (frame number % LAMBDA_PhaseBins) instead of being
+ * exported, and all bins go out once every LAMBDA_PhaseCycles cycles.
+ * Called with the driver locked, after the image size is final.
+ */
+void ADLambda::startPhaseBins()
+{
+	int enable, bins, cycles, width, height;
+	
+	getIntegerParam(LAMBDA_PhaseEnable, &enable);
+	getIntegerParam(LAMBDA_PhaseBins, &bins);
+	getIntegerParam(LAMBDA_PhaseCycles, &cycles);
+	getIntegerParam(ADMaxSizeX, &width);
+	getIntegerParam(ADMaxSizeY, &height);
+	
+	this->setIntegerParam(LAMBDA_PhaseBlocks, 0);
+	this->setIntegerParam(LAMBDA_PhaseLate, 0);
+	this->phaseActive = (enable != 0);
+	this->phaseBlock = -1;
+	
+	if (! this->phaseActive)
+	{
+		this->phaseSums.clear();
+		return;
+	}
+	
+	bins = std::max(1, std::min(bins, PHASE_MAX_BINS));
+	
+	this->phaseCycles = std::max(1, cycles);
+	this->phaseDims[0] = (size_t) width;
+	this->phaseDims[1] = (size_t) height;
+	this->phaseSums.assign(bins, std::vector<epicsUInt32>((size_t) width * height, 0));
+	this->phaseFrames.assign(bins, 0);
+}
+
+/**
+ * Sums a frame into bin (frame number % bins). A frame from a later block
+ * sends out the current one first, a frame whose block has already gone
+ * out is counted in LAMBDA_PhaseLate. Called with phaseLock held.
+ * \param[out] finished Images of a block the frame closed
+ * \return Whether the frame was summed
+ */
+bool ADLambda::sumPhase(NDArray* frame, std::vector<NDArray*>& finished)
+{
+	int bins = (int) this->phaseSums.size();
+	int frame_no = frame->uniqueId;
+	int block = frame_no / (bins * this->phaseCycles);
+	
+	if (block < this->phaseBlock)    { return false; }
+	
+	if (block > this->phaseBlock)
+	{
+		this->takePhaseBins(finished);
+		this->phaseBlock = block;
+	}
+	
+	int bin = frame_no % bins;
+	
+	NDArrayInfo info;
+	frame->getInfo(&info);
+	
+	std::vector<epicsUInt32>& sums = this->phaseSums[bin];
+	size_t count = std::min(info.nElements, sums.size());
+	
+	switch (frame->dataType)
+	{
+		case NDUInt8:     addPixels(sums.data(), (const epicsUInt8*) frame->pData, count);     break;
+		case NDUInt16:    addPixels(sums.data(), (const epicsUInt16*) frame->pData, count);    break;
+		case NDUInt32:    addPixels(sums.data(), (const epicsUInt32*) frame->pData, count);    break;
+		default:          break;
+	}
+	
+	this->phaseFrames[bin] += 1;
+	
+	return true;
+}
+
+/**
+ * Sums the frames the in-order stage has passed on, so blocks close in
+ * frame order and a frame finished late by one input still lands in its
+ * block. Called without the driver lock by the receiver threads after
+ * they complete a frame and by the acquisition thread while it waits,
+ * phaseLock keeps the frames in queue order and the sums consistent.
+ */
+void ADLambda::accumulatePhase()
+{
+	std::vector<NDArray*> finished;
+	std::vector<NDArray*> summed;
+	int late = 0;
+	
+	this->phaseLock->lock();
+		while (! this->phaseQueue.empty())
+		{
+			NDArray* frame = this->phaseQueue.front();
+			this->phaseQueue.pop_front();
+			
+			if (! this->sumPhase(frame, finished))    { late += 1; }
+			
+			summed.push_back(frame);
+		}
+	this->phaseLock->unlock();
+	
+	for (NDArray* frame : summed)    { frame->release(); }
+	
+	if (late == 0 && finished.empty())    { return; }
+	
+	this->lock();
+		if (late > 0)
+		{
+			int count;
+			getIntegerParam(LAMBDA_PhaseLate, &count);
+			setIntegerParam(LAMBDA_PhaseLate, count + late);
+		}
+		
+		this->queuePhaseBins(finished);
+		callParamCallbacks();
+	this->unlock();
+}
+
+/**
+ * Copies the sums of the current block into one UInt32 image per bin and
+ * clears them for the next block. Called with phaseLock held.
+ * \param[out] output Images for the block, nothing if no block is open
+ */
+void ADLambda::takePhaseBins(std::vector<NDArray*>& output)
+{
+	if (this->phaseBlock < 0)    { return; }
+	
+	int bins = (int) this->phaseSums.size();
+	
+	for (int bin = 0; bin < bins; bin += 1)
+	{
+		std::vector<epicsUInt32>& sums = this->phaseSums[bin];
+		
+		NDArray* image = pNDArrayPool->alloc(2, this->phaseDims, NDUInt32, 0, NULL);
+		
+		if (image != NULL)
+		{
+			image->uniqueId = this->phaseBlock * bins + bin;
+			image->codec.name.clear();
+			
+			std::memcpy(image->pData, sums.data(), sums.size() * sizeof(epicsUInt32));
+			
+			image->pAttributeList->add("LambdaPhaseBin", "Phase bin", NDAttrInt32, &bin);
+			image->pAttributeList->add("LambdaPhaseBlock", "Phase accumulation block", NDAttrInt32, &this->phaseBlock);
+			image->pAttributeList->add("LambdaPhaseFrames", "Frames summed into this bin", NDAttrUInt32, &this->phaseFrames[bin]);
+			
+			output.push_back(image);
+		}
+		
+		std::fill(sums.begin(), sums.end(), 0);
+		this->phaseFrames[bin] = 0;
+	}
+	
+	this->phaseBlock = -1;
+}
+
+/**
+ * Exports the images of a finished block. Called with the driver locked.
+ */
+void ADLambda::queuePhaseBins(const std::vector<NDArray*>& images)
+{
+	if (images.empty())    { return; }
+	
+	for (NDArray* image : images)
+	{
+		updateTimeStamps(image);
+		this->queueFrame(image);
+	}
+	
+	incrementValue(LAMBDA_PhaseBlocks);
+}
+
+/**
+ * Sums the frames still queued and exports the partly summed block at the
+ * end of an acquisition or scan point. Called with the driver locked once
+ * the receivers have finished and the in-order stage has been flushed.
+ */
+void ADLambda::emitPhaseBins()
+{
+	std::vector<NDArray*> finished;
+	std::vector<NDArray*> summed;
+	
+	this->phaseLock->lock();
+		while (! this->phaseQueue.empty())
+		{
+			NDArray* frame = this->phaseQueue.front();
+			this->phaseQueue.pop_front();
+			
+			if (! this->sumPhase(frame, finished))    { incrementValue(LAMBDA_PhaseLate); }
+			
+			summed.push_back(frame);
+		}
+		
+		this->takePhaseBins(finished);
+	this->phaseLock->unlock();
+	
+	for (NDArray* frame : summed)    { frame->release(); }
+	
+	this->queuePhaseBins(finished);
+	callParamCallbacks();
+}
+
+/**
+ * Hands the frame to the preview thread when a preview is due, either
+ * LAMBDA_PreviewRate times a second or every LAMBDA_PreviewEvery'th
+ * frame. Only the newest due frame is kept, so a slow viewer never holds
+ * up stitching. The full-rate addresses are unaffected. Called with the
+ * driver locked.
+ * \param[in] slice Slice of a batch the frame was stitched into, -1 for a frame array
+ * \param[in] frame_number Number of the frame in the slice
+ * \param[in] stamp Time stamp of the frame in the slice
+ */
+void ADLambda::sendPreview(NDArray* frame, int slice, int frame_number, const epicsTimeStamp* stamp)
+{
+	int enable, mode, every, factor, callbacks;
+	double rate;
+	
+	getIntegerParam(LAMBDA_PreviewEnable, &enable);
+	getIntegerParam(NDArrayCallbacks, &callbacks);
+	
+	if (! enable || ! callbacks)    { return; }
+	
+	getIntegerParam(LAMBDA_PreviewMode, &mode);
+	getIntegerParam(LAMBDA_PreviewEvery, &every);
+	getIntegerParam(LAMBDA_PreviewBinning, &factor);
+	getDoubleParam(LAMBDA_PreviewRate, &rate);
+	
+	epicsTimeStamp now;
+	epicsTimeGetCurrent(&now);
+	
+	if (mode == PREVIEW_EVERY_NTH)
+	{
+		if (slice < 0)    { frame_number = frame->uniqueId; }
+		
+		if (every <= 0 || (frame_number % every) != 0)    { return; }
+	}
+	else
+	{
+		if (rate <= 0.0 || epicsTimeDiffInSeconds(&now, &this->lastPreview) < (1.0 / rate))    { return; }
+	}
+	
+	this->lastPreview = now;
+	
+	frame->reserve();
+	
+	NDArray* replaced;
+	
+	dequeLock->lock();
+		replaced = this->previewPending;
+		this->previewPending = frame;
+		this->previewSlice = slice;
+		this->previewBinning = factor;
+		
+		if (slice >= 0)
+		{
+			this->previewFrame = frame_number;
+			this->previewStamp = *stamp;
+		}
+	dequeLock->unlock();
+	
+	if (replaced)    { replaced->release(); }
+}
+
+/**
+ * Makes the preview image of a frame, unpacked and binned by
+ * LAMBDA_PreviewBinning blocks of pixels. Runs on the preview thread
+ * without the driver lock.
+ * \param[in] slice Slice of a batch to take the frame from, -1 for a frame array
+ * \return The new array, or NULL if it couldn't be allocated
+ */
+NDArray* ADLambda::buildPreview(NDArray* frame, int slice, int factor)
+{
+	size_t width = frame->dims[0].size;
+	size_t height = frame->dims[1].size;
+	
+	factor = std::max(1, std::min(factor, (int) std::min(width, height)));
+	
+	const char* pixels = (const char*) frame->pData;
+	
+	if (slice >= 0)    { pixels += slice * width * height * elementSize(frame->dataType); }
+	
+	// Viewers can't decode the packed formats, so the preview always carries plain pixels
+	NDArray* unpacked = NULL;
+	
+	if (! frame->codec.name.empty())
+	{
+		unpacked = this->unpackFrame(frame);
+		
+		if (unpacked == NULL)    { return NULL; }
+		
+		frame = unpacked;
+		pixels = (const char*) frame->pData;
+	}
+	
+	NDArray* output;
+	
+	if (factor == 1 && unpacked)
+	{
+		output = unpacked;
+		unpacked = NULL;
+	}
+	else if (factor == 1 && slice < 0)
+	{
+		output = pNDArrayPool->copy(frame, NULL, true);
+	}
+	else
+	{
+		size_t dims[2] = { width / factor, height / factor };
+		
+		output = pNDArrayPool->alloc(2, dims, frame->dataType, 0, NULL);
+		
+		if (output != NULL)
+		{
+			// A slice of a batch at full size still needs its own 2D array
+			if (factor == 1)
+			{
+				std::memcpy(output->pData, pixels, width * height * elementSize(frame->dataType));
+			}
+			else
+			{
+				switch (frame->dataType)
+				{
+					case NDUInt8:     binPixels((epicsUInt8*) output->pData, (const epicsUInt8*) pixels, width, height, factor);      break;
+					case NDUInt16:    binPixels((epicsUInt16*) output->pData, (const epicsUInt16*) pixels, width, height, factor);    break;
+					case NDUInt32:    binPixels((epicsUInt32*) output->pData, (const epicsUInt32*) pixels, width, height, factor);    break;
+					default:          break;
+				}
+			}
+			
+			output->uniqueId = frame->uniqueId;
+			output->timeStamp = frame->timeStamp;
+			output->epicsTS = frame->epicsTS;
+			frame->pAttributeList->copy(output->pAttributeList);
+		}
+	}
+	
+	if (unpacked)    { unpacked->release(); }
+	
+	if (output == NULL)    { return NULL; }
+	
+	output->pAttributeList->add("LambdaPreviewBinning", "Preview binning factor", NDAttrInt32, &factor);
+	
+	return output;
+}
+
+/**
+ * Thread that turns frames picked by sendPreview into preview images and
+ * calls back on the preview address (numExports).
+ */
+void ADLambda::previewThread()
+{
+	int generation = -1;
+	
+	while (this->connected)
+	{
+		if (generation != this->placementGeneration)
+		{
+			generation = this->placementGeneration;
+			this->applyPlacement("preview");
+		}
+		
+		NDArray* frame;
+		int factor, slice, frame_number;
+		epicsTimeStamp stamp;
+		
+		dequeLock->lock();
+			frame = this->previewPending;
+			factor = this->previewBinning;
+			slice = this->previewSlice;
+			frame_number = this->previewFrame;
+			stamp = this->previewStamp;
+			this->previewPending = NULL;
+		dequeLock->unlock();
+		
+		if (frame == NULL)
+		{
+			epicsThreadSleep(SHORT_TIME);
+			continue;
+		}
+		
+		NDArray* output = this->buildPreview(frame, slice, factor);
+		frame->release();
+		
+		if (output == NULL)    { continue; }
+		
+		// A batch slice is stamped like the frame in it, not like the batch
+		if (slice >= 0)
+		{
+			output->uniqueId = frame_number;
+			output->epicsTS = stamp;
+			output->timeStamp = stamp.secPastEpoch + stamp.nsec / 1.e9;
+		}
+		
+		this->lock();
+			incrementValue(LAMBDA_PreviewFrames);
+			callParamCallbacks();
+		this->unlock();
+		
+		doCallbacksGenericPointer(output, NDArrayData, this->numExports);
+		output->release();
+	}
+}
+
+/**
+ * Builds the attribute lists frames are stamped from. The per-frame list
+ * is a fixed set: the frame number, status and time stamp, the scan point
+ * during threshold scans, the frame statistics, the veto result and the
+ * export sequence when those are in use. With LAMBDA_AttributeTemplate
+ * set, a second list holds the driver's attribute file, evaluated once,
+ * plus the armed detector settings. Frames created for an earlier layout
+ * are rebuilt on their next stamp. Called with the driver locked, after
+ * the settings have gone to the detector and again at each scan point.
+ */
+void ADLambda::buildAttributeTemplate()
+{
+	int use_template, stats_enabled, veto_mode, export_mode;
+	double threshold;
+	
+	getIntegerParam(LAMBDA_AttributeTemplate, &use_template);
+	getIntegerParam(LAMBDA_StatsEnable, &stats_enabled);
+	getIntegerParam(LAMBDA_VetoMode, &veto_mode);
+	getIntegerParam(LAMBDA_ExportMode, &export_mode);
+	getDoubleParam(LAMBDA_EnergyThreshold, &threshold);
+	
+	this->useAttributeTemplate = use_template;
+	this->attributeTemplate->clear();
+	this->attributeGeneration += 1;
+	
+	if (use_template)
+	{
+		NDAttributeList* settings = this->attributeTemplate.get();
+		
+		this->getAttributes(settings);
+		
+		int depth, dual, charge, gating, trigger;
+		double dual_threshold, exposure;
+		
+		getIntegerParam(LAMBDA_OperatingMode, &depth);
+		getIntegerParam(LAMBDA_DualMode, &dual);
+		getIntegerParam(LAMBDA_ChargeSumming, &charge);
+		getIntegerParam(LAMBDA_GatingEnable, &gating);
+		getIntegerParam(ADTriggerMode, &trigger);
+		getDoubleParam(LAMBDA_DualThreshold, &dual_threshold);
+		getDoubleParam(ADAcquireTime, &exposure);
+		
+		size_t num_inputs = std::min(this->inputs.size(), (size_t) 64);
+		epicsUInt64 all_inputs = (num_inputs == 64) ? ~(epicsUInt64) 0 : (((epicsUInt64) 1 << num_inputs) - 1);
+		
+		settings->add("LambdaBitDepth", "Counter depth (bits)", NDAttrInt32, &depth);
+		settings->add("LambdaDualMode", "Dual threshold mode", NDAttrInt32, &dual);
+		settings->add("LambdaChargeSumming", "Charge summing mode", NDAttrInt32, &charge);
+		settings->add("LambdaGating", "Gating enabled", NDAttrInt32, &gating);
+		settings->add("LambdaTriggerMode", "Trigger mode", NDAttrInt32, &trigger);
+		settings->add("LambdaThreshold", "Energy threshold (keV)", NDAttrFloat64, &threshold);
+		settings->add("LambdaDualThreshold", "Upper energy threshold (keV)", NDAttrFloat64, &dual_threshold);
+		settings->add("LambdaAcquireTime", "Frame exposure (s)", NDAttrFloat64, &exposure);
+		settings->add("LambdaInputMask", "Inputs stitched into each frame", NDAttrUInt64, &all_inputs);
+	}
+	
+	NDAttributeList* list = this->frameAttributes.get();
+	
+	list->clear();
+	
+	if (this->scanActive)
+	{
+		int point;
+		getIntegerParam(LAMBDA_ScanPoint, &point);
+		
+		list->add("LambdaScanPoint", "Threshold scan point", NDAttrInt32, &point);
+		list->add("LambdaThreshold", "Energy threshold (keV)", NDAttrFloat64, &threshold);
+	}
+	
+	epicsInt32 zero = 0;
+	epicsUInt32 zero32 = 0;
+	epicsUInt64 zero64 = 0;
+	epicsFloat64 zero_time = 0.0;
+	
+	list->add("LambdaFrameNumber", "Detector frame number", NDAttrInt32, &zero);
+	list->add("LambdaFrameStatus", "0 complete, 1 delivered with inputs missing", NDAttrInt32, &zero);
+	list->add("LambdaTimeStamp", "Frame time stamp (s)", NDAttrFloat64, &zero_time);
+	
+	if (stats_enabled)
+	{
+		list->add("LambdaTotalCounts", "Sum of all pixels", NDAttrUInt64, &zero64);
+		list->add("LambdaMaxPixel", "Largest pixel value", NDAttrUInt32, &zero32);
+		list->add("LambdaSaturatedPixels", "Pixels at the counter limit", NDAttrUInt32, &zero32);
+		
+		for (int bin = 0; bin < NUM_HISTOGRAM_BINS; bin += 1)
+		{
+			list->add(HISTOGRAM_ATTR_NAMES[bin], "Pixels in a histogram bin", NDAttrUInt32, &zero32);
+		}
+	}
+	
+	if (veto_mode != VETO_OFF)    { list->add("LambdaVetoTrigger", "Frame passed the veto", NDAttrInt32, &zero); }
+	
+	if (export_mode != EXPORT_SINGLE)
+	{
+		list->add("LambdaSequence", "Export sequence number", NDAttrUInt64, &zero64);
+		list->add("LambdaShard", "Export address", NDAttrInt32, &zero);
+	}
+}
+
+/**
+ * Returns the attributes stamped onto a frame during its current use, or
+ * NULL for arrays that aren't stitched frames of this layout. Called with
+ * the driver locked.
+ */
+frame_attributes* ADLambda::cachedAttributes(NDArray* frame)
+{
+	auto found = this->frameAttributeCache.find(frame);
+	
+	if (found == this->frameAttributeCache.end() || found->second.generation != this->attributeGeneration)    { return NULL; }
+	
+	return &found->second;
+}
+
+/**
+ * Sets a frame's per-frame attributes. Frame arrays keep their attributes
+ * in the pool, so normally this only stores values through the pointers
+ * cached for the array. The lists are copied on only the first time an
+ * array is used for a layout, or if its attribute count shows something
+ * was added or cleared since. Called with the driver locked.
+ */
+void ADLambda::stampAttributes(const stitch_frame& frame)
+{
+	NDArray* array = frame.array;
+	NDAttributeList* list = array->pAttributeList;
+	
+	const bool packed = ! array->codec.name.empty();
+	
+	frame_attributes& cached = this->frameAttributeCache[array];
+	
+	if (cached.generation != this->attributeGeneration || cached.count != list->count() || cached.packed != packed)
+	{
+		list->clear();
+		
+		if (this->useAttributeTemplate)    { this->attributeTemplate->copy(list); }
+		
+		this->frameAttributes->copy(list);
+		
+		epicsInt32 zero = 0;
+		
+		cached.packed_bits = packed ? list->add("LambdaPackedBits", "Bits per pixel in the packed data", NDAttrInt32, &zero) : NULL;
+		
+		cached.frame_number = list->find("LambdaFrameNumber");
+		cached.status = list->find("LambdaFrameStatus");
+		cached.time_stamp = list->find("LambdaTimeStamp");
+		cached.veto_trigger = list->find("LambdaVetoTrigger");
+		cached.sequence = list->find("LambdaSequence");
+		cached.shard = list->find("LambdaShard");
+		cached.total = list->find("LambdaTotalCounts");
+		cached.maximum = list->find("LambdaMaxPixel");
+		cached.saturated = list->find("LambdaSaturatedPixels");
+		
+		for (int bin = 0; bin < NUM_HISTOGRAM_BINS; bin += 1)    { cached.histogram[bin] = list->find(HISTOGRAM_ATTR_NAMES[bin]); }
+		
+		cached.generation = this->attributeGeneration;
+		cached.count = list->count();
+		cached.packed = packed;
+	}
+	
+	epicsInt32 frame_no = array->uniqueId;
+	epicsInt32 status = (frame.missing != 0) ? 1 : 0;
+	epicsFloat64 stamp = array->timeStamp;
+	
+	cached.frame_number->setValue(&frame_no);
+	cached.status->setValue(&status);
+	cached.time_stamp->setValue(&stamp);
+	
+	if (cached.packed_bits != NULL)
+	{
+		epicsInt32 bits = (array->codec.name == LAMBDA_CODEC_PACK1) ? 1 : 6;
+		cached.packed_bits->setValue(&bits);
+	}
+	
+	// Present when statistics were on at arm time
+	if (frame.has_stats && cached.total != NULL)
+	{
+		cached.total->setValue(&frame.stats.total);
+		cached.maximum->setValue(&frame.stats.maximum);
+		cached.saturated->setValue(&frame.stats.saturated);
+		
+		for (int bin = 0; bin < NUM_HISTOGRAM_BINS; bin += 1)    { cached.histogram[bin]->setValue(&frame.stats.histogram[bin]); }
+	}
+}
+
+/**
+ * At most once every LAMBDA_StatsPeriod seconds, copies a frame's
+ * statistics into the statistics parameters. The attributes are set by
+ * stampAttributes. Called with the driver locked.
+ */
+void ADLambda::publishStats(const frame_stats& stats)
+{
+	double period;
+	getDoubleParam(LAMBDA_StatsPeriod, &period);
+	
+	epicsTimeStamp now;
+	epicsTimeGetCurrent(&now);
+	
+	if (epicsTimeDiffInSeconds(&now, &this->lastStatsPublish) < period)    { return; }
+	
+	this->lastStatsPublish = now;
+	
+	epicsInt32 histogram[NUM_HISTOGRAM_BINS];
+	for (int bin = 0; bin < NUM_HISTOGRAM_BINS; bin += 1)    { histogram[bin] = (epicsInt32) stats.histogram[bin]; }
+	
+	setDoubleParam(LAMBDA_StatsTotal, (double) stats.total);
+	setIntegerParam(LAMBDA_StatsMax, (int) stats.maximum);
+	setIntegerParam(LAMBDA_StatsSaturated, (int) stats.saturated);
+	
+	doCallbacksInt32Array(histogram, NUM_HISTOGRAM_BINS, LAMBDA_StatsHistogram, 0);
+	callParamCallbacks();
 }
 
 /**
- * Thread to pull and export NDArrays being generated by the acquisition threads
+ * Tracks a receiver's buffer: high-water mark, fill fraction of the
+ * configured capacity and, from a smoothed growth rate, how long until the
+ * buffer overflows (-1 while it isn't growing). Parameter callbacks are
+ * limited to one every TELEMETRY_PERIOD. Called with the driver locked.
  */
-void ADLambda::exportThread()
-{	
-	while(this->connected)
+void ADLambda::updateQueueTelemetry(int index, int depth)
+{
+	if (index >= (int) this->telemetry.size())    { return; }
+	
+	queue_telemetry& state = this->telemetry[index];
+	
+	epicsTimeStamp now;
+	epicsTimeGetCurrent(&now);
+	
+	if (! state.started)
 	{
-		while (export_queue.empty())    { epicsThreadSleep(SHORT_TIME); }
-		
-		if (this->pImage)    { this->pImage->release(); }
-		
-		// Pull from available frames
-		dequeLock->lock();
-			this->pImage = export_queue.front();
-			export_queue.pop_front();
-		dequeLock->unlock();
-		
-		NDArrayInfo info;
-		this->pImage->getInfo(&info);
-		
-		
-		this->lock();
-			incrementValue(NDArrayCounter);
-			this->setIntegerParam(NDArraySize, info.totalBytes);
-		
-			int arrayCallbacks;
-			getIntegerParam(NDArrayCallbacks, &arrayCallbacks);
+		state.started = true;
+		state.growth_rate = 0.0;
+		state.last_depth = depth;
+		state.last_sample = now;
+		state.last_publish = now;
+	}
+	
+	double elapsed = epicsTimeDiffInSeconds(&now, &state.last_sample);
+	
+	if (elapsed > 0.0)
+	{
+		double instant = (depth - state.last_depth) / elapsed;
+		double weight = elapsed / (TELEMETRY_TIME_CONSTANT + elapsed);
 		
-			this->callParamCallbacks();
-			if (arrayCallbacks)    { doCallbacksGenericPointer(this->pImage, NDArrayData, 0); }
-		this->unlock();
+		state.growth_rate += (instant - state.growth_rate) * weight;
+		state.last_depth = depth;
+		state.last_sample = now;
+	}
+	
+	state.high_water = std::max(state.high_water, depth);
+	
+	int capacity;
+	getIntegerParam(index, LAMBDA_QueueCapacity, &capacity);
+	
+	// 0 falls back to what the receiver itself was configured with
+	if (capacity <= 0 && index < (int) this->inputCapacity.size())    { capacity = this->inputCapacity[index]; }
+	
+	double fill = (capacity > 0) ? (100.0 * depth / capacity) : 0.0;
+	double overflow = (capacity > 0 && state.growth_rate > 0.0) ? ((capacity - depth) / state.growth_rate) : -1.0;
+	
+	setIntegerParam(index, LAMBDA_DecodedQueueDepth, depth);
+	setIntegerParam(index, LAMBDA_QueueHighWater, state.high_water);
+	setDoubleParam(index, LAMBDA_QueueFill, fill);
+	setDoubleParam(index, LAMBDA_TimeToOverflow, std::max(overflow, -1.0));
+	
+	if (epicsTimeDiffInSeconds(&now, &state.last_publish) >= TELEMETRY_PERIOD)
+	{
+		state.last_publish = now;
+		callParamCallbacks(index);
 	}
 }
 
-
 /**
- * Thread spawned per detector module, acquires frames from indexed receiver and
- * copies the data to the correct spot in the stitched image.
+ * Counts a bad frame against the module that reported it, broken down by
+ * which xsp::FrameStatusCode bits were set. Called with the driver locked.
  */
-void ADLambda::acquireThread(int index)
+void ADLambda::countBadFrame(int index, int status)
 {
-	lambda_input input = this->inputs[index];
-
-	int width, height, toRead, datatype, dual_mode, depth;
-	double exposure;
-	
-	/**
-	 * Grab parameters that will be used for the entirety of the acquisition
-	 */
-	
-	this->lock();
-		this->getIntegerParam(ADMaxSizeX, &width);
-		this->getIntegerParam(ADMaxSizeY, &height);
-		this->getIntegerParam(ADNumImages, &toRead);
-		this->getIntegerParam(NDDataType, &datatype);
-		this->getIntegerParam(LAMBDA_OperatingMode, &depth);
-		this->getIntegerParam(LAMBDA_DualMode, &dual_mode);
-		this->getDoubleParam(ADAcquireTime, &exposure);
-	this->unlock();
+	if (status == (int) xsp::FrameStatusCode::FRAME_OK || index >= (int) this->badFrameCauses.size())    { return; }
 	
-	size_t imagedims_output[2] = { (size_t) width, (size_t) height};
-	const int frame_width  = std::visit([](auto&& arg) -> const int { return arg->frameWidth();  }, input);
-	const int frame_height = std::visit([](auto&& arg) -> const int { return arg->frameHeight(); }, input);
-	int x_shift = 0;
-	int y_shift = 0;
+	int count;
+	getIntegerParam(index, LAMBDA_ModuleBadFrames, &count);
+	setIntegerParam(index, LAMBDA_ModuleBadFrames, count + 1);
 	
-	if (! this->hasDecoder)
+	for (int bit = 0; bit < NUM_STATUS_BITS; bit += 1)
 	{
-		xsp::Position modulepos = std::get<0>(input)->position();
-		x_shift = (int) modulepos.x;
-		y_shift = (int) modulepos.y;
+		if (status & (1 << bit))    { this->badFrameCauses[index][bit] += 1; }
 	}
 	
-	xsp::Frame* acquired[2] = { NULL, NULL };
+	this->telemetry[index].bad_pending = true;
+	this->publishBadFrames(index, false);
+}
+
+/**
+ * Posts a module's bad frame counts, at most once every TELEMETRY_PERIOD
+ * unless forced. Called with the driver locked.
+ */
+void ADLambda::publishBadFrames(int index, bool force)
+{
+	if (index >= (int) this->telemetry.size())    { return; }
+	
+	queue_telemetry& state = this->telemetry[index];
 	
-	NDArrayInfo info;
+	if (! state.bad_pending)    { return; }
 	
-	int numAcquired = 0;
-	int dual = 0;
+	epicsTimeStamp now;
+	epicsTimeGetCurrent(&now);
 	
-	while (numAcquired < toRead)
+	if (! force && epicsTimeDiffInSeconds(&now, &state.last_bad_publish) < TELEMETRY_PERIOD)    { return; }
+	
+	state.bad_pending = false;
+	state.last_bad_publish = now;
+	
+	doCallbacksInt32Array(this->badFrameCauses[index].data(), NUM_STATUS_BITS, LAMBDA_BadFrameCauses, index);
+	callParamCallbacks(index);
+}
+
+/**
+ * Looks up how many frames each input can buffer, used for the queue fill
+ * and overflow estimates while QueueCapacity is 0. Replayed inputs report
+ * their prefetch pool, xsp inputs their frame-buffer-size setting.
+ */
+void ADLambda::detectCapacities()
+{
+	this->inputCapacity.assign(this->inputs.size(), 0);
+	
+	for (size_t index = 0; index < this->inputs.size(); index += 1)
 	{
-		acquired[dual] = std::visit([](auto&& arg) -> xsp::Frame* { return (xsp::Frame*) arg->frame(1500); }, input);
-		
-		// Empty frame plus the detector saying it's not busy means something's gone wrong.
-		if (acquired[dual] == nullptr || acquired[dual]->data() == NULL)
+		if (auto replay = std::get_if<std::shared_ptr<LambdaReplayReceiver> >(&this->inputs[index]))
 		{
-			if (det->isBusy())    { continue; }
-			else                  { this->tryStopAcquire(); break; }
+			this->inputCapacity[index] = (int) (*replay)->bufferFrames();
 		}
-		
-		/*
-		 * For dual mode, every acquisition is two frames, increment dual to save frame in
-		 * the second slot of acquired.
-		 */
-		if (dual_mode && !dual)    { dual = 1; continue; }
-		else                       { dual = 0; }
-	
-		const int frame_no = acquired[0]->nr();
-		
-		NDArray* output;
-		
-		this->lock();		
-			// If there's not an NDArray stored for this frame_no, create one
-			if (this->hasDecoder)
-			{
-				output = pNDArrayPool->alloc(2, imagedims_output, (NDDataType_t) datatype, 0, NULL);
-				output->uniqueId = frame_no;
-				output->getInfo(&info);
-				
-				updateTimeStamps(output);
-			
-				memset((char*) output->pData, 0, imagedims_output[0] * imagedims_output[1] * info.bytesPerElement);
-				
-				incrementValue(ADNumImagesCounter);
-			}
-			else if (this->frames.find(frame_no) == this->frames.end())
-			{
-				NDArray* new_frame = pNDArrayPool->alloc(2, imagedims_output, (NDDataType_t) datatype, 0, NULL);
-				new_frame->uniqueId = 0;
-				new_frame->getInfo(&info);
-				
-				updateTimeStamps(new_frame);
-			
-				memset((char*) new_frame->pData, 0, imagedims_output[0] * imagedims_output[1] * info.bytesPerElement);
-
-				this->frames[frame_no] = new_frame;
-				output = new_frame;
-				incrementValue(ADNumImagesCounter);
-			}
-			else
-			{
-				output = this->frames[frame_no];
-			}
-		this->unlock();
-		
-		output->getInfo(&info);
-		numAcquired += 1;
-		
-		// If not in dual mode, will just take the first status twice
-		int bad_frame = ((int) acquired[0]->status() | (int) acquired[dual_mode]->status()); 
-		
-		// Stitch frame into its correct spot in the NDArray
-		if (bad_frame == (int) xsp::FrameStatusCode::FRAME_OK)
+		else
 		{
-			if (! this->fake)
-			{
-				for (int which = 0; which <= dual_mode; which += 1)
-				{
-					char* in_data = (char*) acquired[which]->data();
-					char* out_data = (char*) output->pData;
-
-					if (this->hasDecoder)
-					{
-						int in_offset = 0;
-						int out_offset = frame_height * which * width * info.bytesPerElement;
-					
-						std::memcpy(&out_data[out_offset], &in_data[in_offset], frame_height * frame_width * info.bytesPerElement);
-					}
-					else
-					{
-						for (int row = 0; row < frame_height; row += 1)
-						{
-							int in_offset = row * frame_width * info.bytesPerElement;
-							int out_offset = ((y_shift + row + (frame_height * which)) * width + x_shift) * info.bytesPerElement;
-						
-							std::memcpy(&out_data[out_offset], &in_data[in_offset], frame_width * info.bytesPerElement);
-						}
-					}
-				}
-			}
+			this->inputCapacity[index] = configBufferFrames(this->configFileName, this->inputNames[index]);
 		}
-		
-		std::visit([&acquired](auto&& arg){ arg->release(acquired[0]); }, input);
-		if (dual_mode)    { std::visit([&acquired](auto&& arg){ arg->release(acquired[1]); }, input); }
-
-		
-		this->lock();
-			if (this->hasDecoder)
-			{
-				if (bad_frame)
-				{ 
-					incrementValue(LAMBDA_BadFrameCounter); 
-					output->release();
-				}
-				else
-				{
-					dequeLock->lock();
-						this->export_queue.push_back(output); 
-					dequeLock->unlock();
-				}
-			}
-			else
-			{
-				int id = output->uniqueId;
-					
-				/*
-				 * Negative value means that one of the threads reported a bad frame,
-				 * magnitude is the number of threads that have reported frames.
-				 */
-				if (id < 0)                { id -= 1; }
-				else if (bad_frame > 0)    { id = -1 * std::abs(id) - 1; }
-				else                       { id += 1; }
-			
-				if   (std::abs(id) < this->inputs.size())    { output->uniqueId = id; }
-				else 
-				{
-					output->uniqueId = frame_no;
-					
-					if (id < 0)    
-					{ 
-						incrementValue(LAMBDA_BadFrameCounter); 
-						output->release();
-					}	
-					else
-					{ 
-						dequeLock->lock();
-							this->export_queue.push_back(output); 
-						dequeLock->unlock();
-					}
-					
-					this->frames.erase(frame_no);
-				}
-			}
-		
-			int numBuffered = std::visit([](auto&& arg) -> int { return arg->framesQueued(); }, input);
-			this->setIntegerParam(index, LAMBDA_DecodedQueueDepth, numBuffered);
-		
-		this->unlock();
 	}
-	
-	this->threadFinishEvents[index]->trigger();
 }
 
 /**
@@ -869,7 +4441,89 @@ void ADLambda::acquireThread(int index)
  */
 void ADLambda::report(FILE *fp, int details) 
 {
+	this->lock();
+		fprintf(fp, "Lambda thread placement:\n");
+		
+		for (auto& item : this->effectivePlacement)    { fprintf(fp, "  %-12s %s\n", item.first.c_str(), item.second.c_str()); }
+	this->unlock();
+	
 	ADDriver::report(fp, details);
+	
+	if (details > 5)
+	{
+		fprintf(fp, "Lambda stitched frame pool:\n");
+		this->framePool->report(fp, details);
+	}
+}
+
+/**
+ * Stores the placement for a thread role. Roles are "control", "export",
+ * "receiver" and "preview", a numeric suffix ("receiver2") targets a single thread
+ * and takes precedence over the unsuffixed role. Running threads pick up
+ * changes the next time they're idle, receiver threads when spawned.
+ * \param[in] role Which thread(s) the settings apply to
+ * \param[in] cpus CPU list in the form "0-3,8", empty to leave affinity alone
+ * \param[in] numa_node Node to allocate memory from, -1 for no preference
+ * \param[in] priority SCHED_FIFO priority, 0 for the normal scheduler
+ */
+void ADLambda::setThreadPlacement(const char* role, const char* cpus, int numa_node, int priority)
+{
+	thread_placement setting;
+	
+	setting.cpus = cpus ? cpus : "";
+	setting.numa_node = numa_node;
+	setting.priority = priority;
+	
+	this->lock();
+		this->placements[role] = setting;
+		this->placementGeneration += 1;
+	this->unlock();
+}
+
+/**
+ * Places a post-decoder's frames at (x, y) in the stitched image, for
+ * systems where each decoder assembles only part of the detector.
+ * \param[in] decoder Post-decoder ID from the system config file
+ * \param[in] x Column of the decoder's top left pixel
+ * \param[in] y Row of the decoder's top left pixel
+ */
+void ADLambda::setDecoderOffset(const char* decoder, int x, int y)
+{
+	this->lock();
+		this->decoderOffsets[decoder] = std::make_pair(x, y);
+		
+		if (this->connected)
+		{
+			this->updateGeometry();
+			this->setSizes();
+		}
+	this->unlock();
+}
+
+/**
+ * Applies the configured placement to the calling thread. The sysfs reads
+ * and system calls happen with the driver unlocked, so must be called
+ * without the lock held.
+ */
+void ADLambda::applyPlacement(const std::string& role)
+{
+	thread_placement setting;
+	
+	setting.numa_node = -1;
+	setting.priority = 0;
+	
+	this->lock();
+		auto found = this->placements.find(role);
+		
+		if (found == this->placements.end())    { found = this->placements.find(role.substr(0, role.find_first_of("0123456789"))); }
+		if (found != this->placements.end())    { setting = found->second; }
+	this->unlock();
+	
+	std::string effective = placeThread(setting);
+	
+	this->lock();
+		this->effectivePlacement[role] = effective;
+	this->unlock();
 }
 
 void ADLambda::writeDepth(int depth)
@@ -929,6 +4583,10 @@ asynStatus ADLambda::writeInt32(asynUser *pasynUser, epicsInt32 value)
 	{
 		this->writeDepth(value);
 	}
+	else if (function == LAMBDA_XpcsRing)
+	{
+		this->updateXpcsWaveform();
+	}
 	else if (function < LAMBDA_FIRST_PARAM) 
 	{
 		status = ADDriver::writeInt32(pasynUser, value);
@@ -938,6 +4596,51 @@ asynStatus ADLambda::writeInt32(asynUser *pasynUser, epicsInt32 value)
 	return (asynStatus) status;
 }
 
+/**
+ * Takes the threshold scan list. Every point is checked here so a bad list
+ * is rejected when it's written rather than partway through a scan.
+ */
+asynStatus ADLambda::writeFloat64Array(asynUser *pasynUser, epicsFloat64 *value, size_t nElements)
+{
+	int function = pasynUser->reason;
+	
+	if (function != LAMBDA_ScanThresholds)    { return ADDriver::writeFloat64Array(pasynUser, value, nElements); }
+	
+	if (nElements > (size_t) SCAN_MAX_POINTS)
+	{
+		std::string message = "Threshold scan is limited to " + std::to_string(SCAN_MAX_POINTS) + " points";
+		
+		this->setStringParam(ADStatusMessage, message.c_str());
+		this->callParamCallbacks();
+		return asynError;
+	}
+	
+	double min_energy, max_energy;
+	
+	getDoubleParam(LAMBDA_ThresholdMin, &min_energy);
+	getDoubleParam(LAMBDA_ThresholdMax, &max_energy);
+	
+	for (size_t index = 0; index < nElements; index += 1)
+	{
+		if (! std::isfinite(value[index]) || value[index] < min_energy || value[index] > max_energy)
+		{
+			std::string message = "Threshold scan point " + std::to_string(index) + " is outside the detector's threshold range";
+			
+			this->setStringParam(ADStatusMessage, message.c_str());
+			this->callParamCallbacks();
+			return asynError;
+		}
+	}
+	
+	this->scanThresholds.assign(value, value + nElements);
+	
+	setIntegerParam(LAMBDA_ScanPoints, (int) nElements);
+	callParamCallbacks();
+	doCallbacksFloat64Array(this->scanThresholds.data(), nElements, LAMBDA_ScanThresholds, 0);
+	
+	return asynSuccess;
+}
+
 
 /* Code for iocsh registration */
 
@@ -946,16 +4649,77 @@ static const iocshArg LambdaConfigArg0 = { "Port name", iocshArgString };
 static const iocshArg LambdaConfigArg1 = { "Config file path", iocshArgString };
 static const iocshArg LambdaConfigArg2 = { "numModules", iocshArgInt };
 static const iocshArg LambdaConfigArg3 = { "fake", iocshArgInt };
-static const iocshArg * const LambdaConfigArgs[] = { &LambdaConfigArg0, &LambdaConfigArg1, &LambdaConfigArg2, &LambdaConfigArg3};
+static const iocshArg LambdaConfigArg4 = { "numExports", iocshArgInt };
+static const iocshArg * const LambdaConfigArgs[] = { &LambdaConfigArg0, &LambdaConfigArg1, &LambdaConfigArg2, &LambdaConfigArg3, &LambdaConfigArg4};
 
 static void configLambdaCallFunc(const iocshArgBuf *args) {
-	LambdaConfig(args[0].sval, args[1].sval, args[2].ival, args[3].ival);
+	LambdaConfig(args[0].sval, args[1].sval, args[2].ival, args[3].ival, args[4].ival);
+}
+static const iocshFuncDef configLambda = { "LambdaConfig", 5, LambdaConfigArgs };
+
+/* LambdaThreadConfig */
+static const iocshArg LambdaThreadConfigArg0 = { "Port name", iocshArgString };
+static const iocshArg LambdaThreadConfigArg1 = { "Thread role", iocshArgString };
+static const iocshArg LambdaThreadConfigArg2 = { "CPU list", iocshArgString };
+static const iocshArg LambdaThreadConfigArg3 = { "NUMA node", iocshArgString };
+static const iocshArg LambdaThreadConfigArg4 = { "FIFO priority", iocshArgInt };
+static const iocshArg * const LambdaThreadConfigArgs[] = { &LambdaThreadConfigArg0, &LambdaThreadConfigArg1, &LambdaThreadConfigArg2, &LambdaThreadConfigArg3, &LambdaThreadConfigArg4};
+
+static void configLambdaThreadCallFunc(const iocshArgBuf *args) {
+	ADLambda* driver = dynamic_cast<ADLambda*>((asynPortDriver*) findAsynPortDriver(args[0].sval));
+	
+	if (driver == NULL || args[1].sval == NULL)
+	{
+		printf("LambdaThreadConfig: no Lambda driver on port %s\n", args[0].sval ? args[0].sval : "");
+		return;
+	}
+	
+	// Node is a string so that leaving it out means no preference rather than node 0
+	int numa_node = (args[3].sval && args[3].sval[0]) ? atoi(args[3].sval) : -1;
+	
+	driver->setThreadPlacement(args[1].sval, args[2].sval, numa_node, args[4].ival);
+}
+static const iocshFuncDef configLambdaThread = { "LambdaThreadConfig", 5, LambdaThreadConfigArgs };
+
+/* LambdaDecoderOffset */
+static const iocshArg LambdaDecoderOffsetArg0 = { "Port name", iocshArgString };
+static const iocshArg LambdaDecoderOffsetArg1 = { "Decoder ID", iocshArgString };
+static const iocshArg LambdaDecoderOffsetArg2 = { "x", iocshArgInt };
+static const iocshArg LambdaDecoderOffsetArg3 = { "y", iocshArgInt };
+static const iocshArg * const LambdaDecoderOffsetArgs[] = { &LambdaDecoderOffsetArg0, &LambdaDecoderOffsetArg1, &LambdaDecoderOffsetArg2, &LambdaDecoderOffsetArg3};
+
+static void configLambdaDecoderOffsetCallFunc(const iocshArgBuf *args) {
+	ADLambda* driver = dynamic_cast<ADLambda*>((asynPortDriver*) findAsynPortDriver(args[0].sval));
+	
+	if (driver == NULL || args[1].sval == NULL)
+	{
+		printf("LambdaDecoderOffset: no Lambda driver on port %s\n", args[0].sval ? args[0].sval : "");
+		return;
+	}
+	
+	driver->setDecoderOffset(args[1].sval, args[2].ival, args[3].ival);
+}
+static const iocshFuncDef configLambdaDecoderOffset = { "LambdaDecoderOffset", 4, LambdaDecoderOffsetArgs };
+
+/* LambdaReplayConfig */
+static const iocshArg LambdaReplayConfigArg0 = { "Port name", iocshArgString };
+static const iocshArg LambdaReplayConfigArg1 = { "Recording path", iocshArgString };
+static const iocshArg LambdaReplayConfigArg2 = { "numModules", iocshArgInt };
+static const iocshArg LambdaReplayConfigArg3 = { "realtime", iocshArgInt };
+static const iocshArg LambdaReplayConfigArg4 = { "numExports", iocshArgInt };
+static const iocshArg * const LambdaReplayConfigArgs[] = { &LambdaReplayConfigArg0, &LambdaReplayConfigArg1, &LambdaReplayConfigArg2, &LambdaReplayConfigArg3, &LambdaReplayConfigArg4};
+
+static void configLambdaReplayCallFunc(const iocshArgBuf *args) {
+	LambdaReplayConfig(args[0].sval, args[1].sval, args[2].ival, args[3].ival, args[4].ival);
 }
-static const iocshFuncDef configLambda = { "LambdaConfig", 4, LambdaConfigArgs };
+static const iocshFuncDef configLambdaReplay = { "LambdaReplayConfig", 5, LambdaReplayConfigArgs };
 
 static void LambdaRegister(void) 
 {
 	iocshRegister(&configLambda, configLambdaCallFunc);
+	iocshRegister(&configLambdaReplay, configLambdaReplayCallFunc);
+	iocshRegister(&configLambdaThread, configLambdaThreadCallFunc);
+	iocshRegister(&configLambdaDecoderOffset, configLambdaDecoderOffsetCallFunc);
 }
 
 extern "C" 
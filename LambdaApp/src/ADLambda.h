@@ -13,15 +13,25 @@
 #include <libxsp.h>
 #include <string>
 #include <map>
+#include <unordered_map>
 #include <deque>
+#include <memory>
 #include <variant>
+#include <atomic>
 
 
 #include <epicsString.h>
 #include <epicsEvent.h>
 #include <epicsThread.h>
+#include <epicsTime.h>
 
 #include "ADDriver.h"
+#include "LambdaRawRecorder.h"
+#include "LambdaReplayReceiver.h"
+#include "LambdaPack.h"
+#include "LambdaGeometry.h"
+#include "LambdaShmRing.h"
+#include "LambdaXpcs.h"
 
 static const int ONE_BIT = 1;
 static const int SIX_BIT = 6;
@@ -32,7 +42,204 @@ static const double ONE_BILLION = 1.E9;
 
 static const double SHORT_TIME = 0.000025;
 
-typedef std::variant<std::shared_ptr<xsp::lambda::Receiver>, std::shared_ptr<xsp::PostDecoder> > lambda_input;
+static const int NUM_STATUS_BITS = 16;
+static const double TELEMETRY_PERIOD = 0.1;
+static const double TELEMETRY_TIME_CONSTANT = 1.0;
+
+static const int NUM_HISTOGRAM_BINS = 16;
+static const int HISTOGRAM_BITS = 4;
+
+static const int REPLAY_OFF = 0;
+static const int REPLAY_FAST = 1;
+static const int REPLAY_REALTIME = 2;
+
+static const int EXPORT_SINGLE = 0;
+static const int EXPORT_ROUND_ROBIN = 1;
+static const int EXPORT_FRAME_NUMBER = 2;
+
+static const int STALE_RELEASE = 0;
+static const int STALE_DELIVER = 1;
+
+static const int SCAN_MAX_POINTS = 1024;
+
+static const int PHASE_MAX_BINS = 64;
+
+static const int PREVIEW_RATE = 0;
+static const int PREVIEW_EVERY_NTH = 1;
+
+static const int VETO_OFF = 0;
+static const int VETO_ROI_SUM = 1;
+static const int VETO_PIXEL_COUNT = 2;
+
+static const int BATCH_MAX_FRAMES = 64;
+
+static const int SHM_LOSSY = 0;
+static const int SHM_LOSSLESS = 1;
+
+typedef std::variant<std::shared_ptr<xsp::lambda::Receiver>, 
+                     std::shared_ptr<xsp::PostDecoder>, 
+                     std::shared_ptr<LambdaReplayReceiver> > lambda_input;
+
+/**
+ * Frame pulled from any lambda_input, handle is the input's own frame
+ * object and is what gets handed back on release.
+ */
+typedef struct
+{
+	const void* handle;
+	const void* data;
+	int nr;
+	int status;
+} lambda_frame;
+
+/**
+ * Pixel reductions computed while a module is copied into the stitched frame
+ */
+typedef struct
+{
+	epicsUInt64 total;
+	epicsUInt32 maximum;
+	epicsUInt32 saturated;
+	epicsUInt32 histogram[NUM_HISTOGRAM_BINS];
+} frame_stats;
+
+/**
+ * Region the veto is measured over, in stitched image coordinates, and
+ * the level a pixel has to reach to count as hit
+ */
+typedef struct
+{
+	int x;
+	int y;
+	int width;
+	int height;
+	epicsUInt32 level;
+} veto_roi;
+
+/**
+ * Veto measurements taken while a module is copied into the stitched frame
+ */
+typedef struct
+{
+	epicsUInt64 sum;
+	epicsUInt32 above;
+} veto_measure;
+
+/**
+ * A frame being assembled from the individual receivers. data is where
+ * its pixels go, the array's buffer or, for frames stitched straight into
+ * a batch, their slice of it with a NULL array. contributed has bit n set
+ * once input n has reported, writers counts inputs currently copying into
+ * the array so it isn't evicted from under them. missing is set for frames
+ * delivered incomplete by eviction.
+ */
+typedef struct
+{
+	NDArray* array;
+	char* data;
+	int number;
+	epicsTimeStamp stamp;
+	size_t reported;
+	epicsUInt64 contributed;
+	int writers;
+	epicsTimeStamp first_seen;
+	bool bad;
+	bool has_stats;
+	bool packed;
+	frame_stats stats;
+	veto_measure veto;
+	epicsUInt64 missing;
+} stitch_frame;
+
+/**
+ * A completed frame held back until the frames before it have gone out.
+ * A NULL array marks a frame number that was dropped, so the frames after
+ * it don't wait for it.
+ */
+typedef struct
+{
+	NDArray* array;
+	epicsTimeStamp arrived;
+	veto_measure veto;
+	bool partial;
+} reorder_entry;
+
+/**
+ * An array waiting for an export thread. A batch is queued with the frames
+ * its slices come from, and the export thread copies them in.
+ */
+typedef struct
+{
+	NDArray* array;
+	std::vector<NDArray*> slices;
+} export_item;
+
+/**
+ * A batch that frames are stitched into directly, one slice per frame
+ * number counted from its first. pending counts its frames still being
+ * stitched and resolved its slices that are done with, kept or not. A
+ * slice without a frame stays zero with a frame number of -1.
+ */
+typedef struct
+{
+	NDArray* array;
+	int pending;
+	int resolved;
+	epicsUInt64 missing;
+	epicsTimeStamp opened;
+	std::vector<bool> used;
+	std::vector<epicsInt32> numbers;
+	std::vector<epicsTimeStamp> stamps;
+	std::vector<epicsUInt64> slice_missing;
+} batch_group;
+
+/**
+ * Attributes kept on a pooled frame array from one use to the next. They
+ * are recreated when the layout generation or the list's attribute count
+ * no longer match what they were created for.
+ */
+typedef struct
+{
+	int generation;
+	int count;
+	bool packed;
+	NDAttribute* frame_number;
+	NDAttribute* status;
+	NDAttribute* time_stamp;
+	NDAttribute* packed_bits;
+	NDAttribute* veto_trigger;
+	NDAttribute* sequence;
+	NDAttribute* shard;
+	NDAttribute* total;
+	NDAttribute* maximum;
+	NDAttribute* saturated;
+	NDAttribute* histogram[NUM_HISTOGRAM_BINS];
+} frame_attributes;
+
+/**
+ * Running state used to estimate how quickly a receiver's buffer is filling
+ */
+typedef struct
+{
+	int high_water;
+	int last_depth;
+	double growth_rate;
+	epicsTimeStamp last_sample;
+	epicsTimeStamp last_publish;
+	epicsTimeStamp last_bad_publish;
+	bool bad_pending;
+	bool started;
+} queue_telemetry;
+
+/**
+ * CPU, NUMA and scheduling settings for one of the driver's threads
+ */
+typedef struct
+{
+	std::string cpus;
+	int numa_node;
+	int priority;
+} thread_placement;
 
 /**
  * Class to wrap Lambda detector library provided by X-Spectrum
@@ -42,7 +249,7 @@ class epicsShareClass ADLambda: public ADDriver
 public:
 	static const char *driverName;
 
-	ADLambda(const char *portName, const char *configPath, int numModules, int fake);
+	ADLambda(const char *portName, const char *configPath, int numModules, int fake, int numExports=1, int replay=REPLAY_OFF);
 	~ADLambda();
 
 	virtual asynStatus disconnect();
@@ -52,11 +259,16 @@ public:
 	void tryConnect();
 	void acquireThread(int receiver);
 	void acquireDecoderThread();
-	void exportThread();
+	void exportThread(int shard);
+	void previewThread();
 
 	void report(FILE *fp, int details);
+	
+	void setThreadPlacement(const char* role, const char* cpus, int numa_node, int priority);
+	void setDecoderOffset(const char* decoder, int x, int y);
 
 	virtual asynStatus writeInt32(asynUser *pasynUser, epicsInt32 value);
+	virtual asynStatus writeFloat64Array(asynUser *pasynUser, epicsFloat64 *value, size_t nElements);
 
 protected:
     int LAMBDA_ConfigFilePath;
@@ -74,6 +286,103 @@ protected:
     int LAMBDA_ReadoutThreads;
     int LAMBDA_StitchedWidth;
     int LAMBDA_StitchedHeight;
+    int LAMBDA_RecordEnable;
+    int LAMBDA_RecordLiveEvery;
+    int LAMBDA_RecordBandwidth;
+    int LAMBDA_RecordFrames;
+    int LAMBDA_ExportMode;
+    int LAMBDA_ExportShards;
+    int LAMBDA_QueueHighWater;
+    int LAMBDA_QueueCapacity;
+    int LAMBDA_QueueFill;
+    int LAMBDA_TimeToOverflow;
+    int LAMBDA_ModuleBadFrames;
+    int LAMBDA_BadFrameCauses;
+    int LAMBDA_StatsEnable;
+    int LAMBDA_StatsPeriod;
+    int LAMBDA_StatsTotal;
+    int LAMBDA_StatsMax;
+    int LAMBDA_StatsSaturated;
+    int LAMBDA_StatsHistogram;
+    int LAMBDA_AttributeTemplate;
+    int LAMBDA_PackedOutput;
+    int LAMBDA_StaleMode;
+    int LAMBDA_StaleAge;
+    int LAMBDA_StaleDistance;
+    int LAMBDA_StaleFrames;
+    int LAMBDA_LateFrames;
+    int LAMBDA_PendingFrames;
+    int LAMBDA_ModuleMissing;
+    int LAMBDA_ScanEnable;
+    int LAMBDA_ScanThresholds;
+    int LAMBDA_ThresholdMin;
+    int LAMBDA_ThresholdMax;
+    int LAMBDA_ScanPoints;
+    int LAMBDA_ScanPoint;
+    int LAMBDA_ScanSetupTime;
+    int LAMBDA_GeometryEnable;
+    int LAMBDA_GeometryFile;
+    int LAMBDA_GeometryRuns;
+    int LAMBDA_GeometrySpreads;
+    int LAMBDA_ShmEnable;
+    int LAMBDA_ShmName;
+    int LAMBDA_ShmSlots;
+    int LAMBDA_ShmMode;
+    int LAMBDA_ShmTimeout;
+    int LAMBDA_ShmPublished;
+    int LAMBDA_ShmOverruns;
+    int LAMBDA_ShmReaders;
+    int LAMBDA_ShmOversized;
+    int LAMBDA_PhaseEnable;
+    int LAMBDA_PhaseBins;
+    int LAMBDA_PhaseCycles;
+    int LAMBDA_PhaseBlocks;
+    int LAMBDA_PhaseLate;
+    int LAMBDA_XpcsEnable;
+    int LAMBDA_XpcsMaskFile;
+    int LAMBDA_XpcsChannels;
+    int LAMBDA_XpcsLevels;
+    int LAMBDA_XpcsWorkers;
+    int LAMBDA_XpcsPeriod;
+    int LAMBDA_XpcsExport;
+    int LAMBDA_XpcsRing;
+    int LAMBDA_XpcsRings;
+    int LAMBDA_XpcsPixels;
+    int LAMBDA_XpcsFrames;
+    int LAMBDA_XpcsDropped;
+    int LAMBDA_XpcsMissing;
+    int LAMBDA_XpcsTau;
+    int LAMBDA_XpcsG2;
+    int LAMBDA_ReorderEnable;
+    int LAMBDA_ReorderWindow;
+    int LAMBDA_ReorderTimeout;
+    int LAMBDA_ReorderDepth;
+    int LAMBDA_ReorderSkipped;
+    int LAMBDA_ReorderLate;
+    int LAMBDA_ReorderDuplicates;
+    int LAMBDA_PreviewEnable;
+    int LAMBDA_PreviewMode;
+    int LAMBDA_PreviewRate;
+    int LAMBDA_PreviewEvery;
+    int LAMBDA_PreviewBinning;
+    int LAMBDA_PreviewFrames;
+    int LAMBDA_VetoMode;
+    int LAMBDA_VetoMinX;
+    int LAMBDA_VetoMinY;
+    int LAMBDA_VetoSizeX;
+    int LAMBDA_VetoSizeY;
+    int LAMBDA_VetoPixelLevel;
+    int LAMBDA_VetoLow;
+    int LAMBDA_VetoHigh;
+    int LAMBDA_VetoPreFrames;
+    int LAMBDA_VetoPostFrames;
+    int LAMBDA_VetoAccepted;
+    int LAMBDA_VetoRetained;
+    int LAMBDA_VetoRejected;
+    int LAMBDA_BatchEnable;
+    int LAMBDA_BatchSize;
+    int LAMBDA_BatchTimeout;
+    int LAMBDA_BatchArrays;
 
 private:
 	bool connected = false;
@@ -86,21 +395,167 @@ private:
    	void sendParameters();
    	void writeDepth(int depth);
 
+	bool startRecording();
+	bool openShmRing();
+	bool startXpcs();
+	void publishXpcs(bool force);
+	void updateXpcsWaveform();
+	void stopRecording();
+
+	bool applyScanPoint(size_t point, double threshold);
+	bool sendThreshold(double threshold);
+	void finishScan();
 	bool tryStartAcquire();
 	bool tryStopAcquire();
+	bool detectorReady();
+	bool detectorBusy();
+	void connectReplay();
+	void updateGeometry();
+	bool loadGeometry();
+	bool checkOverlap();
+	void applyPlacement(const std::string& role);
 	
 	int fake;
+	int replay;
+	int numModules;
+	int numExports;
 
 	void spawnAcquireThread(int receiver);
 	void spawnAcquireDecoderThread();
+	void spawnExportThread(int shard);
+	
+	void queueFrame(NDArray* frame, const std::vector<NDArray*>& slices = std::vector<NDArray*>());
+	void reorderFrame(NDArray* frame, const veto_measure& measure, bool partial);
+	void reorderDrop(int frame_number);
+	void deliverFrame(NDArray* frame, const veto_measure& measure, bool partial);
+	void vetoFrame(NDArray* frame, const veto_measure& measure);
+	void flushVeto();
+	bool vetoContinues(int frame_number);
+	void startBatches();
+	void batchFrame(NDArray* frame);
+	void releaseBatch(bool flush);
+	char* openSlice(int frame_number);
+	void finishSlice(const stitch_frame& frame, bool keep);
+	void releaseGroups(bool flush);
+	void releaseReordered(bool flush);
+	bool exportPending();
+	
+	void updateQueueTelemetry(int index, int depth);
+	void countBadFrame(int index, int status);
+	void publishBadFrames(int index, bool force);
+	void detectCapacities();
+	void completeFrame(stitch_frame& frame);
+	void evictStale(int newest, bool flush);
+	void publishStats(const frame_stats& stats);
+	void packFrame(NDArray* frame, int depth);
+	NDArray* unpackFrame(NDArray* frame);
+	void sendPreview(NDArray* frame, int slice = -1, int frame_number = 0, const epicsTimeStamp* stamp = NULL);
+	NDArray* buildPreview(NDArray* frame, int slice, int factor);
+	void buildAttributeTemplate();
+	void stampAttributes(const stitch_frame& frame);
+	frame_attributes* cachedAttributes(NDArray* frame);
+	void startPhaseBins();
+	bool sumPhase(NDArray* frame, std::vector<NDArray*>& finished);
+	void accumulatePhase();
+	void takePhaseBins(std::vector<NDArray*>& output);
+	void queuePhaseBins(const std::vector<NDArray*>& images);
+	void emitPhaseBins();
 
 	std::unique_ptr<xsp::System> sys;
 	std::shared_ptr<xsp::lambda::Detector> det;
+	std::vector< std::shared_ptr<xsp::lambda::Detector> > detectors;
 	
 	std::vector< lambda_input > inputs;
+	std::vector< std::string > inputNames;
+	std::vector< std::pair<int, int> > inputOffsets;
+	std::vector<int> inputCapacity;
+	std::map< std::string, std::pair<int, int> > decoderOffsets;
+	std::shared_ptr<LambdaGeometry> geometry;
+	
+	std::map<int, stitch_frame> frames;
+	int staleThrough = -1;
+	int newestFrame = -1;
+	
+	std::vector<double> scanThresholds;
+	bool scanActive = false;
+	double scanRestoreThreshold = 0.0;
+	
+	std::vector< std::vector<epicsUInt32> > phaseSums;
+	std::vector<epicsUInt32> phaseFrames;
+	size_t phaseDims[2] = { 0, 0 };
+	int phaseCycles = 1;
+	int phaseBlock = -1;
+	bool phaseActive = false;
+	std::deque<NDArray*> phaseQueue;
+	epicsMutex* phaseLock;
+	
+	std::deque<NDArray*> vetoHistory;
+	int vetoMode = VETO_OFF;
+	int vetoPostRemaining = 0;
+	int vetoLast = -1;
+	std::deque<int> vetoBreaks;
+	
+	std::vector<NDArray*> batchSlices;
+	int batchSize = 1;
+	int batchLast = -1;
+	epicsUInt64 batchMissing = 0;
+	epicsTimeStamp batchStarted;
+	std::unique_ptr<NDAttributeList> batchAttributes;
+	std::vector<std::string> batchAttrNames;
+	std::vector<NDAttribute*> batchFrameAttr;
+	std::vector<NDAttribute*> batchTimeAttr;
+	std::vector<NDAttribute*> batchMissingAttr;
+	
+	bool batchDirect = false;
+	int batchBase = -1;
+	int batchClosedBelow = -1;
+	size_t batchDims[2] = { 0, 0 };
+	NDDataType_t batchType = NDUInt16;
+	std::map<int, batch_group> batchGroups;
+	
+	std::map<int, reorder_entry> reorderPending;
+	int reorderNext = -1;
+	bool reorderActive = false;
+	epicsTimeStamp lastReorderPublish;
 	
-	std::map<int, NDArray*> frames;
-	std::deque<NDArray*> export_queue;
+	std::vector< std::deque<export_item> > export_queues;
+	epicsUInt64 exportSequence = 0;
+	
+	std::vector< std::unique_ptr<LambdaRawRecorder> > recorders;
+	std::shared_ptr<LambdaShmRing> shmRing;
+	
+	std::shared_ptr<LambdaXpcs> xpcs;
+	std::vector<double> xpcsTau;
+	std::vector<double> xpcsG2;
+	epicsTimeStamp lastXpcsPublish;
+	
+	std::vector<queue_telemetry> telemetry;
+	std::vector< std::vector<epicsInt32> > badFrameCauses;
+	
+	epicsTimeStamp lastStatsPublish;
+	
+	/*
+	 * Attributes shared by every frame of an acquisition, built at arm
+	 * time. The per-frame fields are set through the cached pointers and
+	 * the whole list is copied onto each frame.
+	 */
+	std::unique_ptr<NDAttributeList> attributeTemplate;
+	std::unique_ptr<NDAttributeList> frameAttributes;
+	bool useAttributeTemplate = false;
+	std::unordered_map<NDArray*, frame_attributes> frameAttributeCache;
+	int attributeGeneration = 0;
+	NDArrayPool* framePool;
+	
+	epicsTimeStamp lastPreview;
+	NDArray* previewPending = NULL;
+	int previewSlice = -1;
+	int previewFrame = 0;
+	epicsTimeStamp previewStamp = { 0, 0 };
+	int previewBinning = 1;
+	
+	std::map<std::string, thread_placement> placements;
+	std::map<std::string, std::string> effectivePlacement;
+	std::atomic<int> placementGeneration{0};
 	
 	epicsEvent* startAcquireEvent;
 	epicsEvent* stopAcquireEvent;
@@ -108,7 +563,6 @@ private:
  	epicsMutex* dequeLock;
 
 	std::string configFileName;
-	NDArray *pImage = NULL;
 };
 
 typedef struct
@@ -117,6 +571,12 @@ typedef struct
 	int receiver;
 } acquire_data;
 
+typedef struct
+{
+	ADLambda* driver;
+	int shard;
+} export_data;
+
 
 #define LAMBDA_ConfigFilePathString         "LAMBDA_CONFIG_FILE_PATH"
 #define LAMBDA_DecoderDetectedString        "LAMBDA_DECODER_DETECTED"
@@ -132,6 +592,103 @@ typedef struct
 #define LAMBDA_ReadoutThreadsString         "LAMBDA_NUM_READOUT_THREADS"
 #define LAMBDA_StitchWidthString            "LAMBDA_STITCHED_WIDTH"
 #define LAMBDA_StitchHeightString           "LAMBDA_STITCHED_HEIGHT"
+#define LAMBDA_RecordEnableString           "LAMBDA_RECORD_ENABLE"
+#define LAMBDA_RecordLiveEveryString        "LAMBDA_RECORD_LIVE_EVERY"
+#define LAMBDA_RecordBandwidthString        "LAMBDA_RECORD_BANDWIDTH"
+#define LAMBDA_RecordFramesString           "LAMBDA_RECORD_FRAMES"
+#define LAMBDA_ExportModeString             "LAMBDA_EXPORT_MODE"
+#define LAMBDA_ExportShardsString           "LAMBDA_EXPORT_SHARDS"
+#define LAMBDA_QueueHighWaterString         "LAMBDA_QUEUE_HIGH_WATER"
+#define LAMBDA_QueueCapacityString          "LAMBDA_QUEUE_CAPACITY"
+#define LAMBDA_QueueFillString              "LAMBDA_QUEUE_FILL"
+#define LAMBDA_TimeToOverflowString         "LAMBDA_TIME_TO_OVERFLOW"
+#define LAMBDA_ModuleBadFramesString        "LAMBDA_MODULE_BAD_FRAMES"
+#define LAMBDA_BadFrameCausesString         "LAMBDA_BAD_FRAME_CAUSES"
+#define LAMBDA_StatsEnableString            "LAMBDA_STATS_ENABLE"
+#define LAMBDA_StatsPeriodString            "LAMBDA_STATS_PERIOD"
+#define LAMBDA_StatsTotalString             "LAMBDA_STATS_TOTAL"
+#define LAMBDA_StatsMaxString               "LAMBDA_STATS_MAX"
+#define LAMBDA_StatsSaturatedString         "LAMBDA_STATS_SATURATED"
+#define LAMBDA_AttributeTemplateString      "LAMBDA_ATTRIBUTE_TEMPLATE"
+#define LAMBDA_StatsHistogramString         "LAMBDA_STATS_HISTOGRAM"
+#define LAMBDA_PackedOutputString           "LAMBDA_PACKED_OUTPUT"
+#define LAMBDA_StaleModeString              "LAMBDA_STALE_MODE"
+#define LAMBDA_StaleAgeString               "LAMBDA_STALE_AGE"
+#define LAMBDA_StaleDistanceString          "LAMBDA_STALE_DISTANCE"
+#define LAMBDA_StaleFramesString            "LAMBDA_STALE_FRAMES"
+#define LAMBDA_LateFramesString             "LAMBDA_LATE_FRAMES"
+#define LAMBDA_PendingFramesString          "LAMBDA_PENDING_FRAMES"
+#define LAMBDA_ModuleMissingString          "LAMBDA_MODULE_MISSING"
+#define LAMBDA_ScanEnableString             "LAMBDA_SCAN_ENABLE"
+#define LAMBDA_ScanThresholdsString         "LAMBDA_SCAN_THRESHOLDS"
+#define LAMBDA_ThresholdMinString           "LAMBDA_THRESHOLD_MIN"
+#define LAMBDA_ThresholdMaxString           "LAMBDA_THRESHOLD_MAX"
+#define LAMBDA_ScanPointsString             "LAMBDA_SCAN_POINTS"
+#define LAMBDA_ScanPointString              "LAMBDA_SCAN_POINT"
+#define LAMBDA_ScanSetupTimeString          "LAMBDA_SCAN_SETUP_TIME"
+#define LAMBDA_GeometryEnableString         "LAMBDA_GEOMETRY_ENABLE"
+#define LAMBDA_GeometryFileString           "LAMBDA_GEOMETRY_FILE"
+#define LAMBDA_GeometryRunsString           "LAMBDA_GEOMETRY_RUNS"
+#define LAMBDA_GeometrySpreadsString        "LAMBDA_GEOMETRY_SPREADS"
+#define LAMBDA_ShmEnableString              "LAMBDA_SHM_ENABLE"
+#define LAMBDA_ShmNameString                "LAMBDA_SHM_NAME"
+#define LAMBDA_ShmSlotsString               "LAMBDA_SHM_SLOTS"
+#define LAMBDA_ShmModeString                "LAMBDA_SHM_MODE"
+#define LAMBDA_ShmTimeoutString             "LAMBDA_SHM_TIMEOUT"
+#define LAMBDA_ShmPublishedString           "LAMBDA_SHM_PUBLISHED"
+#define LAMBDA_ShmOverrunsString            "LAMBDA_SHM_OVERRUNS"
+#define LAMBDA_ShmReadersString             "LAMBDA_SHM_READERS"
+#define LAMBDA_ShmOversizedString           "LAMBDA_SHM_OVERSIZED"
+#define LAMBDA_PhaseEnableString            "LAMBDA_PHASE_ENABLE"
+#define LAMBDA_PhaseBinsString              "LAMBDA_PHASE_BINS"
+#define LAMBDA_PhaseCyclesString            "LAMBDA_PHASE_CYCLES"
+#define LAMBDA_PhaseBlocksString            "LAMBDA_PHASE_BLOCKS"
+#define LAMBDA_PhaseLateString              "LAMBDA_PHASE_LATE"
+#define LAMBDA_XpcsEnableString             "LAMBDA_XPCS_ENABLE"
+#define LAMBDA_XpcsMaskFileString           "LAMBDA_XPCS_MASK_FILE"
+#define LAMBDA_XpcsChannelsString           "LAMBDA_XPCS_CHANNELS"
+#define LAMBDA_XpcsLevelsString             "LAMBDA_XPCS_LEVELS"
+#define LAMBDA_XpcsWorkersString            "LAMBDA_XPCS_WORKERS"
+#define LAMBDA_XpcsPeriodString             "LAMBDA_XPCS_PERIOD"
+#define LAMBDA_XpcsExportString             "LAMBDA_XPCS_EXPORT"
+#define LAMBDA_XpcsRingString               "LAMBDA_XPCS_RING"
+#define LAMBDA_XpcsRingsString              "LAMBDA_XPCS_RINGS"
+#define LAMBDA_XpcsPixelsString             "LAMBDA_XPCS_PIXELS"
+#define LAMBDA_XpcsFramesString             "LAMBDA_XPCS_FRAMES"
+#define LAMBDA_XpcsDroppedString            "LAMBDA_XPCS_DROPPED"
+#define LAMBDA_XpcsMissingString            "LAMBDA_XPCS_MISSING"
+#define LAMBDA_XpcsTauString                "LAMBDA_XPCS_TAU"
+#define LAMBDA_XpcsG2String                 "LAMBDA_XPCS_G2"
+#define LAMBDA_ReorderEnableString          "LAMBDA_REORDER_ENABLE"
+#define LAMBDA_ReorderWindowString          "LAMBDA_REORDER_WINDOW"
+#define LAMBDA_ReorderTimeoutString         "LAMBDA_REORDER_TIMEOUT"
+#define LAMBDA_ReorderDepthString           "LAMBDA_REORDER_DEPTH"
+#define LAMBDA_ReorderSkippedString         "LAMBDA_REORDER_SKIPPED"
+#define LAMBDA_ReorderLateString            "LAMBDA_REORDER_LATE"
+#define LAMBDA_ReorderDuplicatesString      "LAMBDA_REORDER_DUPLICATES"
+#define LAMBDA_PreviewEnableString          "LAMBDA_PREVIEW_ENABLE"
+#define LAMBDA_PreviewModeString            "LAMBDA_PREVIEW_MODE"
+#define LAMBDA_PreviewRateString            "LAMBDA_PREVIEW_RATE"
+#define LAMBDA_PreviewEveryString           "LAMBDA_PREVIEW_EVERY"
+#define LAMBDA_PreviewBinningString         "LAMBDA_PREVIEW_BINNING"
+#define LAMBDA_PreviewFramesString          "LAMBDA_PREVIEW_FRAMES"
+#define LAMBDA_VetoModeString               "LAMBDA_VETO_MODE"
+#define LAMBDA_VetoMinXString               "LAMBDA_VETO_MIN_X"
+#define LAMBDA_VetoMinYString               "LAMBDA_VETO_MIN_Y"
+#define LAMBDA_VetoSizeXString              "LAMBDA_VETO_SIZE_X"
+#define LAMBDA_VetoSizeYString              "LAMBDA_VETO_SIZE_Y"
+#define LAMBDA_VetoPixelLevelString         "LAMBDA_VETO_PIXEL_LEVEL"
+#define LAMBDA_VetoLowString                "LAMBDA_VETO_LOW"
+#define LAMBDA_VetoHighString               "LAMBDA_VETO_HIGH"
+#define LAMBDA_VetoPreFramesString          "LAMBDA_VETO_PRE_FRAMES"
+#define LAMBDA_VetoPostFramesString         "LAMBDA_VETO_POST_FRAMES"
+#define LAMBDA_VetoAcceptedString           "LAMBDA_VETO_ACCEPTED"
+#define LAMBDA_VetoRetainedString           "LAMBDA_VETO_RETAINED"
+#define LAMBDA_VetoRejectedString           "LAMBDA_VETO_REJECTED"
+#define LAMBDA_BatchEnableString            "LAMBDA_BATCH_ENABLE"
+#define LAMBDA_BatchSizeString              "LAMBDA_BATCH_SIZE"
+#define LAMBDA_BatchTimeoutString           "LAMBDA_BATCH_TIMEOUT"
+#define LAMBDA_BatchArraysString            "LAMBDA_BATCH_ARRAYS"
 
 
 #endif
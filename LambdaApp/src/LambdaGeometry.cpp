@@ -0,0 +1,199 @@
+/**
+ Copyright (c) 2015, UChicago Argonne, LLC
+ See LICENSE file.
+ */
+/* LambdaGeometry.cpp */
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <cmath>
+
+#include "LambdaGeometry.h"
+
+/**
+ * Reads a remap table. Nothing is compiled until the module frame sizes
+ * are known, see compile().
+ * \param[in] path Location of the table file
+ */
+LambdaGeometry::LambdaGeometry(const std::string& path) :
+	file_path(path)
+{
+	FILE* fp = fopen(path.c_str(), "r");
+
+	if (fp == NULL)
+	{
+		this->error_msg = "Couldn't open " + path + ": " + std::strerror(errno);
+		return;
+	}
+
+	char line[256];
+	int line_no = 0;
+	int current = -1;
+
+	while (fgets(line, sizeof(line), fp) != NULL)
+	{
+		line_no += 1;
+
+		char* comment = strchr(line, '#');
+		if (comment != NULL)    { *comment = '\0'; }
+
+		pixel_entry entry;
+		int value_a, value_b;
+		char extra;
+
+		entry.weight = 1.0f;
+
+		int fields = sscanf(line, "%d %d %d %d %f %c", &entry.src_x, &entry.src_y, &entry.dst_x, &entry.dst_y, &entry.weight, &extra);
+
+		if (fields == 4 || fields == 5)
+		{
+			if (current < 0 || ! std::isfinite(entry.weight) || entry.weight <= 0.0f)
+			{
+				this->error_msg = path + " line " + std::to_string(line_no) + ": pixel entry outside a module section or with a bad weight";
+				break;
+			}
+
+			this->tables[current].push_back(entry);
+		}
+		else if (sscanf(line, " size %d %d %c", &value_a, &value_b, &extra) == 2)
+		{
+			this->full_width = value_a;
+			this->full_height = value_b;
+		}
+		else if (sscanf(line, " module %d %c", &value_a, &extra) == 1)
+		{
+			current = value_a;
+		}
+		else if (strspn(line, " \t\r\n") != strlen(line))
+		{
+			this->error_msg = path + " line " + std::to_string(line_no) + ": can't parse \"" + line + "\"";
+			break;
+		}
+	}
+
+	fclose(fp);
+
+	if (this->error_msg.empty() && (this->full_width <= 0 || this->full_height <= 0))
+	{
+		this->error_msg = path + " has no valid size line";
+	}
+}
+
+/**
+ * Turns the table for one input into copy runs and spread ops. Pixels that
+ * move one to one with no other pixel landing on the same spot become runs,
+ * where consecutive source pixels go to consecutive destinations they are
+ * merged so they copy as fast as the plain stitch. Everything else, split
+ * pixels or pixels sharing a destination, is a weighted spread.
+ * \param[in] index Input the table section belongs to
+ * \param[in] frameWidth Width of that input's frames
+ * \param[in] frameHeight Height of that input's frames
+ */
+bool LambdaGeometry::compile(int index, int frameWidth, int frameHeight)
+{
+	auto found = this->tables.find(index);
+
+	if (found == this->tables.end())    { return true; }
+
+	std::vector<pixel_entry>& entries = found->second;
+	std::vector<int> src_uses((size_t) frameWidth * frameHeight, 0);
+	std::vector<int> dst_uses((size_t) this->full_width * this->full_height, 0);
+	std::vector<double> src_weights((size_t) frameWidth * frameHeight, 0.0);
+
+	for (const auto& entry : entries)
+	{
+		if (entry.src_x < 0 || entry.src_x >= frameWidth || entry.src_y < 0 || entry.src_y >= frameHeight ||
+		    entry.dst_x < 0 || entry.dst_x >= this->full_width || entry.dst_y < 0 || entry.dst_y >= this->full_height)
+		{
+			this->error_msg = this->file_path + ": module " + std::to_string(index) + " maps pixel (" +
+			                  std::to_string(entry.src_x) + ", " + std::to_string(entry.src_y) + ") out of bounds";
+			return false;
+		}
+
+		src_uses[entry.src_y * frameWidth + entry.src_x] += 1;
+		src_weights[entry.src_y * frameWidth + entry.src_x] += entry.weight;
+		dst_uses[entry.dst_y * this->full_width + entry.dst_x] += 1;
+	}
+
+	std::sort(entries.begin(), entries.end(), [frameWidth](const pixel_entry& a, const pixel_entry& b)
+	{
+		return (a.src_y * frameWidth + a.src_x) < (b.src_y * frameWidth + b.src_x);
+	});
+
+	lambda_module_map& output = this->maps[index];
+
+	output.runs.clear();
+	output.spreads.clear();
+
+	uint32_t last_src = UINT32_MAX;
+	double handed_out = 0.0;
+	int remaining = 0;
+
+	for (const auto& entry : entries)
+	{
+		uint32_t src = entry.src_y * frameWidth + entry.src_x;
+		uint32_t dst = entry.dst_y * this->full_width + entry.dst_x;
+
+		if (entry.weight == 1.0f && src_uses[src] == 1 && dst_uses[dst] == 1)
+		{
+			if (! output.runs.empty())
+			{
+				lambda_copy_run& run = output.runs.back();
+
+				if (run.src + run.length == src && run.dst + run.length == dst)
+				{
+					run.length += 1;
+					continue;
+				}
+			}
+
+			output.runs.push_back(lambda_copy_run{ src, dst, 1 });
+		}
+		else
+		{
+			if (src != last_src)
+			{
+				handed_out = 0.0;
+				remaining = src_uses[src];
+			}
+
+			handed_out += entry.weight / src_weights[src];
+			remaining -= 1;
+
+			// The last share takes whatever rounding left over
+			output.spreads.push_back(lambda_spread_op{ src, dst, (remaining == 0) ? 1.0 : std::min(handed_out, 1.0), src != last_src });
+			last_src = src;
+		}
+	}
+
+	return true;
+}
+
+/**
+ * Compiled map for an input, NULL if the table doesn't cover it
+ */
+const lambda_module_map* LambdaGeometry::module(int index) const
+{
+	auto found = this->maps.find(index);
+
+	return (found == this->maps.end()) ? NULL : &found->second;
+}
+
+size_t LambdaGeometry::numRuns() const
+{
+	size_t output = 0;
+
+	for (const auto& item : this->maps)    { output += item.second.runs.size(); }
+
+	return output;
+}
+
+size_t LambdaGeometry::numSpreads() const
+{
+	size_t output = 0;
+
+	for (const auto& item : this->maps)    { output += item.second.spreads.size(); }
+
+	return output;
+}
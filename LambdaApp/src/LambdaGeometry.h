@@ -0,0 +1,124 @@
+/**
+ Copyright (c) 2015, UChicago Argonne, LLC
+ See LICENSE file.
+ */
+/* LambdaGeometry.h
+ *
+ * Pixel remapping from module frames into the stitched image, used to
+ * place modules at their true positions and to split the large pixels at
+ * Medipix3 chip boundaries.
+ *
+ * The table is a text file, one entry per line, '#' starts a comment:
+ *
+ *   size <width> <height>                           stitched image size
+ *   module <n>                                      following lines apply to input n
+ *   <src_x> <src_y> <dst_x> <dst_y> [weight]        move one module pixel
+ *
+ * A source pixel may appear several times with weights summing to 1 to
+ * spread it over several destination pixels. Weights are normalised per
+ * source pixel and every count ends up in exactly one destination, so a
+ * spread never creates or loses counts. Inputs without a module section
+ * are stitched at their usual position.
+ *
+ */
+#ifndef LAMBDA_GEOMETRY_H
+#define LAMBDA_GEOMETRY_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <cstdint>
+#include <cmath>
+
+/**
+ * length pixels copied unchanged from consecutive source indices to
+ * consecutive destination indices
+ */
+typedef struct
+{
+	uint32_t src;
+	uint32_t dst;
+	uint32_t length;
+} lambda_copy_run;
+
+/**
+ * A weighted share of one source pixel added onto a destination pixel.
+ * The ops for a source pixel are consecutive, upto is the fraction of the
+ * source handed out by this op and the ones before it, exactly 1 on the
+ * last. first marks the first op for its source pixel so statistics count
+ * every source pixel once.
+ */
+typedef struct
+{
+	uint32_t src;
+	uint32_t dst;
+	double upto;
+	bool first;
+} lambda_spread_op;
+
+/**
+ * Integer share of value that a spread op adds onto its destination.
+ * given carries the amount already handed out for the source pixel
+ * between calls, so the shares of one source sum to exactly value.
+ */
+inline uint32_t lambdaSpreadShare(const lambda_spread_op& op, uint32_t value, uint32_t* given)
+{
+	if (op.first)    { *given = 0; }
+
+	uint32_t total = (uint32_t) std::llround(value * op.upto);
+	uint32_t share = total - *given;
+
+	*given = total;
+
+	return share;
+}
+
+/**
+ * The compiled remap for a single input. Runs are applied first, then
+ * spreads are added on top.
+ */
+typedef struct
+{
+	std::vector<lambda_copy_run> runs;
+	std::vector<lambda_spread_op> spreads;
+} lambda_module_map;
+
+class LambdaGeometry
+{
+public:
+	LambdaGeometry(const std::string& path);
+
+	bool isValid() const    { return this->error_msg.empty(); }
+	const std::string& error() const    { return this->error_msg; }
+	const std::string& path() const     { return this->file_path; }
+
+	int width() const     { return this->full_width; }
+	int height() const    { return this->full_height; }
+
+	bool compile(int index, int frameWidth, int frameHeight);
+	const lambda_module_map* module(int index) const;
+
+	size_t numRuns() const;
+	size_t numSpreads() const;
+
+private:
+	typedef struct
+	{
+		int src_x;
+		int src_y;
+		int dst_x;
+		int dst_y;
+		float weight;
+	} pixel_entry;
+
+	std::string file_path;
+	std::string error_msg;
+
+	int full_width = 0;
+	int full_height = 0;
+
+	std::map<int, std::vector<pixel_entry> > tables;
+	std::map<int, lambda_module_map> maps;
+};
+
+#endif
@@ -0,0 +1,135 @@
+/**
+ Copyright (c) 2015, UChicago Argonne, LLC
+ See LICENSE file.
+ */
+/* LambdaPack.h
+ *
+ * Pack and unpack kernels for the 1-bit and 6-bit output formats. Frames
+ * using them are exported with NDArray::codec.name set to one of the
+ * codec names below and compressedSize set to the packed length.
+ *
+ * Both formats are little-endian bit streams: pixel p occupies bits
+ * [p * bits, (p + 1) * bits) counting from bit 0 of byte 0.
+ *
+ * Packing may be done in place (in == out).
+ *
+ */
+#ifndef LAMBDA_PACK_H
+#define LAMBDA_PACK_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+static const char LAMBDA_CODEC_PACK1[] = "lambda-pack1";
+static const char LAMBDA_CODEC_PACK6[] = "lambda-pack6";
+
+inline size_t lambdaPackedSize(size_t pixels, int bits)    { return (pixels * bits + 7) / 8; }
+
+/**
+ * Packs one byte per pixel (0 or 1) into one bit per pixel
+ */
+inline size_t lambdaPack1(const uint8_t* in, uint8_t* out, size_t pixels)
+{
+	size_t index = 0;
+
+	#ifdef __SSE2__
+	// Shift bit 0 of every byte up to bit 7, movemask gathers the 16 top bits
+	for (; index + 16 <= pixels; index += 16)
+	{
+		__m128i block = _mm_loadu_si128((const __m128i*) &in[index]);
+		uint16_t mask = (uint16_t) _mm_movemask_epi8(_mm_slli_epi16(block, 7));
+
+		out[index / 8]     = (uint8_t) mask;
+		out[index / 8 + 1] = (uint8_t) (mask >> 8);
+	}
+	#endif
+
+	// Multiplying by the magic constant moves bit 0 of byte i to bit 56 + i
+	for (; index + 8 <= pixels; index += 8)
+	{
+		uint64_t block;
+		std::memcpy(&block, &in[index], sizeof(block));
+
+		out[index / 8] = (uint8_t) (((block & 0x0101010101010101ull) * 0x0102040810204080ull) >> 56);
+	}
+
+	if (index < pixels)
+	{
+		uint8_t tail = 0;
+
+		for (size_t bit = 0; index + bit < pixels; bit += 1)    { tail |= (in[index + bit] & 1) << bit; }
+
+		out[index / 8] = tail;
+	}
+
+	return lambdaPackedSize(pixels, 1);
+}
+
+/**
+ * Packs one byte per pixel (0 to 63) into six bits per pixel, eight pixels
+ * to six bytes at a time.
+ */
+inline size_t lambdaPack6(const uint8_t* in, uint8_t* out, size_t pixels)
+{
+	size_t index = 0;
+
+	for (; index + 8 <= pixels; index += 8)
+	{
+		uint64_t block;
+		std::memcpy(&block, &in[index], sizeof(block));
+
+		block &= 0x3F3F3F3F3F3F3F3Full;
+		block = (block & 0x003F003F003F003Full) | ((block & 0x3F003F003F003F00ull) >> 2);
+		block = (block & 0x00000FFF00000FFFull) | ((block & 0x0FFF00000FFF0000ull) >> 4);
+		block = (block & 0x0000000000FFFFFFull) | ((block & 0x00FFFFFF00000000ull) >> 8);
+
+		uint8_t* dest = &out[index / 8 * 6];
+
+		for (int byte = 0; byte < 6; byte += 1)    { dest[byte] = (uint8_t) (block >> (8 * byte)); }
+	}
+
+	if (index < pixels)
+	{
+		uint64_t block = 0;
+
+		for (size_t pixel = 0; index + pixel < pixels; pixel += 1)    { block |= (uint64_t) (in[index + pixel] & 0x3F) << (6 * pixel); }
+
+		uint8_t* dest = &out[index / 8 * 6];
+		size_t remaining = lambdaPackedSize(pixels - index, 6);
+
+		for (size_t byte = 0; byte < remaining; byte += 1)    { dest[byte] = (uint8_t) (block >> (8 * byte)); }
+	}
+
+	return lambdaPackedSize(pixels, 6);
+}
+
+/**
+ * Expands a lambda-pack1 stream back to one byte per pixel
+ */
+inline void lambdaUnpack1(const uint8_t* in, uint8_t* out, size_t pixels)
+{
+	for (size_t index = 0; index < pixels; index += 1)    { out[index] = (in[index / 8] >> (index % 8)) & 1; }
+}
+
+/**
+ * Expands a lambda-pack6 stream back to one byte per pixel
+ */
+inline void lambdaUnpack6(const uint8_t* in, uint8_t* out, size_t pixels)
+{
+	for (size_t index = 0; index < pixels; index += 1)
+	{
+		size_t bit = index * 6;
+		uint16_t pair = in[bit / 8];
+
+		if ((bit % 8) > 2)    { pair |= (uint16_t) in[bit / 8 + 1] << 8; }
+
+		out[index] = (pair >> (bit % 8)) & 0x3F;
+	}
+}
+
+#endif
@@ -0,0 +1,370 @@
+/**
+ Copyright (c) 2015, UChicago Argonne, LLC
+ See LICENSE file.
+ */
+/* LambdaRawRecorder.cpp */
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "LambdaRawRecorder.h"
+
+static void raw_writer_callback(void *drvPvt)    { ((LambdaRawRecorder*) drvPvt)->writerThread(); }
+
+static uint64_t raw_timestamp()
+{
+	epicsTimeStamp now;
+	epicsTimeGetCurrent(&now);
+
+	return (uint64_t) now.secPastEpoch * 1000000000ull + now.nsec;
+}
+
+/**
+ * Opens the data and index files, preallocates the data file and starts
+ * the writer thread.
+ * \param[in] basename Full path of the files without extension
+ * \param[in] header Description of the frames that will be recorded
+ * \param[in] preallocFrames Number of frames to reserve space for on disk
+ */
+LambdaRawRecorder::LambdaRawRecorder(const std::string& basename, const lambda_raw_header& header, size_t preallocFrames) :
+	header(header),
+	data_name(basename + ".raw"),
+	index_name(basename + ".idx")
+{
+	std::memcpy(this->header.magic, LAMBDA_RAW_MAGIC, sizeof(LAMBDA_RAW_MAGIC));
+	this->header.version = LAMBDA_RAW_VERSION;
+
+	#ifdef O_DIRECT
+	this->data_fd = open(this->data_name.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+	this->direct = (this->data_fd >= 0);
+	#endif
+
+	// Some filesystems (tmpfs, some network mounts) refuse O_DIRECT
+	if (this->data_fd < 0)    { this->data_fd = open(this->data_name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644); }
+
+	if (this->data_fd < 0)
+	{
+		this->error_msg = "Couldn't open " + this->data_name + ": " + std::strerror(errno);
+		return;
+	}
+
+	this->index_fp = fopen(this->index_name.c_str(), "wb");
+
+	if (this->index_fp == NULL)
+	{
+		this->error_msg = "Couldn't open " + this->index_name + ": " + std::strerror(errno);
+		close(this->data_fd);
+		this->data_fd = -1;
+		return;
+	}
+
+	if (fwrite(&this->header, sizeof(lambda_raw_header), 1, this->index_fp) != 1)
+	{
+		this->error_msg = "Write to " + this->index_name + " failed: " + std::strerror(errno);
+		fclose(this->index_fp);
+		close(this->data_fd);
+		this->index_fp = NULL;
+		this->data_fd = -1;
+		return;
+	}
+
+	if (preallocFrames > 0)
+	{
+		off_t length = (off_t) (preallocFrames * this->header.frame_bytes);
+		length = ((length + LAMBDA_RAW_ALIGNMENT - 1) / LAMBDA_RAW_ALIGNMENT) * LAMBDA_RAW_ALIGNMENT;
+
+		// Failure only means we lose the preallocation, the writes still work
+		posix_fallocate(this->data_fd, 0, length);
+	}
+
+	for (int index = 0; index < LAMBDA_RAW_NUM_BUFFERS; index += 1)
+	{
+		void* memory = NULL;
+
+		if (posix_memalign(&memory, LAMBDA_RAW_ALIGNMENT, LAMBDA_RAW_BUFFER_BYTES) != 0)    { break; }
+
+		raw_buffer* buffer = new raw_buffer;
+		buffer->data = (char*) memory;
+		buffer->used = 0;
+
+		this->pool.push_back(buffer);
+		this->free_buffers.push_back(buffer);
+	}
+
+	if (this->pool.empty())
+	{
+		this->error_msg = "Couldn't allocate raw recording buffers";
+		fclose(this->index_fp);
+		close(this->data_fd);
+		this->index_fp = NULL;
+		this->data_fd = -1;
+		return;
+	}
+
+	epicsThreadCreate("LambdaRawRecorder::writerThread()",
+	                  epicsThreadPriorityMedium,
+	                  epicsThreadGetStackSize(epicsThreadStackMedium),
+	                  (EPICSTHREADFUNC)::raw_writer_callback,
+	                  this);
+}
+
+LambdaRawRecorder::~LambdaRawRecorder()
+{
+	this->finish();
+
+	for (auto buffer : this->pool)
+	{
+		free(buffer->data);
+		delete buffer;
+	}
+}
+
+LambdaRawRecorder::raw_buffer* LambdaRawRecorder::takeFreeBuffer()
+{
+	this->lock.lock();
+
+	// Block the receiver rather than drop, the receiver's own RAM buffer absorbs the stall
+	while (this->free_buffers.empty())
+	{
+		this->lock.unlock();
+			this->bufferFreed.wait();
+		this->lock.lock();
+	}
+
+	raw_buffer* output = this->free_buffers.front();
+	this->free_buffers.pop_front();
+
+	this->lock.unlock();
+
+	output->used = 0;
+	output->entries.clear();
+
+	return output;
+}
+
+void LambdaRawRecorder::submit(raw_buffer* buffer)
+{
+	this->lock.lock();
+		this->full_buffers.push_back(buffer);
+	this->lock.unlock();
+
+	this->bufferFilled.trigger();
+}
+
+/**
+ * Copies a single raw frame into the buffer pool. Frames may straddle
+ * pool buffers, the data file is a contiguous stream.
+ */
+void LambdaRawRecorder::write(const void* data, uint64_t frame_no, uint32_t status)
+{
+	if (! this->isOpen() || this->finishing)    { return; }
+
+	if (this->current == NULL)    { this->current = this->takeFreeBuffer(); }
+
+	lambda_raw_entry entry;
+	entry.frame_no = frame_no;
+	entry.module = this->header.module;
+	entry.status = status;
+	entry.timestamp_ns = raw_timestamp();
+
+	this->current->entries.push_back(entry);
+
+	const char* source = (const char*) data;
+	size_t remaining = this->header.frame_bytes;
+
+	while (remaining > 0)
+	{
+		if (this->current == NULL)    { this->current = this->takeFreeBuffer(); }
+
+		size_t count = std::min(remaining, LAMBDA_RAW_BUFFER_BYTES - this->current->used);
+
+		std::memcpy(&this->current->data[this->current->used], source, count);
+
+		this->current->used += count;
+		source += count;
+		remaining -= count;
+
+		if (this->current->used == LAMBDA_RAW_BUFFER_BYTES)
+		{
+			this->submit(this->current);
+			this->current = NULL;
+		}
+	}
+
+	this->frames_submitted += 1;
+}
+
+/**
+ * Flushes any partially filled buffer, waits for the writer thread to
+ * drain and trims the preallocated file down to the recorded size.
+ */
+void LambdaRawRecorder::finish()
+{
+	if (! this->isOpen() || this->finishing)    { return; }
+
+	if (this->current != NULL)
+	{
+		if (this->current->used > 0)    { this->submit(this->current); }
+		else
+		{
+			this->lock.lock();
+				this->free_buffers.push_back(this->current);
+			this->lock.unlock();
+		}
+
+		this->current = NULL;
+	}
+
+	this->lock.lock();
+		this->finishing = true;
+	this->lock.unlock();
+
+	this->bufferFilled.trigger();
+	this->writerDone.wait();
+
+	if (ftruncate(this->data_fd, (off_t) (this->frames_submitted * this->header.frame_bytes)) != 0)
+	{
+		this->setError("Couldn't truncate " + this->data_name + ": " + std::strerror(errno));
+	}
+
+	close(this->data_fd);
+
+	// Buffered index entries only reach the disk here
+	if (fclose(this->index_fp) != 0)    { this->setError("Write to " + this->index_name + " failed: " + std::strerror(errno)); }
+
+	this->data_fd = -1;
+	this->index_fp = NULL;
+}
+
+/**
+ * Pulls filled buffers and writes them out. Every buffer except the last is
+ * exactly LAMBDA_RAW_BUFFER_BYTES, the last is padded up to the alignment
+ * that O_DIRECT requires and trimmed again in finish().
+ */
+void LambdaRawRecorder::writerThread()
+{
+	epicsTime first_write;
+	bool started = false;
+
+	this->lock.lock();
+
+	while (true)
+	{
+		if (this->full_buffers.empty())
+		{
+			if (this->finishing)    { break; }
+
+			this->lock.unlock();
+				this->bufferFilled.wait();
+			this->lock.lock();
+			continue;
+		}
+
+		raw_buffer* buffer = this->full_buffers.front();
+		this->full_buffers.pop_front();
+
+		this->lock.unlock();
+
+		if (! started)
+		{
+			first_write = epicsTime::getCurrent();
+			started = true;
+		}
+
+		size_t length = buffer->used;
+
+		if (this->direct)
+		{
+			size_t padded = ((length + LAMBDA_RAW_ALIGNMENT - 1) / LAMBDA_RAW_ALIGNMENT) * LAMBDA_RAW_ALIGNMENT;
+			std::memset(&buffer->data[length], 0, padded - length);
+			length = padded;
+		}
+
+		size_t done = 0;
+
+		while (done < length)
+		{
+			ssize_t count = pwrite(this->data_fd, &buffer->data[done], length - done, (off_t) (this->data_offset + done));
+
+			if (count < 0 && errno == EINTR)    { continue; }
+			if (count <= 0)
+			{
+				this->setError("Write to " + this->data_name + " failed: " + std::strerror(errno));
+				break;
+			}
+
+			done += count;
+		}
+
+		bool indexed = (fwrite(buffer->entries.data(), sizeof(lambda_raw_entry), buffer->entries.size(), this->index_fp) == buffer->entries.size());
+
+		if (! indexed)    { this->setError("Write to " + this->index_name + " failed: " + std::strerror(errno)); }
+
+		this->lock.lock();
+			// The offset moves on regardless so later frames stay at i * frameBytes
+			this->data_offset += buffer->used;
+			this->bytes_written += std::min(done, buffer->used);
+
+			// A frame missing from the index can't be replayed, so it doesn't count either
+			if (done >= length && indexed)    { this->frames_written += buffer->entries.size(); }
+
+			this->write_seconds = epicsTime::getCurrent() - first_write;
+
+			this->free_buffers.push_back(buffer);
+		this->lock.unlock();
+
+		this->bufferFreed.trigger();
+
+		this->lock.lock();
+	}
+
+	this->lock.unlock();
+
+	this->writerDone.trigger();
+}
+
+/**
+ * Most recent error, the writer thread can set it at any time
+ */
+std::string LambdaRawRecorder::error()
+{
+	this->lock.lock();
+		std::string output = this->error_msg;
+	this->lock.unlock();
+
+	return output;
+}
+
+void LambdaRawRecorder::setError(const std::string& message)
+{
+	this->lock.lock();
+		this->error_msg = message;
+	this->lock.unlock();
+}
+
+uint64_t LambdaRawRecorder::framesWritten()
+{
+	this->lock.lock();
+		uint64_t output = this->frames_written;
+	this->lock.unlock();
+
+	return output;
+}
+
+/**
+ * Sustained write bandwidth in MB/s, measured from the start of the first
+ * write to the end of the most recent one.
+ */
+double LambdaRawRecorder::bandwidth()
+{
+	this->lock.lock();
+		double output = (this->write_seconds > 0.0) ? (this->bytes_written / this->write_seconds / 1.0E6) : 0.0;
+	this->lock.unlock();
+
+	return output;
+}
@@ -0,0 +1,125 @@
+/**
+ Copyright (c) 2015, UChicago Argonne, LLC
+ See LICENSE file.
+ */
+/* LambdaRawRecorder.h
+ *
+ * Writes raw module frames straight to disk, bypassing the NDArray
+ * pipeline. Each recorder owns one data file and one index file.
+ *
+ * The data file is a headerless stream of fixed-size frames, frame i
+ * begins at byte i * frameBytes. The index file starts with a
+ * lambda_raw_header followed by one lambda_raw_entry per frame. Version 1
+ * headers end before bit_depth.
+ *
+ */
+#ifndef LAMBDA_RAW_RECORDER_H
+#define LAMBDA_RAW_RECORDER_H
+
+#include <string>
+#include <deque>
+#include <vector>
+#include <cstdio>
+#include <cstdint>
+
+#include <epicsEvent.h>
+#include <epicsMutex.h>
+#include <epicsThread.h>
+#include <epicsTime.h>
+
+static const char LAMBDA_RAW_MAGIC[8] = { 'L', 'M', 'B', 'D', 'R', 'A', 'W', '1' };
+
+static const uint32_t LAMBDA_RAW_VERSION = 2;
+
+static const size_t LAMBDA_RAW_ALIGNMENT = 4096;
+static const size_t LAMBDA_RAW_BUFFER_BYTES = 16 * 1024 * 1024;
+static const int LAMBDA_RAW_NUM_BUFFERS = 8;
+
+#pragma pack(push, 1)
+typedef struct
+{
+	char     magic[8];
+	uint32_t version;
+	uint32_t module;
+	uint32_t width;
+	uint32_t height;
+	uint32_t bytes_per_pixel;
+	int32_t  x_position;
+	int32_t  y_position;
+	uint32_t frames_per_image;
+	uint64_t frame_bytes;
+	uint32_t bit_depth;
+} lambda_raw_header;
+
+typedef struct
+{
+	uint64_t frame_no;
+	uint32_t module;
+	uint32_t status;
+	uint64_t timestamp_ns;    /* Host time the frame was handed to the recorder */
+} lambda_raw_entry;
+#pragma pack(pop)
+
+/**
+ * Recorder for a single receiver. write() is called from the receiver's
+ * acquisition thread and only copies into a pool buffer, full buffers are
+ * handed to a writer thread that issues large aligned writes.
+ */
+class LambdaRawRecorder
+{
+public:
+	LambdaRawRecorder(const std::string& basename, const lambda_raw_header& header, size_t preallocFrames);
+	~LambdaRawRecorder();
+
+	bool isOpen() const    { return this->data_fd >= 0; }
+	std::string error();
+	const std::string& dataFileName() const    { return this->data_name; }
+
+	void write(const void* data, uint64_t frame_no, uint32_t status);
+	void finish();
+
+	void writerThread();
+
+	uint64_t framesWritten();
+	double bandwidth();
+
+private:
+	typedef struct
+	{
+		char* data;
+		size_t used;
+		std::vector<lambda_raw_entry> entries;
+	} raw_buffer;
+
+	raw_buffer* takeFreeBuffer();
+	void submit(raw_buffer* buffer);
+	void setError(const std::string& message);
+
+	lambda_raw_header header;
+	std::string data_name;
+	std::string index_name;
+	std::string error_msg;
+
+	int data_fd = -1;
+	FILE* index_fp = NULL;
+	bool direct = false;
+
+	std::vector<raw_buffer*> pool;
+	std::deque<raw_buffer*> free_buffers;
+	std::deque<raw_buffer*> full_buffers;
+	raw_buffer* current = NULL;
+
+	epicsMutex lock;
+	epicsEvent bufferFreed;
+	epicsEvent bufferFilled;
+	epicsEvent writerDone;
+	bool finishing = false;
+
+	uint64_t data_offset = 0;
+	uint64_t bytes_written = 0;
+	uint64_t frames_written = 0;
+	uint64_t frames_submitted = 0;
+	double write_seconds = 0.0;
+};
+
+#endif
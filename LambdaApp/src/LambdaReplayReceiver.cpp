@@ -0,0 +1,298 @@
+/**
+ Copyright (c) 2015, UChicago Argonne, LLC
+ See LICENSE file.
+ */
+/* LambdaReplayReceiver.cpp */
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+#include <cstddef>
+
+#include <epicsTime.h>
+
+#include "LambdaReplayReceiver.h"
+
+static void replay_reader_callback(void *drvPvt)    { ((LambdaReplayReceiver*) drvPvt)->readerThread(); }
+
+/**
+ * Loads the index of a recording and starts the reader thread, which
+ * stays idle until start() is called.
+ * \param[in] basename Path of the recording without the .raw/.idx extension
+ * \param[in] realtime Replay at the recorded frame timing instead of as fast as possible.
+ *                     The timing is when the recorder received each frame, not
+ *                     the detector's own time stamps.
+ */
+LambdaReplayReceiver::LambdaReplayReceiver(const std::string& basename, bool realtime) :
+	realtime(realtime)
+{
+	std::string index_name = basename + ".idx";
+	std::string data_name = basename + ".raw";
+
+	FILE* index_fp = fopen(index_name.c_str(), "rb");
+
+	if (index_fp == NULL)
+	{
+		this->error_msg = "Couldn't open " + index_name + ": " + std::strerror(errno);
+		return;
+	}
+
+	// Version 1 headers stop short of bit_depth
+	const size_t v1_bytes = offsetof(lambda_raw_header, bit_depth);
+
+	std::memset(&this->header, 0, sizeof(lambda_raw_header));
+
+	if (fread(&this->header, v1_bytes, 1, index_fp) != 1 ||
+	    std::memcmp(this->header.magic, LAMBDA_RAW_MAGIC, sizeof(LAMBDA_RAW_MAGIC)) != 0 ||
+	    this->header.version < 1 || this->header.version > LAMBDA_RAW_VERSION ||
+	    (this->header.version >= 2 && fread(&this->header.bit_depth, sizeof(uint32_t), 1, index_fp) != 1))
+	{
+		this->error_msg = index_name + " is not a Lambda raw recording index";
+		fclose(index_fp);
+		return;
+	}
+
+	// 1-bit and 6-bit recordings look the same without it, assume the more common 6-bit
+	if (this->header.version == 1)
+	{
+		if      (this->header.bytes_per_pixel == 1)    { this->header.bit_depth = 6; }
+		else if (this->header.bytes_per_pixel == 2)    { this->header.bit_depth = 12; }
+		else                                           { this->header.bit_depth = 24; }
+	}
+
+	lambda_raw_entry entry;
+
+	while (fread(&entry, sizeof(lambda_raw_entry), 1, index_fp) == 1)    { this->entries.push_back(entry); }
+
+	fclose(index_fp);
+
+	this->data_fp = fopen(data_name.c_str(), "rb");
+
+	if (this->data_fp == NULL)
+	{
+		this->error_msg = "Couldn't open " + data_name + ": " + std::strerror(errno);
+		return;
+	}
+
+	// Prefetch as many frames as fit into the buffer budget, but always at least a dual pair
+	size_t num_frames = std::max((size_t) 2, (size_t) (LAMBDA_REPLAY_BUFFER_BYTES / std::max((uint64_t) 1, this->header.frame_bytes)));
+	num_frames = std::min(num_frames, std::max((size_t) 2, this->entries.size()));
+
+	for (size_t index = 0; index < num_frames; index += 1)
+	{
+		LambdaReplayFrame* frame = new LambdaReplayFrame;
+		frame->buffer = (char*) malloc(this->header.frame_bytes);
+
+		this->pool.push_back(frame);
+		this->free_frames.push_back(frame);
+	}
+
+	epicsThreadCreate("LambdaReplayReceiver::readerThread()",
+	                  epicsThreadPriorityMedium,
+	                  epicsThreadGetStackSize(epicsThreadStackMedium),
+	                  (EPICSTHREADFUNC)::replay_reader_callback,
+	                  this);
+}
+
+LambdaReplayReceiver::~LambdaReplayReceiver()
+{
+	if (this->isOpen())
+	{
+		this->lock.lock();
+			this->shutdown = true;
+			this->running = false;
+		this->lock.unlock();
+
+		this->startEvent.trigger();
+		this->frameFreed.trigger();
+		this->readerDone.wait();
+
+		fclose(this->data_fp);
+	}
+
+	for (auto frame : this->pool)
+	{
+		free(frame->buffer);
+		delete frame;
+	}
+}
+
+/**
+ * Begins streaming the recording from its first frame. Frames left over
+ * from a previous run are discarded.
+ */
+void LambdaReplayReceiver::start()
+{
+	this->stop();
+
+	this->lock.lock();
+		while (! this->ready_frames.empty())
+		{
+			this->free_frames.push_back(this->ready_frames.front());
+			this->ready_frames.pop_front();
+		}
+
+		this->running = true;
+		this->busy = true;
+	this->lock.unlock();
+
+	this->startEvent.trigger();
+}
+
+void LambdaReplayReceiver::stop()
+{
+	this->lock.lock();
+		this->running = false;
+	this->lock.unlock();
+
+	this->frameFreed.trigger();
+
+	// Wait for the reader to notice
+	while (true)
+	{
+		this->lock.lock();
+			bool reading = this->busy;
+		this->lock.unlock();
+
+		if (! reading)    { break; }
+
+		epicsThreadSleep(0.001);
+	}
+}
+
+/**
+ * Busy until every frame has been queued, mirrors Detector::isBusy() so
+ * the acquisition threads know when an empty frame means the end.
+ */
+bool LambdaReplayReceiver::isBusy()
+{
+	this->lock.lock();
+		bool output = this->busy || ! this->ready_frames.empty();
+	this->lock.unlock();
+
+	return output;
+}
+
+LambdaReplayFrame* LambdaReplayReceiver::frame(int timeout_ms)
+{
+	this->lock.lock();
+
+	if (this->ready_frames.empty())
+	{
+		this->lock.unlock();
+			this->frameReady.wait(timeout_ms / 1000.0);
+		this->lock.lock();
+	}
+
+	LambdaReplayFrame* output = nullptr;
+
+	if (! this->ready_frames.empty())
+	{
+		output = this->ready_frames.front();
+		this->ready_frames.pop_front();
+	}
+
+	this->lock.unlock();
+
+	return output;
+}
+
+void LambdaReplayReceiver::release(LambdaReplayFrame* frame)
+{
+	if (frame == nullptr)    { return; }
+
+	this->lock.lock();
+		this->free_frames.push_back(frame);
+	this->lock.unlock();
+
+	this->frameFreed.trigger();
+}
+
+int LambdaReplayReceiver::framesQueued()
+{
+	this->lock.lock();
+		int output = (int) this->ready_frames.size();
+	this->lock.unlock();
+
+	return output;
+}
+
+/**
+ * Reads frames sequentially from the data file into free buffers. In
+ * realtime mode each frame is held back until its recorded offset from
+ * the first frame has elapsed. Recorded offsets are host arrival times, so
+ * they include any receiver buffering jitter.
+ */
+void LambdaReplayReceiver::readerThread()
+{
+	while (true)
+	{
+		this->startEvent.wait();
+
+		this->lock.lock();
+			bool exiting = this->shutdown;
+		this->lock.unlock();
+
+		if (exiting)    { break; }
+
+		rewind(this->data_fp);
+
+		epicsTime start_time = epicsTime::getCurrent();
+		uint64_t first_stamp = this->entries.empty() ? 0 : this->entries[0].timestamp_ns;
+
+		for (const auto& entry : this->entries)
+		{
+			LambdaReplayFrame* frame = NULL;
+
+			this->lock.lock();
+
+			while (this->running && this->free_frames.empty())
+			{
+				this->lock.unlock();
+					this->frameFreed.wait(0.1);
+				this->lock.lock();
+			}
+
+			if (this->running)
+			{
+				frame = this->free_frames.front();
+				this->free_frames.pop_front();
+			}
+
+			this->lock.unlock();
+
+			if (frame == NULL)    { break; }
+
+			if (fread(frame->buffer, this->header.frame_bytes, 1, this->data_fp) != 1)
+			{
+				this->release(frame);
+				break;
+			}
+
+			frame->entry = entry;
+
+			if (this->realtime)
+			{
+				double offset = (entry.timestamp_ns - first_stamp) / 1.0E9;
+				double remaining = offset - (epicsTime::getCurrent() - start_time);
+
+				if (remaining > 0.0)    { epicsThreadSleep(remaining); }
+			}
+
+			this->lock.lock();
+				this->ready_frames.push_back(frame);
+			this->lock.unlock();
+
+			this->frameReady.trigger();
+		}
+
+		this->lock.lock();
+			this->busy = false;
+			exiting = this->shutdown;
+		this->lock.unlock();
+
+		if (exiting)    { break; }
+	}
+
+	this->readerDone.trigger();
+}
@@ -0,0 +1,99 @@
+/**
+ Copyright (c) 2015, UChicago Argonne, LLC
+ See LICENSE file.
+ */
+/* LambdaReplayReceiver.h
+ *
+ * Streams frames previously written by LambdaRawRecorder back into the
+ * driver. Presents the same frame()/release()/framesQueued() interface
+ * as xsp::lambda::Receiver so it can be used as a lambda_input.
+ *
+ */
+#ifndef LAMBDA_REPLAY_RECEIVER_H
+#define LAMBDA_REPLAY_RECEIVER_H
+
+#include <string>
+#include <deque>
+#include <vector>
+#include <cstdio>
+#include <cstdint>
+
+#include <libxsp.h>
+
+#include <epicsEvent.h>
+#include <epicsMutex.h>
+#include <epicsThread.h>
+
+#include "LambdaRawRecorder.h"
+
+static const size_t LAMBDA_REPLAY_BUFFER_BYTES = 256 * 1024 * 1024;
+
+/**
+ * A single replayed frame, mirrors the accessors of xsp::Frame
+ */
+class LambdaReplayFrame
+{
+public:
+	uint64_t nr() const                  { return this->entry.frame_no; }
+	xsp::FrameStatusCode status() const  { return (xsp::FrameStatusCode) this->entry.status; }
+	const void* data() const             { return this->buffer; }
+
+private:
+	friend class LambdaReplayReceiver;
+
+	lambda_raw_entry entry;
+	char* buffer = NULL;
+};
+
+class LambdaReplayReceiver
+{
+public:
+	LambdaReplayReceiver(const std::string& basename, bool realtime);
+	~LambdaReplayReceiver();
+
+	bool isOpen() const    { return this->data_fp != NULL; }
+	const std::string& error() const    { return this->error_msg; }
+
+	int frameWidth() const     { return this->header.width; }
+	int frameHeight() const    { return this->header.height; }
+	int xPosition() const      { return this->header.x_position; }
+	int yPosition() const      { return this->header.y_position; }
+	int bitDepth() const       { return this->header.bit_depth; }
+	bool dualMode() const      { return this->header.frames_per_image > 1; }
+	size_t framesRecorded() const    { return this->entries.size(); }
+	size_t bufferFrames() const      { return this->pool.size(); }
+
+	void start();
+	void stop();
+	bool isBusy();
+
+	LambdaReplayFrame* frame(int timeout_ms);
+	void release(LambdaReplayFrame* frame);
+	int framesQueued();
+
+	void readerThread();
+
+private:
+	lambda_raw_header header;
+	std::vector<lambda_raw_entry> entries;
+	std::string error_msg;
+
+	FILE* data_fp = NULL;
+	bool realtime;
+
+	std::vector<LambdaReplayFrame*> pool;
+	std::deque<LambdaReplayFrame*> free_frames;
+	std::deque<LambdaReplayFrame*> ready_frames;
+
+	epicsMutex lock;
+	epicsEvent startEvent;
+	epicsEvent frameReady;
+	epicsEvent frameFreed;
+	epicsEvent readerDone;
+
+	bool running = false;
+	bool busy = false;
+	bool shutdown = false;
+};
+
+#endif
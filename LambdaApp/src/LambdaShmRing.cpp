@@ -0,0 +1,299 @@
+/**
+ Copyright (c) 2015, UChicago Argonne, LLC
+ See LICENSE file.
+ */
+/* LambdaShmRing.cpp */
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+#include <new>
+
+#include <epicsThread.h>
+#include <epicsTime.h>
+
+#include "LambdaShmRing.h"
+
+/**
+ * Creates (or recreates) the shared memory segment. Readers attached to a
+ * previous segment of the same name see it marked closed.
+ * \param[in] name POSIX shared memory name, e.g. "/lambda"
+ * \param[in] numSlots Number of frames the ring holds
+ * \param[in] slotBytes Largest frame that can be published
+ */
+LambdaShmRing::LambdaShmRing(const std::string& name, uint32_t numSlots, uint64_t slotBytes) :
+	shm_name(name),
+	num_slots(std::max(numSlots, (uint32_t) 1)),
+	slot_bytes(slotBytes)
+{
+	uint64_t stride = LAMBDA_SHM_SLOT_HEADER + slotBytes;
+	stride = ((stride + LAMBDA_SHM_ALIGNMENT - 1) / LAMBDA_SHM_ALIGNMENT) * LAMBDA_SHM_ALIGNMENT;
+
+	this->mapped_bytes = lambdaShmHeaderBytes() + this->num_slots * stride;
+
+	shm_unlink(name.c_str());
+
+	int fd = shm_open(name.c_str(), O_CREAT | O_RDWR | O_EXCL, 0666);
+
+	if (fd < 0)
+	{
+		this->error_msg = "Couldn't create shared memory " + name + ": " + std::strerror(errno);
+		return;
+	}
+
+	// Identifies this segment, so the destructor leaves a newer one of the same name alone
+	struct stat info;
+
+	if (fstat(fd, &info) == 0)
+	{
+		this->shm_device = info.st_dev;
+		this->shm_inode = info.st_ino;
+	}
+
+	if (ftruncate(fd, this->mapped_bytes) != 0)
+	{
+		this->error_msg = "Couldn't size shared memory " + name + ": " + std::strerror(errno);
+		close(fd);
+		shm_unlink(name.c_str());
+		return;
+	}
+
+	void* memory = mmap(NULL, this->mapped_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (memory == MAP_FAILED)
+	{
+		this->error_msg = "Couldn't map shared memory " + name + ": " + std::strerror(errno);
+		shm_unlink(name.c_str());
+		return;
+	}
+
+	// A fresh segment is zero filled, which is a valid state for every atomic
+	this->header = new (memory) lambda_shm_header;
+
+	this->header->version = 1;
+	this->header->num_slots = this->num_slots;
+	this->header->slot_bytes = slotBytes;
+	this->header->slot_stride = stride;
+	this->header->write_seq.store(0);
+
+	// Magic goes last, readers refuse the segment until it's there
+	std::atomic_thread_fence(std::memory_order_release);
+	std::memcpy(this->header->magic, LAMBDA_SHM_MAGIC, sizeof(LAMBDA_SHM_MAGIC));
+}
+
+LambdaShmRing::~LambdaShmRing()
+{
+	if (this->header == NULL)    { return; }
+
+	this->header->closed.store(1);
+
+	munmap(this->header, this->mapped_bytes);
+
+	// A ring recreated under the same name replaced this one, its segment has to stay
+	int fd = shm_open(this->shm_name.c_str(), O_RDONLY, 0);
+
+	if (fd < 0)    { return; }
+
+	struct stat info;
+
+	if (fstat(fd, &info) == 0 && info.st_dev == this->shm_device && info.st_ino == this->shm_inode)
+	{
+		shm_unlink(this->shm_name.c_str());
+	}
+
+	close(fd);
+}
+
+/**
+ * Position of the reader that's furthest behind, current if there are no
+ * readers.
+ */
+uint64_t LambdaShmRing::slowestReader(uint64_t current)
+{
+	uint64_t output = current;
+
+	for (int index = 0; index < LAMBDA_SHM_MAX_READERS; index += 1)
+	{
+		const lambda_shm_cursor& cursor = this->header->readers[index];
+
+		if (cursor.active.load() == 1)    { output = std::min(output, cursor.read_seq.load()); }
+	}
+
+	return output;
+}
+
+/**
+ * Frees the cursors of readers that exited without closing the ring, so
+ * they don't hold up a lossless writer or count as readers forever. Called
+ * with the ring locked, which is only held for this and never while a
+ * publish waits.
+ */
+void LambdaShmRing::reapReaders()
+{
+	for (int index = 0; index < LAMBDA_SHM_MAX_READERS; index += 1)
+	{
+		lambda_shm_cursor& cursor = this->header->readers[index];
+		uint32_t expected = 1;
+
+		if (cursor.active.load() != 1 || cursor.pid == 0)    { continue; }
+
+		if (kill((pid_t) cursor.pid, 0) != 0 && errno == ESRCH)    { cursor.active.compare_exchange_strong(expected, 0); }
+	}
+}
+
+/**
+ * Copies a frame into the next slot. In lossless mode, waits up to timeout
+ * seconds for every reader to be done with the slot first. A slot that's
+ * reused before a reader got to it counts as an overrun, a frame larger
+ * than a slot isn't published and counts as oversized. The ring's lock is
+ * only held to claim a slot, waiting and copying happen without it so
+ * export threads publishing at the same time don't hold each other up.
+ * \param[in] meta Frame description, seq is filled in here
+ * \param[in] data meta.data_bytes bytes of frame data
+ * \param[in] lossless Wait for readers instead of overwriting
+ * \param[in] timeout Longest wait in lossless mode
+ */
+bool LambdaShmRing::publish(lambda_shm_slot& meta, const void* data, bool lossless, double timeout)
+{
+	if (this->header == NULL)    { return false; }
+
+	epicsTimeStamp start, now;
+	epicsTimeGetCurrent(&start);
+
+	uint64_t seq = 0;
+	bool claimed = false;
+
+	// Never more writers filling slots than there are slots, or two would share one
+	while (true)
+	{
+		{
+			std::lock_guard<std::mutex> guard(this->lock);
+
+			if (meta.data_bytes > this->slot_bytes)
+			{
+				this->oversize_count += 1;
+				return false;
+			}
+
+			if (this->in_flight < this->num_slots)
+			{
+				seq = this->next_seq;
+				this->next_seq += 1;
+				this->in_flight += 1;
+				claimed = true;
+			}
+			else if (! lossless)
+			{
+				this->overrun_count += 1;
+				return false;
+			}
+		}
+
+		if (claimed)    { break; }
+
+		epicsTimeGetCurrent(&now);
+
+		if (epicsTimeDiffInSeconds(&now, &start) >= timeout)
+		{
+			std::lock_guard<std::mutex> guard(this->lock);
+			this->overrun_count += 1;
+			return false;
+		}
+
+		epicsThreadSleep(0.00005);
+	}
+
+	if (lossless && (seq - this->slowestReader(seq)) >= this->num_slots)
+	{
+		// The reader holding things up may have died
+		{
+			std::lock_guard<std::mutex> guard(this->lock);
+			this->reapReaders();
+		}
+
+		do
+		{
+			epicsThreadSleep(0.00005);
+			epicsTimeGetCurrent(&now);
+		}
+		while ((seq - this->slowestReader(seq)) >= this->num_slots && epicsTimeDiffInSeconds(&now, &start) < timeout);
+	}
+
+	if ((seq - this->slowestReader(seq)) >= this->num_slots)
+	{
+		std::lock_guard<std::mutex> guard(this->lock);
+		this->overrun_count += 1;
+	}
+
+	char* base = ((char*) this->header) + lambdaShmHeaderBytes();
+	lambda_shm_slot* slot = (lambda_shm_slot*) (base + (seq % this->num_slots) * this->header->slot_stride);
+
+	slot->seq.store(2 * seq + 1);
+	std::atomic_thread_fence(std::memory_order_release);
+
+	slot->frame_id = meta.frame_id;
+	slot->timestamp_ns = meta.timestamp_ns;
+	slot->data_bytes = meta.data_bytes;
+	slot->flags = meta.flags;
+	slot->data_type = meta.data_type;
+	slot->ndims = std::min(meta.ndims, (uint32_t) LAMBDA_SHM_MAX_DIMS);
+	std::memcpy(slot->dims, meta.dims, sizeof(slot->dims));
+	std::memcpy(slot->codec, meta.codec, sizeof(slot->codec));
+
+	std::memcpy(((char*) slot) + LAMBDA_SHM_SLOT_HEADER, data, meta.data_bytes);
+
+	slot->seq.store(2 * seq + 2, std::memory_order_release);
+
+	// Slots can finish out of order, write_seq only ever moves forward
+	uint64_t written = this->header->write_seq.load();
+
+	while (written < seq + 1 && ! this->header->write_seq.compare_exchange_weak(written, seq + 1, std::memory_order_release))    { }
+
+	{
+		std::lock_guard<std::mutex> guard(this->lock);
+		this->in_flight -= 1;
+	}
+
+	return true;
+}
+
+uint64_t LambdaShmRing::published()
+{
+	return (this->header == NULL) ? 0 : this->header->write_seq.load();
+}
+
+uint64_t LambdaShmRing::overruns()
+{
+	std::lock_guard<std::mutex> guard(this->lock);
+
+	return this->overrun_count;
+}
+
+uint64_t LambdaShmRing::oversized()
+{
+	std::lock_guard<std::mutex> guard(this->lock);
+
+	return this->oversize_count;
+}
+
+/**
+ * Number of attached readers, after freeing the cursors of any that died
+ */
+int LambdaShmRing::readers()
+{
+	int output = 0;
+
+	if (this->header == NULL)    { return 0; }
+
+	{
+		std::lock_guard<std::mutex> guard(this->lock);
+		this->reapReaders();
+	}
+
+	for (int index = 0; index < LAMBDA_SHM_MAX_READERS; index += 1)
+	{
+		if (this->header->readers[index].active.load() == 1)    { output += 1; }
+	}
+
+	return output;
+}
@@ -0,0 +1,285 @@
+/**
+ Copyright (c) 2015, UChicago Argonne, LLC
+ See LICENSE file.
+ */
+/* LambdaShmRing.h
+ *
+ * POSIX shared-memory ring the driver publishes stitched frames into, so
+ * processes on the same host can read them in place.
+ *
+ * The segment starts with a lambda_shm_header followed by num_slots slots
+ * of slot_stride bytes. Each slot is a lambda_shm_slot with the frame data
+ * LAMBDA_SHM_SLOT_HEADER bytes after its start. Frame n (counting from 0)
+ * goes into slot n % num_slots.
+ *
+ * Slots are guarded by a sequence number: it is odd while the writer is
+ * filling the slot and 2 * n + 2 once frame n is complete. A reader checks
+ * the sequence before and after using the data to know the slot wasn't
+ * overwritten in the meantime.
+ *
+ * Readers claim one of LAMBDA_SHM_MAX_READERS cursors. In lossless mode
+ * the writer waits (up to a timeout) for the slowest claimed cursor before
+ * reusing a slot, in lossy mode it never waits. The writer frees cursors
+ * whose process has exited without closing the ring, so readers have to
+ * share the writer's PID namespace.
+ *
+ * Everything a reader needs is in this header, it doesn't depend on EPICS.
+ *
+ */
+#ifndef LAMBDA_SHM_RING_H
+#define LAMBDA_SHM_RING_H
+
+#include <string>
+#include <atomic>
+#include <mutex>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static const char LAMBDA_SHM_MAGIC[8] = { 'L', 'M', 'B', 'D', 'S', 'H', 'M', '1' };
+
+static const int LAMBDA_SHM_MAX_READERS = 16;
+static const int LAMBDA_SHM_MAX_DIMS = 3;
+static const size_t LAMBDA_SHM_ALIGNMENT = 4096;
+static const size_t LAMBDA_SHM_SLOT_HEADER = 256;
+
+/* lambda_shm_slot.flags */
+static const uint32_t LAMBDA_SHM_PARTIAL = 0x1;
+static const uint32_t LAMBDA_SHM_PACKED = 0x2;
+
+typedef struct
+{
+	std::atomic<uint64_t> read_seq;
+	std::atomic<uint32_t> active;
+	uint32_t pid;
+} lambda_shm_cursor;
+
+typedef struct
+{
+	char     magic[8];
+	uint32_t version;
+	uint32_t num_slots;
+	uint64_t slot_bytes;
+	uint64_t slot_stride;
+	std::atomic<uint32_t> closed;
+	std::atomic<uint64_t> write_seq;
+	lambda_shm_cursor readers[LAMBDA_SHM_MAX_READERS];
+} lambda_shm_header;
+
+/**
+ * Per-frame description, data_type is an NDDataType_t and codec is empty
+ * unless the payload is packed (see LambdaPack.h).
+ */
+typedef struct
+{
+	std::atomic<uint64_t> seq;
+	uint64_t frame_id;
+	uint64_t timestamp_ns;
+	uint64_t data_bytes;
+	uint32_t flags;
+	uint32_t data_type;
+	uint32_t ndims;
+	uint32_t dims[LAMBDA_SHM_MAX_DIMS];
+	char     codec[16];
+} lambda_shm_slot;
+
+static_assert(sizeof(lambda_shm_slot) <= LAMBDA_SHM_SLOT_HEADER, "lambda_shm_slot must fit in the slot header");
+
+inline size_t lambdaShmHeaderBytes()
+{
+	return ((sizeof(lambda_shm_header) + LAMBDA_SHM_ALIGNMENT - 1) / LAMBDA_SHM_ALIGNMENT) * LAMBDA_SHM_ALIGNMENT;
+}
+
+/**
+ * Writer side, owned by the driver. publish() may be called from several
+ * export threads at once, each claims its own slot and fills it without
+ * holding the ring's lock.
+ */
+class LambdaShmRing
+{
+public:
+	LambdaShmRing(const std::string& name, uint32_t numSlots, uint64_t slotBytes);
+	~LambdaShmRing();
+
+	bool isOpen() const    { return this->header != NULL; }
+	const std::string& error() const    { return this->error_msg; }
+	const std::string& name() const     { return this->shm_name; }
+	uint32_t numSlots() const    { return this->num_slots; }
+	uint64_t slotBytes() const   { return this->slot_bytes; }
+
+	bool publish(lambda_shm_slot& meta, const void* data, bool lossless, double timeout);
+
+	uint64_t published();
+	uint64_t overruns();
+	uint64_t oversized();
+	int readers();
+
+private:
+	uint64_t slowestReader(uint64_t current);
+	void reapReaders();
+
+	std::string shm_name;
+	std::string error_msg;
+
+	uint32_t num_slots;
+	uint64_t slot_bytes;
+
+	lambda_shm_header* header = NULL;
+	size_t mapped_bytes = 0;
+
+	dev_t shm_device = 0;
+	ino_t shm_inode = 0;
+
+	std::mutex lock;
+	uint64_t next_seq = 0;
+	uint32_t in_flight = 0;
+	uint64_t overrun_count = 0;
+	uint64_t oversize_count = 0;
+};
+
+/**
+ * Reader side, for use by external processes.
+ *
+ *     LambdaShmReader reader;
+ *     reader.open("/lambda");
+ *
+ *     while (true)
+ *     {
+ *         const lambda_shm_slot* slot = reader.next(1000);
+ *         if (slot == NULL)    { continue; }
+ *
+ *         ... use slot and reader.payload(slot) ...
+ *
+ *         if (! reader.valid(slot))    { ... overwritten while in use, discard results ... }
+ *         reader.release();
+ *     }
+ */
+class LambdaShmReader
+{
+public:
+	~LambdaShmReader()    { this->close(); }
+
+	bool open(const char* name)
+	{
+		int fd = shm_open(name, O_RDWR, 0);
+		if (fd < 0)    { return false; }
+
+		struct stat info;
+		if (fstat(fd, &info) != 0 || (size_t) info.st_size < lambdaShmHeaderBytes())    { ::close(fd); return false; }
+
+		void* memory = mmap(NULL, info.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		::close(fd);
+
+		if (memory == MAP_FAILED)    { return false; }
+
+		this->header = (lambda_shm_header*) memory;
+		this->mapped_bytes = info.st_size;
+
+		if (std::memcmp(this->header->magic, LAMBDA_SHM_MAGIC, sizeof(LAMBDA_SHM_MAGIC)) != 0)    { this->close(); return false; }
+
+		// A cursor is 2 while being claimed, the writer only waits for cursors at 1
+		for (int index = 0; index < LAMBDA_SHM_MAX_READERS; index += 1)
+		{
+			uint32_t expected = 0;
+			lambda_shm_cursor& cursor = this->header->readers[index];
+
+			if (cursor.active.compare_exchange_strong(expected, 2))
+			{
+				this->position = this->header->write_seq.load();
+				cursor.read_seq.store(this->position);
+				cursor.pid = (uint32_t) getpid();
+				cursor.active.store(1);
+
+				this->cursor = index;
+				return true;
+			}
+		}
+
+		this->close();
+		return false;
+	}
+
+	void close()
+	{
+		if (this->header == NULL)    { return; }
+
+		if (this->cursor >= 0)    { this->header->readers[this->cursor].active.store(0); }
+
+		munmap(this->header, this->mapped_bytes);
+		this->header = NULL;
+		this->cursor = -1;
+	}
+
+	/** The writer has gone away or recreated the ring, reopen to continue */
+	bool closed() const    { return this->header == NULL || this->header->closed.load() != 0; }
+
+	/** Frames the writer overwrote before this reader got to them */
+	uint64_t lost() const    { return this->lost_count; }
+
+	/** Waits up to timeout_ms for the next frame */
+	const lambda_shm_slot* next(int timeout_ms)
+	{
+		if (this->header == NULL)    { return NULL; }
+
+		struct timespec pause = { 0, 50000 };
+
+		for (int waited = 0; waited <= timeout_ms * 20; waited += 1)
+		{
+			uint64_t written = this->header->write_seq.load();
+
+			// Lapped by the writer, skip to the oldest frame still in the ring
+			if (written > this->position + this->header->num_slots)
+			{
+				uint64_t oldest = written - this->header->num_slots;
+
+				this->lost_count += oldest - this->position;
+				this->position = oldest;
+				this->header->readers[this->cursor].read_seq.store(oldest);
+			}
+
+			const lambda_shm_slot* slot = this->slot(this->position);
+
+			if (slot->seq.load() == 2 * this->position + 2)    { return slot; }
+
+			if (this->closed())    { return NULL; }
+
+			nanosleep(&pause, NULL);
+		}
+
+		return NULL;
+	}
+
+	const void* payload(const lambda_shm_slot* slot) const    { return ((const char*) slot) + LAMBDA_SHM_SLOT_HEADER; }
+
+	/** Whether the slot still holds the frame next() returned */
+	bool valid(const lambda_shm_slot* slot) const    { return slot->seq.load() == 2 * this->position + 2; }
+
+	/** Done with the current frame, lets the writer reuse its slot */
+	void release()
+	{
+		this->position += 1;
+		this->header->readers[this->cursor].read_seq.store(this->position);
+	}
+
+private:
+	const lambda_shm_slot* slot(uint64_t seq) const
+	{
+		const char* base = ((const char*) this->header) + lambdaShmHeaderBytes();
+
+		return (const lambda_shm_slot*) (base + (seq % this->header->num_slots) * this->header->slot_stride);
+	}
+
+	lambda_shm_header* header = NULL;
+	size_t mapped_bytes = 0;
+	int cursor = -1;
+	uint64_t position = 0;
+	uint64_t lost_count = 0;
+};
+
+#endif
@@ -0,0 +1,525 @@
+/**
+ Copyright (c) 2015, UChicago Argonne, LLC
+ See LICENSE file.
+ */
+/* LambdaXpcs.cpp */
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+
+#include "LambdaXpcs.h"
+
+typedef struct
+{
+	LambdaXpcs* owner;
+	int index;
+} xpcs_thread_data;
+
+static void xpcs_worker_callback(void *drvPvt)
+{
+	xpcs_thread_data* data = (xpcs_thread_data*) drvPvt;
+
+	data->owner->workerThread(data->index);
+
+	delete data;
+}
+
+/**
+ * Loads the ring mask, lays out the lags and starts the worker threads.
+ * Each worker owns a contiguous share of the masked pixels. isValid() is
+ * false if the mask can't be used or a worker thread can't be started.
+ * \param[in] maskPath Location of the mask file
+ * \param[in] width Stitched image width
+ * \param[in] height Stitched image height
+ * \param[in] numWorkers Number of worker threads
+ * \param[in] channels Values kept per level, rounded down to an even number, 4 to 64
+ * \param[in] levels Number of levels, each doubling the lag range
+ */
+LambdaXpcs::LambdaXpcs(const std::string& maskPath, size_t width, size_t height, int numWorkers, int channels, int levels) :
+	width(width),
+	height(height),
+	channels(std::max(4, std::min(channels, 64) & ~1)),
+	levels(std::max(1, std::min(levels, 24)))
+{
+	if (! this->loadMask(maskPath))    { return; }
+
+	for (int level = 0; level < this->levels; level += 1)
+	{
+		this->level_first_lag.push_back((int) this->lags.size());
+
+		for (int step = (level == 0) ? 1 : this->channels / 2; step < this->channels; step += 1)
+		{
+			this->lags.push_back((uint32_t) step << level);
+			this->lag_level.push_back(level);
+			this->lag_steps.push_back(step);
+		}
+	}
+
+	numWorkers = std::max(1, std::min(numWorkers, 64));
+	numWorkers = (int) std::min((size_t) numWorkers, this->pixels.size());
+
+	for (int index = 0; index < numWorkers; index += 1)
+	{
+		std::unique_ptr<xpcs_worker> worker(new xpcs_worker);
+
+		worker->first = this->pixels.size() * index / numWorkers;
+		worker->count = this->pixels.size() * (index + 1) / numWorkers - worker->first;
+		worker->frames = 0;
+		worker->stopping = false;
+		worker->started = false;
+
+		worker->history.assign(worker->count * this->levels * this->channels, 0.0f);
+		worker->products.assign(worker->count * this->lags.size(), 0.0);
+		worker->sums.assign(worker->count * this->levels, 0.0);
+		worker->level_frames.assign(this->levels, 0);
+		worker->valid.assign(this->levels * this->channels, 0);
+		worker->pairs.assign(this->lags.size(), 0);
+		worker->level_valid.assign(this->levels, 0);
+
+		worker->present.assign(this->levels, 0);
+		worker->steps.assign(this->levels * this->channels, 0);
+		worker->num_steps.assign(this->levels, 0);
+
+		this->workers.push_back(std::move(worker));
+	}
+
+	for (int index = 0; index < numWorkers; index += 1)
+	{
+		xpcs_thread_data* data = new xpcs_thread_data;
+
+		data->owner = this;
+		data->index = index;
+
+		epicsThreadId thread = epicsThreadCreate("LambdaXpcs::workerThread()",
+		                                         epicsThreadPriorityMedium,
+		                                         epicsThreadGetStackSize(epicsThreadStackMedium),
+		                                         (EPICSTHREADFUNC)::xpcs_worker_callback,
+		                                         data);
+
+		// The workers that did start are stopped by finish(), the others are never waited for
+		if (thread == NULL)
+		{
+			delete data;
+			this->error_msg = "Couldn't start correlator worker " + std::to_string(index);
+			break;
+		}
+
+		this->workers[index]->started = true;
+	}
+}
+
+LambdaXpcs::~LambdaXpcs()    { this->finish(); }
+
+bool LambdaXpcs::loadMask(const std::string& maskPath)
+{
+	FILE* fp = fopen(maskPath.c_str(), "rb");
+
+	if (fp == NULL)
+	{
+		this->error_msg = "Couldn't open " + maskPath + ": " + std::strerror(errno);
+		return false;
+	}
+
+	std::vector<uint16_t> mask(this->width * this->height);
+
+	size_t count = fread(mask.data(), sizeof(uint16_t), mask.size(), fp);
+	bool extra = (fgetc(fp) != EOF);
+
+	fclose(fp);
+
+	if (count != mask.size() || extra)
+	{
+		this->error_msg = maskPath + " isn't " + std::to_string(this->width) + " x " + std::to_string(this->height) + " 16-bit values";
+		return false;
+	}
+
+	for (size_t pixel = 0; pixel < mask.size(); pixel += 1)
+	{
+		if (mask[pixel] == 0)    { continue; }
+
+		this->pixels.push_back((uint32_t) pixel);
+		this->rings.push_back(mask[pixel] - 1);
+		this->num_rings = std::max(this->num_rings, (int) mask[pixel]);
+	}
+
+	if (this->pixels.empty())
+	{
+		this->error_msg = maskPath + " doesn't select any pixels";
+		return false;
+	}
+
+	return true;
+}
+
+/**
+ * Hands the next frame to every worker. When a worker is
+ * LAMBDA_XPCS_MAX_BACKLOG items behind, the frame is counted as dropped
+ * and goes in as a missing frame instead, so the correlator can't hold on
+ * to the whole NDArray pool.
+ */
+bool LambdaXpcs::push(NDArray* frame)
+{
+	if (frame->ndims < 2 || frame->dims[0].size * frame->dims[1].size < this->width * this->height)
+	{
+		this->skip(1);
+		return false;
+	}
+
+	this->lock.lock();
+
+	bool behind = false;
+
+	for (auto& worker : this->workers)    { behind = behind || (worker->queue.size() >= LAMBDA_XPCS_MAX_BACKLOG); }
+
+	if (behind)    { this->dropped += 1; }
+
+	this->lock.unlock();
+
+	this->enqueue(behind ? NULL : frame, behind ? 1 : 0);
+
+	return ! behind;
+}
+
+/**
+ * Stands in for frame numbers that won't be pushed, so later frames keep
+ * their place in time
+ * \param[in] count Number of consecutive frames missing
+ */
+void LambdaXpcs::skip(uint64_t count)
+{
+	if (count == 0)    { return; }
+
+	this->lock.lock();
+		this->missing += count;
+	this->lock.unlock();
+
+	this->enqueue(NULL, count);
+}
+
+/**
+ * Queues a frame, or a run of missing frames, for every worker. A run
+ * joins one already at the back of the queue.
+ */
+void LambdaXpcs::enqueue(NDArray* frame, uint64_t missing)
+{
+	this->lock.lock();
+
+	if (this->finished || this->workers.empty())
+	{
+		this->lock.unlock();
+		return;
+	}
+
+	for (auto& worker : this->workers)
+	{
+		if (frame != NULL)
+		{
+			frame->reserve();
+			worker->queue.push_back(xpcs_item{ frame, 0 });
+		}
+		else if (! worker->queue.empty() && worker->queue.back().frame == NULL)
+		{
+			worker->queue.back().missing += missing;
+		}
+		else
+		{
+			worker->queue.push_back(xpcs_item{ NULL, missing });
+		}
+	}
+
+	this->lock.unlock();
+
+	for (auto& worker : this->workers)    { worker->wake.trigger(); }
+}
+
+/**
+ * Lets the workers drain their queues and waits for them to exit. Results
+ * stay available afterwards.
+ */
+void LambdaXpcs::finish()
+{
+	this->lock.lock();
+
+	if (this->finished)
+	{
+		this->lock.unlock();
+		return;
+	}
+
+	this->finished = true;
+
+	for (auto& worker : this->workers)    { worker->stopping = true; }
+
+	this->lock.unlock();
+
+	for (auto& worker : this->workers)    { worker->wake.trigger(); }
+
+	for (auto& worker : this->workers)
+	{
+		if (worker->started)    { worker->done.wait(); }
+	}
+}
+
+void LambdaXpcs::workerThread(int index)
+{
+	xpcs_worker& worker = *this->workers[index];
+
+	this->lock.lock();
+
+	while (true)
+	{
+		if (worker.queue.empty())
+		{
+			if (worker.stopping)    { break; }
+
+			this->lock.unlock();
+				worker.wake.wait();
+			this->lock.lock();
+			continue;
+		}
+
+		xpcs_item item = worker.queue.front();
+		worker.queue.pop_front();
+
+		this->lock.unlock();
+
+		worker.lock.lock();
+			if (item.frame != NULL)
+			{
+				this->process(worker, item.frame);
+				worker.frames += 1;
+			}
+			else
+			{
+				this->miss(worker, item.missing);
+			}
+		worker.lock.unlock();
+
+		if (item.frame != NULL)    { item.frame->release(); }
+
+		this->lock.lock();
+	}
+
+	this->lock.unlock();
+
+	worker.done.trigger();
+}
+
+void LambdaXpcs::process(xpcs_worker& worker, const NDArray* frame)
+{
+	switch (frame->dataType)
+	{
+		case NDUInt8:     this->correlate(worker, (const epicsUInt8*) frame->pData);     break;
+		case NDUInt16:    this->correlate(worker, (const epicsUInt16*) frame->pData);    break;
+		case NDUInt32:    this->correlate(worker, (const epicsUInt32*) frame->pData);    break;
+		default:          break;
+	}
+}
+
+/**
+ * Works out, once for all of a worker's pixels, which levels receive a
+ * value from the next frame and which of their lags pair it with a real
+ * earlier value. Level l + 1 gets the average of level l's last two values
+ * each time level l completes a pair, and that average is only real when
+ * both values are. Counts the values and pairs that will be added.
+ * \param[in] present Whether the next frame exists
+ * \return Number of levels that receive a value, real or not
+ */
+int LambdaXpcs::advance(xpcs_worker& worker, bool present)
+{
+	const int m = this->channels;
+	const int num_levels = this->levels;
+
+	int active = 1;
+	while (active < num_levels && (worker.level_frames[active - 1] % 2) == 1)    { active += 1; }
+
+	for (int level = 0; level < active; level += 1)
+	{
+		uint64_t now = worker.level_frames[level];
+		uint8_t* valid = &worker.valid[level * m];
+
+		if (level > 0)    { present = present && worker.valid[(level - 1) * m + (worker.level_frames[level - 1] - 1) % m]; }
+
+		valid[now % m] = present;
+		worker.present[level] = present;
+		worker.num_steps[level] = 0;
+
+		if (! present)    { continue; }
+
+		worker.level_valid[level] += 1;
+
+		int first_step = (level == 0) ? 1 : m / 2;
+
+		for (int step = first_step; step < m && (uint64_t) step <= now; step += 1)
+		{
+			if (! valid[(now - step) % m])    { continue; }
+
+			worker.steps[level * m + worker.num_steps[level]] = step;
+			worker.num_steps[level] += 1;
+			worker.pairs[this->level_first_lag[level] + step - first_step] += 1;
+		}
+	}
+
+	return active;
+}
+
+/**
+ * Moves a worker past frames that won't arrive. Once a gap spans the whole
+ * history every slot is empty anyway, so longer gaps just clear it.
+ */
+void LambdaXpcs::miss(xpcs_worker& worker, uint64_t count)
+{
+	const uint64_t span = (uint64_t) this->channels << (this->levels - 1);
+
+	if (count > span)
+	{
+		std::fill(worker.valid.begin(), worker.valid.end(), 0);
+		return;
+	}
+
+	for (uint64_t index = 0; index < count; index += 1)
+	{
+		int active = this->advance(worker, false);
+
+		for (int level = 0; level < active; level += 1)    { worker.level_frames[level] += 1; }
+	}
+}
+
+/**
+ * Adds one frame to a worker's pixels, at the levels and lags advance()
+ * found real values for.
+ */
+template <typename T>
+void LambdaXpcs::correlate(xpcs_worker& worker, const T* data)
+{
+	const int m = this->channels;
+	const int num_levels = this->levels;
+	const size_t num_lags = this->lags.size();
+
+	int active = this->advance(worker, true);
+
+	for (size_t pixel = 0; pixel < worker.count; pixel += 1)
+	{
+		float value = (float) data[this->pixels[worker.first + pixel]];
+
+		float* history = &worker.history[pixel * num_levels * m];
+		double* products = &worker.products[pixel * num_lags];
+		double* sums = &worker.sums[pixel * num_levels];
+
+		// Averages built from a missing value are missing too, so the first gap ends the climb
+		for (int level = 0; level < active && worker.present[level]; level += 1)
+		{
+			float* ring = &history[level * m];
+			uint64_t now = worker.level_frames[level];
+
+			ring[now % m] = value;
+			sums[level] += value;
+
+			int first_step = (level == 0) ? 1 : m / 2;
+			double* lag_products = &products[this->level_first_lag[level]];
+			const int* steps = &worker.steps[level * m];
+
+			for (int index = 0; index < worker.num_steps[level]; index += 1)
+			{
+				int step = steps[index];
+
+				lag_products[step - first_step] += (double) value * ring[(now - step) % m];
+			}
+
+			if (level + 1 < active)    { value = 0.5f * (value + ring[(now - 1) % m]); }
+		}
+	}
+
+	for (int level = 0; level < active; level += 1)    { worker.level_frames[level] += 1; }
+}
+
+/**
+ * g2 of every ring at every lag, ring by ring. Points with nothing to
+ * average yet are 0. Each worker's sums are copied out under its lock and
+ * the division is done on the copy, so workers are only held up briefly.
+ */
+void LambdaXpcs::results(std::vector<double>& g2)
+{
+	const size_t num_lags = this->lags.size();
+
+	std::vector<uint32_t> counts(this->num_rings * num_lags, 0);
+	g2.assign(this->num_rings * num_lags, 0.0);
+
+	std::vector<double> products, sums;
+	std::vector<uint64_t> pairs, level_valid;
+
+	for (auto& item : this->workers)
+	{
+		xpcs_worker& worker = *item;
+
+		worker.lock.lock();
+			products = worker.products;
+			sums = worker.sums;
+			pairs = worker.pairs;
+			level_valid = worker.level_valid;
+		worker.lock.unlock();
+
+		for (size_t pixel = 0; pixel < worker.count; pixel += 1)
+		{
+			size_t ring_offset = this->rings[worker.first + pixel] * num_lags;
+			const double* pixel_products = &products[pixel * num_lags];
+			const double* pixel_sums = &sums[pixel * this->levels];
+
+			for (size_t lag = 0; lag < num_lags; lag += 1)
+			{
+				int level = this->lag_level[lag];
+
+				if (pairs[lag] == 0 || level_valid[level] == 0 || pixel_sums[level] <= 0.0)    { continue; }
+
+				double mean = pixel_sums[level] / level_valid[level];
+
+				g2[ring_offset + lag] += (pixel_products[lag] / pairs[lag]) / (mean * mean);
+				counts[ring_offset + lag] += 1;
+			}
+		}
+	}
+
+	for (size_t index = 0; index < g2.size(); index += 1)
+	{
+		if (counts[index] > 0)    { g2[index] /= counts[index]; }
+	}
+}
+
+/**
+ * Frames every worker has finished with
+ */
+uint64_t LambdaXpcs::framesProcessed()
+{
+	uint64_t output = UINT64_MAX;
+
+	for (auto& worker : this->workers)
+	{
+		worker->lock.lock();
+			output = std::min(output, worker->frames);
+		worker->lock.unlock();
+	}
+
+	return this->workers.empty() ? 0 : output;
+}
+
+uint64_t LambdaXpcs::framesDropped()
+{
+	this->lock.lock();
+		uint64_t output = this->dropped;
+	this->lock.unlock();
+
+	return output;
+}
+
+/**
+ * Frame numbers that never reached the correlator, see skip()
+ */
+uint64_t LambdaXpcs::framesMissing()
+{
+	this->lock.lock();
+		uint64_t output = this->missing;
+	this->lock.unlock();
+
+	return output;
+}
@@ -0,0 +1,152 @@
+/**
+ Copyright (c) 2015, UChicago Argonne, LLC
+ See LICENSE file.
+ */
+/* LambdaXpcs.h
+ *
+ * Streaming multi-tau autocorrelation of stitched frames over q-rings, so
+ * g2(tau) can be followed during an XPCS run.
+ *
+ * The mask file is a headerless array of width * height unsigned 16-bit
+ * values in native byte order, row by row. A pixel with value r > 0 belongs
+ * to q-ring r - 1, 0 leaves the pixel out.
+ *
+ * Each level of the correlator keeps the last `channels` values of every
+ * pixel. Level 0 sees every frame and covers lags 1 .. channels - 1, level
+ * l sees the average of consecutive pairs from level l - 1 and covers lags
+ * (channels / 2 .. channels - 1) * 2^l frames. For every pixel and lag the
+ * correlator sums I(t) * I(t - lag), g2 of a pixel is that sum over its
+ * count divided by the square of the pixel's mean at the same level, and
+ * the g2 of a ring is the mean over its pixels.
+ *
+ * Frames must be pushed in frame number order, with skip() standing in for
+ * every frame number that won't arrive. A missing frame still advances the
+ * correlator, so lags stay in step with frame numbers. It is left out of
+ * the means, of every product it takes part in and of the level averages
+ * built from it.
+ *
+ */
+#ifndef LAMBDA_XPCS_H
+#define LAMBDA_XPCS_H
+
+#include <string>
+#include <deque>
+#include <vector>
+#include <memory>
+#include <cstdint>
+
+#include <epicsEvent.h>
+#include <epicsMutex.h>
+#include <epicsThread.h>
+
+#include "NDArray.h"
+
+static const size_t LAMBDA_XPCS_MAX_BACKLOG = 32;
+
+class LambdaXpcs
+{
+public:
+	LambdaXpcs(const std::string& maskPath, size_t width, size_t height, int numWorkers, int channels, int levels);
+	~LambdaXpcs();
+
+	bool isValid() const    { return this->error_msg.empty(); }
+	const std::string& error() const    { return this->error_msg; }
+
+	int numRings() const     { return this->num_rings; }
+	size_t numLags() const   { return this->lags.size(); }
+	size_t numPixels() const { return this->pixels.size(); }
+
+	/** Lag of each g2 point, in frames */
+	const std::vector<uint32_t>& lagFrames() const    { return this->lags; }
+
+	bool push(NDArray* frame);
+	void skip(uint64_t count);
+	void finish();
+
+	void results(std::vector<double>& g2);
+
+	uint64_t framesProcessed();
+	uint64_t framesDropped();
+	uint64_t framesMissing();
+
+	void workerThread(int index);
+
+private:
+	/**
+	 * A frame for the workers, or missing frames when frame is NULL
+	 */
+	typedef struct
+	{
+		NDArray* frame;
+		uint64_t missing;
+	} xpcs_item;
+
+	/**
+	 * Correlator state for a contiguous share of the masked pixels, laid
+	 * out pixel by pixel so one frame touches each pixel's state once.
+	 * Whether a history slot holds a real value is the same for every
+	 * pixel, so valid, pairs and level_valid are kept once per worker.
+	 * lock is held while a frame is being processed. started is set once
+	 * the worker's thread exists, finish() only waits for those.
+	 */
+	typedef struct
+	{
+		size_t first;
+		size_t count;
+
+		std::deque<xpcs_item> queue;
+
+		epicsMutex lock;
+		epicsEvent wake;
+		epicsEvent done;
+
+		std::vector<float> history;
+		std::vector<double> products;
+		std::vector<double> sums;
+		std::vector<uint64_t> level_frames;
+		std::vector<uint8_t> valid;
+		std::vector<uint64_t> pairs;
+		std::vector<uint64_t> level_valid;
+
+		std::vector<uint8_t> present;
+		std::vector<int> steps;
+		std::vector<int> num_steps;
+
+		uint64_t frames;
+		bool stopping;
+		bool started;
+	} xpcs_worker;
+
+	bool loadMask(const std::string& maskPath);
+	void enqueue(NDArray* frame, uint64_t missing);
+	void process(xpcs_worker& worker, const NDArray* frame);
+	int advance(xpcs_worker& worker, bool present);
+	void miss(xpcs_worker& worker, uint64_t count);
+
+	template <typename T>
+	void correlate(xpcs_worker& worker, const T* data);
+
+	std::string error_msg;
+
+	size_t width;
+	size_t height;
+	int channels;
+	int levels;
+	int num_rings = 0;
+
+	std::vector<uint32_t> pixels;
+	std::vector<uint16_t> rings;
+	std::vector<uint32_t> lags;
+	std::vector<int> lag_level;
+	std::vector<int> lag_steps;
+	std::vector<int> level_first_lag;
+
+	std::vector< std::unique_ptr<xpcs_worker> > workers;
+
+	epicsMutex lock;
+	uint64_t dropped = 0;
+	uint64_t missing = 0;
+	bool finished = false;
+};
+
+#endif
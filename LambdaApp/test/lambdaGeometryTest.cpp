@@ -0,0 +1,129 @@
+/**
+ Copyright (c) 2015, UChicago Argonne, LLC
+ See LICENSE file.
+ */
+/* lambdaGeometryTest.cpp
+ *
+ * Checks that the spread ops compiled from a remap table hand out every
+ * count of a split pixel exactly once.
+ *
+ */
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include <epicsUnitTest.h>
+#include <testMain.h>
+
+#include "LambdaGeometry.h"
+
+static const int FRAME_WIDTH = 4;
+static const int FRAME_HEIGHT = 2;
+
+/*
+ * Pixel (1,0) is split in three, (2,0) in two with weights that don't sum
+ * to 1, (3,0) shares its destination with (0,1) and everything else moves
+ * one to one.
+ */
+static const char TABLE[] =
+	"size 8 2\n"
+	"module 0\n"
+	"0 0 0 0\n"
+	"1 0 1 0 0.3333\n"
+	"1 0 2 0 0.3333\n"
+	"1 0 3 0 0.3333\n"
+	"2 0 4 0 0.3\n"
+	"2 0 5 0 0.6\n"
+	"3 0 6 0\n"
+	"0 1 6 0\n"
+	"1 1 1 1\n"
+	"2 1 2 1\n"
+	"3 1 3 1\n";
+
+static std::string writeTable()
+{
+	char path[] = "/tmp/lambdaGeometryTestXXXXXX";
+	int fd = mkstemp(path);
+
+	FILE* fp = fdopen(fd, "w");
+	fputs(TABLE, fp);
+	fclose(fp);
+
+	return path;
+}
+
+/*
+ * Applies the compiled map the same way the driver does and returns the
+ * stitched pixels
+ */
+static std::vector<uint32_t> remap(const lambda_module_map& map, const std::vector<uint32_t>& in, int size)
+{
+	std::vector<uint32_t> out(size, 0);
+
+	for (const auto& run : map.runs)
+	{
+		for (uint32_t index = 0; index < run.length; index += 1)    { out[run.dst + index] = in[run.src + index]; }
+	}
+
+	uint32_t given = 0;
+
+	for (const auto& op : map.spreads)    { out[op.dst] += lambdaSpreadShare(op, in[op.src], &given); }
+
+	return out;
+}
+
+static uint64_t total(const std::vector<uint32_t>& pixels, size_t first, size_t last)
+{
+	uint64_t output = 0;
+
+	for (size_t index = first; index < last; index += 1)    { output += pixels[index]; }
+
+	return output;
+}
+
+MAIN(lambdaGeometryTest)
+{
+	testPlan(7);
+
+	std::string path = writeTable();
+	LambdaGeometry geometry(path);
+	remove(path.c_str());
+
+	testOk(geometry.isValid(), "table parses: %s", geometry.error().c_str());
+	testOk1(geometry.compile(0, FRAME_WIDTH, FRAME_HEIGHT));
+
+	const lambda_module_map* map = geometry.module(0);
+
+	testOk1(map != NULL);
+
+	if (map == NULL)    { return testDone(); }
+
+	const int size = geometry.width() * geometry.height();
+
+	bool conserved = true, split = true, shared = true;
+
+	for (uint32_t value = 0; value < 5000; value += 1)
+	{
+		std::vector<uint32_t> in(FRAME_WIDTH * FRAME_HEIGHT);
+
+		for (size_t index = 0; index < in.size(); index += 1)    { in[index] = value * (index + 1) + index; }
+
+		std::vector<uint32_t> out = remap(*map, in, size);
+
+		conserved = conserved && (total(out, 0, size) == total(in, 0, in.size()));
+		split = split && (total(out, 1, 4) == in[1]) && (total(out, 4, 6) == in[2]);
+		shared = shared && (out[6] == in[3] + in[4]);
+	}
+
+	testOk(conserved, "total counts are conserved");
+	testOk(split, "split pixels hand out exactly their value");
+	testOk(shared, "a shared destination gets both sources");
+
+	std::vector<uint32_t> in(FRAME_WIDTH * FRAME_HEIGHT, 0xFFFFFF);
+	std::vector<uint32_t> out = remap(*map, in, size);
+
+	testOk(total(out, 1, 4) == 0xFFFFFF, "24 bit counts split without overflow or loss");
+
+	return testDone();
+}
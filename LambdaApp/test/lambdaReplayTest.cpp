@@ -0,0 +1,199 @@
+/**
+ Copyright (c) 2015, UChicago Argonne, LLC
+ See LICENSE file.
+ */
+/* lambdaReplayTest.cpp
+ *
+ * Records a two-decoder layout with LambdaRawRecorder, replays it with
+ * LambdaReplayReceiver and checks that frames, statuses and the placement
+ * of each decoder in the stitched image survive the round trip.
+ *
+ */
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+#include <epicsUnitTest.h>
+#include <testMain.h>
+
+#include "LambdaRawRecorder.h"
+#include "LambdaReplayReceiver.h"
+
+static const int FRAME_WIDTH = 4;
+static const int FRAME_HEIGHT = 2;
+static const int NUM_DECODERS = 2;
+static const int NUM_FRAMES = 3;
+
+static const int IMAGE_WIDTH = FRAME_WIDTH * NUM_DECODERS;
+static const int IMAGE_HEIGHT = FRAME_HEIGHT;
+
+/*
+ * The second decoder sits to the right of the first, as a
+ * LambdaDecoderOffset of (FRAME_WIDTH, 0) places it. Its receivers would
+ * report no position at all.
+ */
+static const int POSITIONS[NUM_DECODERS][2] = { { 0, 0 }, { FRAME_WIDTH, 0 } };
+
+static uint16_t pixelValue(int decoder, int frame_no, int pixel)
+{
+	return (uint16_t) (decoder * 1000 + frame_no * 10 + pixel);
+}
+
+static uint32_t frameStatus(int decoder, int frame_no)
+{
+	return (decoder == 1 && frame_no == 2) ? 1 : 0;
+}
+
+/*
+ * Copies a decoder's frame into the stitched image at its position, the
+ * way the driver does for inputs without a remap table
+ */
+static void place(std::vector<uint16_t>& image, const uint16_t* frame, int x, int y)
+{
+	for (int row = 0; row < FRAME_HEIGHT; row += 1)
+	{
+		std::memcpy(&image[(y + row) * IMAGE_WIDTH + x], &frame[row * FRAME_WIDTH], FRAME_WIDTH * sizeof(uint16_t));
+	}
+}
+
+static std::vector<uint16_t> expectedImage(int frame_no)
+{
+	std::vector<uint16_t> image(IMAGE_WIDTH * IMAGE_HEIGHT, 0);
+
+	for (int decoder = 0; decoder < NUM_DECODERS; decoder += 1)
+	{
+		std::vector<uint16_t> frame(FRAME_WIDTH * FRAME_HEIGHT);
+
+		for (int pixel = 0; pixel < FRAME_WIDTH * FRAME_HEIGHT; pixel += 1)    { frame[pixel] = pixelValue(decoder, frame_no, pixel); }
+
+		place(image, frame.data(), POSITIONS[decoder][0], POSITIONS[decoder][1]);
+	}
+
+	return image;
+}
+
+MAIN(lambdaReplayTest)
+{
+	testPlan(12);
+
+	char directory[] = "/tmp/lambdaReplayTestXXXXXX";
+
+	if (mkdtemp(directory) == NULL)
+	{
+		testAbort("couldn't create a scratch directory");
+	}
+
+	std::vector<std::string> names;
+
+	for (int decoder = 0; decoder < NUM_DECODERS; decoder += 1)
+	{
+		names.push_back(std::string(directory) + "/replay_m" + std::to_string(decoder));
+	}
+
+	// Record
+	bool opened = true, written = true;
+
+	for (int decoder = 0; decoder < NUM_DECODERS; decoder += 1)
+	{
+		lambda_raw_header header;
+		std::memset(&header, 0, sizeof(lambda_raw_header));
+
+		header.module           = decoder;
+		header.width            = FRAME_WIDTH;
+		header.height           = FRAME_HEIGHT;
+		header.bytes_per_pixel  = sizeof(uint16_t);
+		header.bit_depth        = 12;
+		header.frames_per_image = 1;
+		header.frame_bytes      = FRAME_WIDTH * FRAME_HEIGHT * sizeof(uint16_t);
+		header.x_position       = POSITIONS[decoder][0];
+		header.y_position       = POSITIONS[decoder][1];
+
+		LambdaRawRecorder recorder(names[decoder], header, NUM_FRAMES);
+
+		opened = opened && recorder.isOpen();
+
+		if (! recorder.isOpen())    { continue; }
+
+		for (int frame_no = 1; frame_no <= NUM_FRAMES; frame_no += 1)
+		{
+			uint16_t frame[FRAME_WIDTH * FRAME_HEIGHT];
+
+			for (int pixel = 0; pixel < FRAME_WIDTH * FRAME_HEIGHT; pixel += 1)    { frame[pixel] = pixelValue(decoder, frame_no, pixel); }
+
+			recorder.write(frame, frame_no, frameStatus(decoder, frame_no));
+		}
+
+		recorder.finish();
+
+		written = written && recorder.error().empty() && recorder.framesWritten() == NUM_FRAMES;
+	}
+
+	testOk(opened, "both recordings open");
+	testOk(written, "every frame is written without error");
+
+	// Replay
+	std::vector<LambdaReplayReceiver*> replays;
+
+	for (int decoder = 0; decoder < NUM_DECODERS; decoder += 1)
+	{
+		replays.push_back(new LambdaReplayReceiver(names[decoder], false));
+	}
+
+	testOk(replays[0]->isOpen() && replays[1]->isOpen(), "both recordings replay: %s", replays[0]->error().c_str());
+	testOk(replays[0]->xPosition() == POSITIONS[0][0] && replays[0]->yPosition() == POSITIONS[0][1], "first decoder keeps its position");
+	testOk(replays[1]->xPosition() == POSITIONS[1][0] && replays[1]->yPosition() == POSITIONS[1][1], "second decoder keeps its offset");
+	testOk(replays[1]->frameWidth() == FRAME_WIDTH && replays[1]->frameHeight() == FRAME_HEIGHT, "frame size survives");
+	testOk(replays[1]->bitDepth() == 12 && ! replays[1]->dualMode(), "bit depth and counter mode survive");
+	testOk(replays[0]->framesRecorded() == NUM_FRAMES && replays[1]->framesRecorded() == NUM_FRAMES, "index holds every frame");
+
+	for (auto replay : replays)    { replay->start(); }
+
+	bool numbered = true, statuses = true, stitched = true, complete = true;
+
+	for (int frame_no = 1; frame_no <= NUM_FRAMES; frame_no += 1)
+	{
+		std::vector<uint16_t> image(IMAGE_WIDTH * IMAGE_HEIGHT, 0);
+
+		for (int decoder = 0; decoder < NUM_DECODERS; decoder += 1)
+		{
+			LambdaReplayReceiver* replay = replays[decoder];
+			LambdaReplayFrame* frame = replay->frame(1000);
+
+			if (frame == NULL)
+			{
+				complete = false;
+				continue;
+			}
+
+			numbered = numbered && (frame->nr() == (uint64_t) frame_no);
+			statuses = statuses && ((uint32_t) frame->status() == frameStatus(decoder, frame_no));
+
+			place(image, (const uint16_t*) frame->data(), replay->xPosition(), replay->yPosition());
+
+			replay->release(frame);
+		}
+
+		stitched = stitched && (image == expectedImage(frame_no));
+	}
+
+	testOk(complete, "every frame replays");
+	testOk(numbered, "frame numbers survive");
+	testOk(statuses, "frame statuses survive");
+	testOk(stitched, "replayed frames stitch to the recorded layout");
+
+	for (auto replay : replays)    { delete replay; }
+
+	for (const std::string& name : names)
+	{
+		std::remove((name + ".raw").c_str());
+		std::remove((name + ".idx").c_str());
+	}
+
+	rmdir(directory);
+
+	return testDone();
+}